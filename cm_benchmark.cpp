@@ -0,0 +1,456 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2022 Auterion, Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/**
+ * @file cm_benchmark.cpp
+ *
+ * In-process loopback benchmark. One master and N slaves run in the same process, connected through
+ * a mock "Loopback" connection driver on 127.0.0.x addresses, so no radio hardware is needed. Each slave
+ * uses its own loopback address and its own UDP port, the run is aborted if two slaves end up on the same
+ * port. Configuration files written during the run are removed on exit. Reports pairing & connect latency,
+ * reconfigure round trip, master message rate and CPU usage per vehicle as the number of vehicles grows.
+ *
+ * Usage: cm_benchmark [max_vehicles] [settle_seconds]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "connection_manager_master.h"
+#include "connection_manager_slave.h"
+#include "driver_registry.h"
+#include "link_layer_udp.h"
+#include "util.h"
+#include "utility/logging/logging_internal.h"
+
+using Clock = std::chrono::steady_clock;
+
+const std::string loopback_driver_name = "Loopback";
+
+const std::string loopback_settings_template = ""
+                                               R"({                           )"
+                                               R"(  "name" : "Loopback",      )"
+                                               R"(  "ip" : "127.0.0.1",       )"
+                                               R"(  "simplified" : true,      )"
+                                               R"(  "autopair" : true,        )"
+                                               R"(  "mavlink" : false,        )"
+                                               R"(  "connection" : {          )"
+                                               R"(    "channel" : "1"         )"
+                                               R"(  }                         )"
+                                               R"(})";
+
+const std::string loopback_pairing_settings = R"({ "channel" : "1" })";
+
+/**
+ * @brief Mock connection driver. Configuration always succeeds immediately and the driver is always connected.
+ */
+class ConnectionDriverLoopback : public ConnectionDriver {
+public:
+    bool init(const Json::Value& configuration) override
+    {
+        bool res = ConnectionDriver::init(configuration);
+        report_status(ConnectionStatusEnum::DRIVER_CONNECTED);
+        return res;
+    }
+
+    bool configure(const Json::Value& configuration) override
+    {
+        bool res = ConnectionDriver::configure(configuration);
+        report_status(ConnectionStatusEnum::DRIVER_CONNECTED);
+        return res;
+    }
+
+    void stop() override {}
+
+    bool get_broadcast_info(Json::Value& info) override
+    {
+        info[json_driver_ip] = get_local_ip();
+        return true;
+    }
+
+    std::string get_local_ip() override { return get_ip(); }
+
+    bool report_wired_status() override { return false; }
+
+    void get_pairing_settings(Json::Value& settings) override { string_to_json(loopback_pairing_settings, &settings); }
+
+    bool get_connection_settings(Json::Value& settings) override
+    {
+        std::lock_guard<std::mutex> lock(_configuration_mutex);
+        settings = _configuration[json_section_connection];
+        return true;
+    }
+};
+
+/**
+ * @brief Master that counts all received protocol messages
+ */
+class BenchmarkMaster : public ConnectionManagerMaster {
+public:
+    std::atomic<uint64_t> messages{0};
+
+protected:
+    bool message_received_filter(const Json::Value&) override
+    {
+        messages++;
+        return false;
+    }
+};
+
+/**
+ * @brief Slave exposing the UDP port its link layer is bound to
+ */
+class BenchmarkSlave : public ConnectionManagerSlave {
+public:
+    uint16_t local_port()
+    {
+        auto udp = std::dynamic_pointer_cast<LinkLayerUDP>(_link_layer);
+        return udp ? udp->get_local_port() : 0;
+    }
+};
+
+/**
+ * @brief Removes configuration files, both when registered and on destruction
+ */
+class BenchmarkFiles {
+public:
+    ~BenchmarkFiles()
+    {
+        for (const auto& file : _files) {
+            remove_configuration(file);
+        }
+    }
+
+    const std::string& add(const std::string& file)
+    {
+        remove_configuration(file);
+        _files.push_back(file);
+        return _files.back();
+    }
+
+private:
+    std::list<std::string> _files;
+
+    static void remove_configuration(const std::string& file)
+    {
+        std::remove(file.c_str());
+        std::remove((file + ".tmp").c_str());
+    }
+};
+
+static std::string make_config(const std::string& machine_name, const std::string& configuration_file, const std::string& ip, uint16_t port)
+{
+    return ""
+           R"({)"
+           R"("machine_name" : ")" +
+           machine_name +
+           R"(",)"
+           R"("port" : )" +
+           std::to_string(port) +
+           R"(,)"
+           R"("encryption_key" : "1234567890",)"
+           R"("link_layer" : "udp",)"
+           R"("configuration_file" : ")" +
+           configuration_file +
+           R"(",)"
+           R"("aes_encryption" : false,)"
+           R"("rsa_encryption" : true,)"
+           R"("drivers" : [)"
+           R"(  {)"
+           R"(    "name" : "Loopback",)"
+           R"(    "instance" : "Loopback",)"
+           R"(    "ip" : ")" +
+           ip +
+           R"(",)"
+           R"(    "simplified" : true,)"
+           R"(    "autopair" : true,)"
+           R"(    "mavlink" : false)"
+           R"(  })"
+           R"(])"
+           R"(})";
+}
+
+static std::string vehicle_name(size_t n)
+{
+    return "BenchVehicle" + std::to_string(n);
+}
+
+static std::string vehicle_ip(size_t n)
+{
+    // 127.0.0.1 is used by the master
+    n += 2;
+    return "127." + std::to_string(n / 65536 % 256) + "." + std::to_string(n / 256 % 256) + "." + std::to_string(n % 256);
+}
+
+static uint16_t vehicle_port(size_t n)
+{
+    // Keep clear of default_slave_port so that a slave ignoring the setting is detected as a collision
+    return static_cast<uint16_t>(default_slave_port + 1 + n);
+}
+
+static double ms_between(Clock::time_point a, Clock::time_point b)
+{
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+/**
+ * @brief Per vehicle timeline
+ */
+struct VehicleTimes {
+    Clock::time_point started;
+    Clock::time_point paired;
+    Clock::time_point connected;
+    bool is_paired = false;
+    bool is_connected = false;
+};
+
+struct Stats {
+    double min = 0;
+    double avg = 0;
+    double p95 = 0;
+    double max = 0;
+};
+
+static Stats compute_stats(std::vector<double> values)
+{
+    Stats s;
+    if (values.empty()) {
+        return s;
+    }
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (auto v : values) {
+        sum += v;
+    }
+    s.min = values.front();
+    s.max = values.back();
+    s.avg = sum / values.size();
+    s.p95 = values[std::min(values.size() - 1, values.size() * 95 / 100)];
+    return s;
+}
+
+static void print_stats(const std::string& name, const Stats& s)
+{
+    std::cout << std::setw(24) << name << std::fixed << std::setprecision(1) << std::setw(10) << s.min << std::setw(10) << s.avg
+              << std::setw(10) << s.p95 << std::setw(10) << s.max << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    spdlog::cfg::load_env_levels();
+
+    size_t max_vehicles = 500;
+    int settle_seconds = 10;
+    int val;
+    if (argc > 1 && atoi(argv[1], val) && val > 0) {
+        max_vehicles = static_cast<size_t>(val);
+    }
+    if (argc > 2 && atoi(argv[2], val) && val > 0) {
+        settle_seconds = val;
+    }
+
+    register_driver(loopback_driver_name, loopback_settings_template, loopback_pairing_settings, []() {
+        return std::make_unique<ConnectionDriverLoopback>();
+    });
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::string, VehicleTimes> times;
+    std::list<ConnectionStatus> status_list;
+
+    // Declared before master and slaves so that files are removed after they are stopped
+    BenchmarkFiles files;
+    BenchmarkMaster master;
+
+    master.register_paired_list_changed_callback([&] {
+        auto paired = master.get_paired_list();
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& name : paired) {
+            auto it = times.find(name);
+            if (it != times.end() && !it->second.is_paired) {
+                it->second.paired = now;
+                it->second.is_paired = true;
+            }
+        }
+        cv.notify_all();
+    });
+
+    master.register_connected_callback([&](const std::string& name) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = times.find(name);
+        if (it != times.end() && !it->second.is_connected) {
+            it->second.connected = now;
+            it->second.is_connected = true;
+        }
+        cv.notify_all();
+    });
+
+    master.register_status_callback([&](ConnectionStatus status) {
+        std::lock_guard<std::mutex> lock(mutex);
+        status_list.push_back(status);
+        cv.notify_all();
+    });
+
+    if (!master.init(make_config("BenchGCS", files.add("bench-master.json"), "127.0.0.1", default_master_port))) {
+        SPDLOG_ERROR("Could not initialize master");
+        return -1;
+    }
+    master.enter_pairing_mode();
+
+    std::vector<std::unique_ptr<BenchmarkSlave>> slaves;
+    std::set<uint16_t> slave_ports;
+    const std::vector<size_t> steps = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+
+    std::cout << std::left;
+    for (size_t step : steps) {
+        const size_t n = std::min(step, max_vehicles);
+        if (n <= slaves.size()) {
+            break;
+        }
+
+        const size_t first_new = slaves.size();
+        while (slaves.size() < n) {
+            const size_t i = slaves.size();
+            const std::string name = vehicle_name(i);
+            const std::string& file = files.add("bench-" + name + ".json");
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                times[name].started = Clock::now();
+            }
+            auto slave = std::make_unique<BenchmarkSlave>();
+            if (!slave->init(make_config(name, file, vehicle_ip(i), vehicle_port(i)))) {
+                SPDLOG_ERROR("Could not initialize slave {}", name);
+                return -1;
+            }
+            const uint16_t port = slave->local_port();
+            if (!slave_ports.insert(port).second) {
+                SPDLOG_ERROR("Slave {} shares UDP port {} with another slave", name, port);
+                return -1;
+            }
+            slave->enter_pairing_mode();
+            slaves.push_back(std::move(slave));
+        }
+
+        // Wait until all new vehicles are connected
+        bool all_connected;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            all_connected = cv.wait_for(lock, std::chrono::seconds(30 + n), [&] {
+                for (size_t i = first_new; i < n; i++) {
+                    if (!times[vehicle_name(i)].is_connected) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+        }
+
+        // Steady state message rate and CPU usage
+        const uint64_t messages_before = master.messages;
+        const std::clock_t cpu_before = std::clock();
+        const auto wall_before = Clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(settle_seconds));
+        const double wall_s = std::chrono::duration<double>(Clock::now() - wall_before).count();
+        const double cpu_s = static_cast<double>(std::clock() - cpu_before) / CLOCKS_PER_SEC;
+        const double message_rate = (master.messages - messages_before) / wall_s;
+
+        // Reconfigure round trip
+        double reconfigure_ms = -1;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            status_list.clear();
+        }
+        const std::string channel = std::to_string(1 + (n % 10));
+        const auto reconfigure_start = Clock::now();
+        master.reconfigure(R"({ "drivers" : [ { "instance" : "Loopback", "channel" : ")" + channel + R"(" } ] })");
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            bool reconfigured = cv.wait_for(lock, std::chrono::seconds(30), [&] {
+                for (const auto& s : status_list) {
+                    if (s.code == ConnectionStatusEnum::RECONFIGURED || s.code == ConnectionStatusEnum::ERROR_RECONFIGURING) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+            if (reconfigured) {
+                reconfigure_ms = ms_between(reconfigure_start, Clock::now());
+            }
+        }
+
+        std::vector<double> pairing_ms;
+        std::vector<double> connect_ms;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = first_new; i < n; i++) {
+                const auto& t = times[vehicle_name(i)];
+                if (t.is_paired) {
+                    pairing_ms.push_back(ms_between(t.started, t.paired));
+                    if (t.is_connected) {
+                        connect_ms.push_back(ms_between(t.paired, t.connected));
+                    }
+                }
+            }
+        }
+
+        std::cout << "==== " << n << " vehicles" << (all_connected ? "" : " (NOT ALL CONNECTED)") << std::endl;
+        std::cout << std::right << std::setw(24) << "" << std::setw(10) << "min" << std::setw(10) << "avg" << std::setw(10) << "p95"
+                  << std::setw(10) << "max" << std::endl;
+        print_stats("pairing latency", compute_stats(pairing_ms));
+        print_stats("connect latency", compute_stats(connect_ms));
+        std::cout << std::setw(24) << "reconfigure rtt" << std::setw(10) << reconfigure_ms << " ms" << std::endl;
+        std::cout << std::setw(24) << "master messages" << std::setw(10) << message_rate << " msg/s" << std::endl;
+        // Master and slaves share the process, so this is an upper bound for the master alone
+        std::cout << std::setw(24) << "cpu per vehicle" << std::setw(10) << 100.0 * cpu_s / wall_s / n << " %" << std::endl;
+        std::cout << std::left;
+    }
+
+    slaves.clear();
+    master.stop();
+
+    return 0;
+}
@@ -0,0 +1,1715 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2022 Auterion, Ltd. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/**
+ * @file cm_components_test.cpp
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/un.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "broadcast_cache.h"
+#include "deadline_queue.h"
+#include "driver_configurator.h"
+#include "event_loop.h"
+#include "icmp_prober.h"
+#include "link_layer_udp_batch.h"
+#include "link_quality.h"
+#include "lru_cache.h"
+#include "mavlink_forwarder.h"
+#include "message_codec.h"
+#include "message_header.h"
+#include "openssl_session.h"
+#include "pairing_journal.h"
+#include "receive_pipeline.h"
+#include "remote_transaction.h"
+#include "replay_window.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "usm.h"
+#include "utility/logging/async_logger.h"
+#include "utility/metrics/metrics.h"
+
+using namespace std::chrono_literals;
+
+TEST(DeadlineQueueTests, expires_in_deadline_order)
+{
+    DeadlineQueue<std::string> queue;
+    const auto now = std::chrono::steady_clock::now();
+    queue.schedule("c", now + 30ms);
+    queue.schedule("a", now + 10ms);
+    queue.schedule("b", now + 20ms);
+
+    DeadlineQueue<std::string>::TimePoint deadline;
+    ASSERT_TRUE(queue.next_deadline(deadline));
+    EXPECT_EQ(deadline, now + 10ms);
+
+    std::vector<std::string> expired;
+    EXPECT_EQ(queue.expire(now + 20ms, [&](const std::string& key) { expired.push_back(key); }), 2u);
+    EXPECT_EQ(expired, (std::vector<std::string>{"a", "b"}));
+    EXPECT_EQ(queue.size(), 1u);
+}
+
+TEST(DeadlineQueueTests, reschedule_and_cancel_invalidate_previous_deadline)
+{
+    DeadlineQueue<std::string> queue;
+    const auto now = std::chrono::steady_clock::now();
+    queue.schedule("a", now + 10ms);
+    queue.schedule("a", now + 50ms);
+    queue.schedule("b", now + 10ms);
+    queue.cancel("b");
+    EXPECT_EQ(queue.size(), 1u);
+
+    size_t calls = 0;
+    EXPECT_EQ(queue.expire(now + 20ms, [&](const std::string&) { calls++; }), 0u);
+    EXPECT_EQ(calls, 0u);
+
+    DeadlineQueue<std::string>::TimePoint deadline;
+    ASSERT_TRUE(queue.next_deadline(deadline));
+    EXPECT_EQ(deadline, now + 50ms);
+
+    queue.cancel("a");
+    EXPECT_FALSE(queue.next_deadline(deadline));
+}
+
+TEST(DeadlineQueueTests, callback_may_reschedule)
+{
+    DeadlineQueue<int> queue;
+    const auto now = std::chrono::steady_clock::now();
+    queue.schedule(1, now);
+    EXPECT_EQ(queue.expire(now, [&](const int& key) { queue.schedule(key, now + 10ms); }), 1u);
+    EXPECT_EQ(queue.size(), 1u);
+
+    // Many reschedules of one key trigger compaction without losing the active deadline
+    for (int i = 0; i < 1000; i++) {
+        queue.schedule(1, now + std::chrono::milliseconds(i));
+    }
+    EXPECT_EQ(queue.size(), 1u);
+    EXPECT_EQ(queue.expire(now + 998ms, [](const int&) {}), 0u);
+    EXPECT_EQ(queue.expire(now + 999ms, [](const int&) {}), 1u);
+    EXPECT_EQ(queue.size(), 0u);
+}
+
+static void remove_journal_files(const std::string& file)
+{
+    std::remove(file.c_str());
+    std::remove((file + ".journal").c_str());
+    std::remove((file + ".tmp").c_str());
+}
+
+TEST(EventLoopTests, remove_waits_for_running_callback)
+{
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    std::atomic<bool> entered{false};
+    std::atomic<bool> finished{false};
+    const auto timer = event_loop->add_timer(std::chrono::milliseconds(1), [&] {
+        entered = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        finished = true;
+    }, false);
+    ASSERT_NE(timer, EventLoop::invalid_handle);
+    while (!entered) {
+        std::this_thread::yield();
+    }
+    event_loop->remove(timer);
+    EXPECT_TRUE(finished);
+    event_loop->stop();
+}
+
+class TestConfigureDriver : public ConnectionDriver {
+public:
+    explicit TestConfigureDriver(const std::string& instance, bool result = true) : _result(result) { set_instance(instance); }
+
+    void stop() override {}
+    bool get_broadcast_info(Json::Value&) override { return false; }
+    std::string get_local_ip() override { return {}; }
+    bool report_wired_status() override { return false; }
+    void get_pairing_settings(Json::Value&) override {}
+    bool get_connection_settings(Json::Value&) override { return false; }
+
+    /**
+     * @brief Takes "delay_ms" of the configuration, or until release()
+     */
+    bool configure(const Json::Value& configuration) override
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        calls++;
+        max_running = std::max(max_running, ++_running);
+        _cv.wait_for(lock, std::chrono::milliseconds(configuration["delay_ms"].asInt()), [this] { return _released; });
+        _running--;
+        return _result;
+    }
+
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _released = true;
+        _cv.notify_all();
+    }
+
+    int calls = 0; // @brief Number of configure() calls, read after DriverConfigurator::wait_idle()
+    int max_running = 0; // @brief Most configure() calls running at once, read after DriverConfigurator::wait_idle()
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    const bool _result;
+    bool _released = false;
+    int _running = 0;
+};
+
+static Json::Value configure_delay(int delay_ms)
+{
+    Json::Value configuration;
+    configuration["delay_ms"] = delay_ms;
+    return configuration;
+}
+
+TEST(DriverConfiguratorTests, configures_slow_drivers_concurrently)
+{
+    DriverConfigurator configurator(std::chrono::milliseconds(2000));
+    std::list<DriverConfigurator::Request> requests;
+    for (int i = 0; i < 4; i++) {
+        requests.push_back({std::make_shared<TestConfigureDriver>("radio" + std::to_string(i)), configure_delay(200)});
+    }
+    std::map<std::string, DriverConfigurator::Result> results;
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(configurator.configure(requests, results));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(700));
+    ASSERT_EQ(results.size(), 4u);
+    for (const auto& result : results) {
+        EXPECT_TRUE(result.second.success);
+        EXPECT_FALSE(result.second.timed_out);
+        EXPECT_GE(result.second.duration, std::chrono::milliseconds(150));
+    }
+
+    requests.push_back({std::make_shared<TestConfigureDriver>("failing", false), configure_delay(0)});
+    EXPECT_FALSE(configurator.configure(requests, results));
+    EXPECT_FALSE(results["failing"].success);
+    EXPECT_TRUE(results["radio0"].success);
+    EXPECT_TRUE(configurator.wait_idle(std::chrono::milliseconds(1000)));
+}
+
+TEST(DriverConfiguratorTests, abandons_driver_on_timeout_and_reports_it_busy)
+{
+    DriverConfigurator configurator(std::chrono::milliseconds(200));
+    auto stuck = std::make_shared<TestConfigureDriver>("stuck");
+    auto fast = std::make_shared<TestConfigureDriver>("fast");
+    const std::list<DriverConfigurator::Request> requests = {{stuck, configure_delay(3600000)}, {fast, configure_delay(0)}};
+    std::map<std::string, DriverConfigurator::Result> results;
+
+    EXPECT_FALSE(configurator.configure(requests, results));
+    EXPECT_TRUE(results["stuck"].timed_out);
+    EXPECT_FALSE(results["stuck"].busy);
+    EXPECT_TRUE(results["fast"].success);
+    EXPECT_EQ(configurator.in_flight(), 1u);
+
+    // Busy driver does not hold back the others, and the call still ends at the timeout
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(configurator.configure(requests, results));
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_GE(elapsed, std::chrono::milliseconds(150));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(600));
+    EXPECT_TRUE(results["stuck"].busy);
+    EXPECT_TRUE(results["stuck"].timed_out);
+    EXPECT_TRUE(results["fast"].success);
+    EXPECT_LT(results["fast"].duration, std::chrono::milliseconds(100));
+
+    stuck->release();
+    EXPECT_TRUE(configurator.wait_idle(std::chrono::milliseconds(1000)));
+    EXPECT_EQ(stuck->calls, 1);
+    EXPECT_EQ(fast->calls, 2);
+}
+
+TEST(DriverConfiguratorTests, starts_busy_driver_once_abandoned_call_returns)
+{
+    DriverConfigurator configurator(std::chrono::milliseconds(300));
+    auto driver = std::make_shared<TestConfigureDriver>("radio");
+    std::map<std::string, DriverConfigurator::Result> results;
+    EXPECT_FALSE(configurator.configure({{driver, configure_delay(400)}}, results));
+    EXPECT_TRUE(results["radio"].timed_out);
+
+    // Abandoned call returns about 100 ms into this call, the new one starts then and finishes in time
+    EXPECT_TRUE(configurator.configure({{driver, configure_delay(0)}}, results));
+    EXPECT_TRUE(results["radio"].success);
+    EXPECT_FALSE(results["radio"].busy);
+    EXPECT_TRUE(configurator.wait_idle(std::chrono::milliseconds(1000)));
+    EXPECT_EQ(driver->calls, 2);
+    EXPECT_EQ(driver->max_running, 1);
+}
+
+TEST(IcmpProberTests, icmp_probe_reaches_loopback)
+{
+    IcmpProber prober;
+    ASSERT_TRUE(prober.init());
+    if (!prober.uses_icmp()) {
+        GTEST_SKIP() << "ICMP datagram sockets not permitted by net.ipv4.ping_group_range";
+    }
+    const auto results = prober.probe_all({"127.0.0.1", "not an address"}, 1000);
+    ASSERT_EQ(results.size(), 2u);
+    EXPECT_TRUE(results[0].reachable);
+    EXPECT_GE(results[0].rtt_ms, 0.f);
+    EXPECT_FALSE(results[1].reachable);
+    EXPECT_EQ(results[1].rtt_ms, -1.f);
+}
+
+TEST(IcmpProberTests, udp_probe_takes_port_unreachable_as_reachable)
+{
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    IcmpProber prober(false);
+    ASSERT_TRUE(prober.init(event_loop));
+    EXPECT_FALSE(prober.uses_icmp());
+
+    const auto results = prober.probe_all({"127.0.0.1", "127.0.0.2", "not an address"}, 1000);
+    ASSERT_EQ(results.size(), 3u);
+    EXPECT_EQ(results[0].address, "127.0.0.1");
+    EXPECT_TRUE(results[0].reachable);
+    EXPECT_TRUE(results[1].reachable);
+    EXPECT_LT(results[1].rtt_ms, 1000.f);
+    EXPECT_FALSE(results[2].reachable);
+    prober.stop();
+    event_loop->stop();
+}
+
+TEST(IcmpProberTests, unanswered_probe_times_out)
+{
+    for (bool try_icmp : {true, false}) {
+        IcmpProber prober(try_icmp);
+        ASSERT_TRUE(prober.init());
+        // Documentation address, nothing answers it
+        const auto start = std::chrono::steady_clock::now();
+        const auto result = prober.probe("192.0.2.123", 200).get();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        EXPECT_FALSE(result.reachable);
+        EXPECT_LT(elapsed, std::chrono::milliseconds(1000));
+
+        // Outstanding probes complete as not reachable on stop
+        auto pending = prober.probe("192.0.2.124", 10000);
+        prober.stop();
+        ASSERT_EQ(pending.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+        EXPECT_FALSE(pending.get().reachable);
+    }
+}
+
+TEST(PairingJournalTests, replays_records_and_drops_torn_tail)
+{
+    const std::string file = "journal-test.json";
+    remove_journal_files(file);
+    Json::Value configuration;
+    {
+        PairingJournal journal;
+        ASSERT_TRUE(journal.load(file, configuration));
+        Json::Value info;
+        info[json_driver_ip] = "10.0.0.2";
+        EXPECT_TRUE(journal.append_paired("vehicle1", info));
+        EXPECT_TRUE(journal.append_paired("vehicle2", info));
+        EXPECT_TRUE(journal.append_removed("vehicle1"));
+        EXPECT_TRUE(journal.append_value(json_last_connect, "vehicle2"));
+    }
+    {
+        // Record cut off by a crash during append
+        std::ofstream journal(file + ".journal", std::ios::app | std::ios::binary);
+        journal << "0badc0de {\"op\":\"removed\",\"machi";
+    }
+    PairingJournal journal;
+    ASSERT_TRUE(journal.load(file, configuration));
+    EXPECT_FALSE(configuration[json_journal_paired].isMember("vehicle1"));
+    EXPECT_EQ(configuration[json_journal_paired]["vehicle2"][json_driver_ip].asString(), "10.0.0.2");
+    EXPECT_EQ(configuration[json_last_connect].asString(), "vehicle2");
+
+    // Appends after the torn record must be replayable
+    EXPECT_TRUE(journal.append_removed("vehicle2"));
+    journal.close();
+    ASSERT_TRUE(journal.load(file, configuration));
+    EXPECT_FALSE(configuration[json_journal_paired].isMember("vehicle2"));
+    journal.close();
+    remove_journal_files(file);
+}
+
+TEST(PairingJournalTests, compaction_rewrites_configuration_and_truncates_journal)
+{
+    const std::string file = "journal-test.json";
+    remove_journal_files(file);
+    Json::Value configuration;
+    {
+        PairingJournal journal;
+        ASSERT_TRUE(journal.load(file, configuration));
+        for (size_t i = 0; i < PairingJournal::compaction_records + 1; i++) {
+            EXPECT_TRUE(journal.append_value(json_last_connect, "vehicle" + std::to_string(i)));
+        }
+    }
+    std::ifstream journal_file(file + ".journal", std::ios::binary | std::ios::ate);
+    EXPECT_LT(static_cast<size_t>(journal_file.tellg()), PairingJournal::compaction_records);
+
+    PairingJournal journal;
+    ASSERT_TRUE(journal.load(file, configuration));
+    EXPECT_EQ(configuration[json_last_connect].asString(), "vehicle" + std::to_string(PairingJournal::compaction_records));
+    journal.close();
+    remove_journal_files(file);
+}
+
+/**
+ * @brief Build MAVLink v2 frame with payload of payload_size zero bytes
+ */
+static std::string mavlink_frame(uint32_t msgid, uint8_t payload_size)
+{
+    std::string frame = {'\xFD', static_cast<char>(payload_size), 0, 0, 0, 1, 1, static_cast<char>(msgid & 0xFF),
+                         static_cast<char>((msgid >> 8) & 0xFF), static_cast<char>(msgid >> 16)};
+    frame.append(payload_size + 2, '\0');
+    return frame;
+}
+
+TEST(MavlinkCoalescerTests, flushes_at_byte_limit_on_frame_boundaries)
+{
+    std::vector<std::string> sent;
+    MavlinkCoalescer coalescer([&](const char* data, size_t size) { sent.emplace_back(data, size); });
+    coalescer.configure(100, 10, false);
+    const std::string frame = mavlink_frame(0, 18); // 30 bytes
+    ASSERT_EQ(frame.size(), 30u);
+
+    // Three frames fit, the fourth flushes them and starts the next datagram
+    coalescer.push((frame + frame).data(), 2 * frame.size());
+    coalescer.push((frame + frame).data(), 2 * frame.size());
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0], frame + frame + frame);
+    coalescer.flush();
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[1], frame);
+
+    // Frame larger than the limit is sent on its own, never split
+    const std::string large = mavlink_frame(0, 200);
+    coalescer.push(frame.data(), frame.size());
+    coalescer.push(large.data(), large.size());
+    ASSERT_EQ(sent.size(), 4u);
+    EXPECT_EQ(sent[2], frame);
+    EXPECT_EQ(sent[3], large);
+    EXPECT_EQ(coalescer.get_statistics().flushed_full, 3u);
+}
+
+TEST(MavlinkCoalescerTests, flushes_at_time_limit)
+{
+    std::vector<std::string> sent;
+    MavlinkCoalescer coalescer([&](const char* data, size_t size) { sent.emplace_back(data, size); });
+    EXPECT_TRUE(coalescer.configure([] {
+        Json::Value configuration;
+        configuration[json_coalesce_bytes] = "1200";
+        configuration[json_coalesce_ms] = 10;
+        return configuration;
+    }()));
+    const std::string frame = mavlink_frame(0, 10);
+    const auto start = std::chrono::steady_clock::now();
+    MavlinkCoalescer::TimePoint deadline;
+    EXPECT_FALSE(coalescer.next_flush(deadline));
+
+    coalescer.push(frame.data(), frame.size(), start);
+    coalescer.push(frame.data(), frame.size(), start + std::chrono::milliseconds(5));
+    ASSERT_TRUE(coalescer.next_flush(deadline));
+    EXPECT_EQ(deadline, start + std::chrono::milliseconds(10));
+    coalescer.poll(start + std::chrono::milliseconds(9));
+    EXPECT_TRUE(sent.empty());
+    coalescer.poll(start + std::chrono::milliseconds(10));
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0], frame + frame);
+    EXPECT_EQ(coalescer.get_statistics().flushed_timeout, 1u);
+    EXPECT_FALSE(coalescer.next_flush(deadline));
+}
+
+TEST(MavlinkCoalescerTests, nodelay_flushes_high_priority_frames)
+{
+    std::vector<std::string> sent;
+    MavlinkCoalescer coalescer([&](const char* data, size_t size) { sent.emplace_back(data, size); });
+    const std::string telemetry = mavlink_frame(0, 9);
+    const std::string command = mavlink_frame(76, 33);
+
+    coalescer.configure(1200, 50, false);
+    coalescer.push((telemetry + command).data(), telemetry.size() + command.size());
+    EXPECT_TRUE(sent.empty());
+    coalescer.flush();
+
+    coalescer.configure(1200, 50, true);
+    coalescer.push(telemetry.data(), telemetry.size());
+    coalescer.push(command.data(), command.size());
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[1], telemetry + command);
+    EXPECT_EQ(coalescer.get_statistics().flushed_nodelay, 1u);
+}
+
+TEST(MavlinkCoalescerTests, passes_through_malformed_input_in_order)
+{
+    std::vector<std::string> sent;
+    MavlinkCoalescer coalescer([&](const char* data, size_t size) { sent.emplace_back(data, size); });
+    const std::string frame = mavlink_frame(0, 10);
+    std::string v1(8 + 4, '\0');
+    v1[0] = '\xFE';
+    v1[1] = 4;
+    std::string signed_frame = mavlink_frame(0, 4) + std::string(13, '\0');
+    signed_frame[2] = 1;
+    uint32_t msgid;
+    EXPECT_EQ(MavlinkCoalescer::frame_length(v1.data(), v1.size(), msgid), v1.size());
+    EXPECT_EQ(MavlinkCoalescer::frame_length(signed_frame.data(), signed_frame.size(), msgid), signed_frame.size());
+    EXPECT_EQ(MavlinkCoalescer::frame_length(frame.data(), frame.size() - 1, msgid), 0u);
+
+    coalescer.configure(1200, 50, false);
+    const std::string datagram = v1 + signed_frame + frame.substr(0, 15);
+    coalescer.push(datagram.data(), datagram.size());
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[0], v1 + signed_frame);
+    EXPECT_EQ(sent[1], frame.substr(0, 15));
+    EXPECT_EQ(coalescer.get_statistics().malformed, 1u);
+
+    // Disabled coalescing forwards datagrams unchanged
+    coalescer.configure(0, 0, false);
+    coalescer.push("raw", 3);
+    ASSERT_EQ(sent.size(), 3u);
+    EXPECT_EQ(sent[2], "raw");
+}
+
+/**
+ * @brief Bound UDP socket on loopback with receive timeout
+ */
+static SOCKET open_test_socket(uint16_t& port)
+{
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    getsockname(sock, reinterpret_cast<sockaddr*>(&address), &length);
+    port = ntohs(address.sin_port);
+    timeval timeout{1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    return sock;
+}
+
+static void send_test_datagram(SOCKET sock, const std::string& data, uint16_t port)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    sendto(sock, data.data(), data.size(), 0, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+}
+
+static std::string receive_test_datagram(SOCKET sock)
+{
+    char buffer[2048];
+    const auto received = recv(sock, buffer, sizeof(buffer), 0);
+    return received > 0 ? std::string(buffer, static_cast<size_t>(received)) : std::string();
+}
+
+TEST(MavlinkForwarderTests, coalesces_towards_remote_and_returns_replies)
+{
+    uint16_t router_port;
+    uint16_t remote_port;
+    SOCKET router = open_test_socket(router_port);
+    SOCKET remote = open_test_socket(remote_port);
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    MavlinkForwarder forwarder(0, "127.0.0.1", remote_port);
+    Json::Value configuration;
+    configuration[json_coalesce_bytes] = 1200;
+    configuration[json_coalesce_ms] = 20;
+    ASSERT_TRUE(forwarder.configure(configuration));
+    ASSERT_TRUE(forwarder.init(event_loop));
+
+    // Reply before any local traffic has nowhere to go
+    send_test_datagram(remote, "early", forwarder.get_local_port());
+    const std::string frame = mavlink_frame(0, 20);
+    for (int i = 0; i < 3; i++) {
+        send_test_datagram(router, frame, forwarder.get_local_port());
+    }
+    EXPECT_EQ(receive_test_datagram(remote), frame + frame + frame);
+
+    const std::string reply = mavlink_frame(77, 3);
+    send_test_datagram(remote, reply, forwarder.get_local_port());
+    EXPECT_EQ(receive_test_datagram(router), reply);
+    forwarder.stop();
+    event_loop->stop();
+
+    const auto statistics = forwarder.get_statistics();
+    EXPECT_EQ(statistics.frames, 3u);
+    EXPECT_EQ(statistics.datagrams, 1u);
+    closesocket(router);
+    closesocket(remote);
+}
+
+TEST(MavlinkForwarderTests, forwards_unchanged_without_coalescing)
+{
+    uint16_t router_port;
+    uint16_t remote_port;
+    SOCKET router = open_test_socket(router_port);
+    SOCKET remote = open_test_socket(remote_port);
+    MavlinkForwarder forwarder(0, "127.0.0.1", remote_port);
+    ASSERT_TRUE(forwarder.init());
+    send_test_datagram(router, "first", forwarder.get_local_port());
+    send_test_datagram(router, "second", forwarder.get_local_port());
+    EXPECT_EQ(receive_test_datagram(remote), "first");
+    EXPECT_EQ(receive_test_datagram(remote), "second");
+    send_test_datagram(remote, "reply", forwarder.get_local_port());
+    EXPECT_EQ(receive_test_datagram(router), "reply");
+    forwarder.stop();
+    closesocket(router);
+    closesocket(remote);
+}
+
+static Json::Value codec_test_message()
+{
+    Json::Value message;
+    message[json_request] = json_pair;
+    message[json_machine_name] = "drone";
+    message[json_port] = 15540;
+    message[json_sequence] = Json::UInt64(1) << 40;
+    message["offset"] = -3;
+    message["ratio"] = 0.25;
+    message["enabled"] = true;
+    message["nothing"] = Json::Value();
+    message["unknown field"] = "kept by name";
+    message[json_drivers].append(Json::Value(Json::objectValue));
+    message[json_drivers][0][json_driver_name] = "radio";
+    message[json_drivers][0][json_driver_channel] = 36;
+    message[json_drivers].append("text");
+    return message;
+}
+
+TEST(MessageCodecTests, round_trips_both_encodings)
+{
+    const Json::Value message = codec_test_message();
+    for (auto encoding : {MessageEncoding::JSON, MessageEncoding::TLV}) {
+        std::string data;
+        ASSERT_TRUE(MessageCodec::encode(message, encoding, data));
+        EXPECT_EQ(MessageCodec::detect(data), encoding);
+        Json::Value decoded;
+        ASSERT_TRUE(MessageCodec::decode(data, decoded));
+        // jsoncpp reads JSON integers back as signed, so compare the text form
+        EXPECT_EQ(decoded.toStyledString(), message.toStyledString());
+        EXPECT_EQ(decoded["offset"].asInt(), -3);
+        EXPECT_EQ(decoded[json_sequence].asUInt64(), Json::UInt64(1) << 40);
+    }
+    // TLV keeps integer signedness
+    std::string data;
+    Json::Value decoded;
+    ASSERT_TRUE(MessageCodec::encode(message, MessageEncoding::TLV, data));
+    ASSERT_TRUE(MessageCodec::decode(data, decoded));
+    EXPECT_EQ(decoded, message);
+    EXPECT_FALSE(MessageCodec::encode(Json::Value(Json::arrayValue), MessageEncoding::TLV, data));
+    EXPECT_FALSE(MessageCodec::encode(Json::Value("text"), MessageEncoding::JSON, data));
+}
+
+TEST(MessageCodecTests, rejects_truncated_and_garbage_input)
+{
+    std::string data;
+    ASSERT_TRUE(MessageCodec::encode(codec_test_message(), MessageEncoding::TLV, data));
+    Json::Value decoded;
+    for (size_t length = 0; length < data.size(); length++) {
+        EXPECT_FALSE(MessageCodec::decode(data.substr(0, length), decoded)) << "length " << length;
+    }
+    EXPECT_FALSE(MessageCodec::decode(data + '\0', decoded));
+
+    const std::string header = {static_cast<char>(MessageCodec::tlv_magic), static_cast<char>(MessageCodec::tlv_version)};
+    // Wrong version, unknown type, unknown field index, counts larger than the message, not an object
+    EXPECT_FALSE(MessageCodec::decode(std::string{static_cast<char>(MessageCodec::tlv_magic), 9, 8, 0}, decoded));
+    EXPECT_FALSE(MessageCodec::decode(header + '\x42', decoded));
+    EXPECT_FALSE(MessageCodec::decode(header + std::string{8, 1, static_cast<char>(0xFF), 0}, decoded));
+    EXPECT_FALSE(MessageCodec::decode(header + std::string("\x08\xFF\xFF\xFF\xFF\x0F", 6), decoded));
+    EXPECT_FALSE(MessageCodec::decode(header + std::string("\x06\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01", 11), decoded));
+    EXPECT_FALSE(MessageCodec::decode(header + std::string(1, '\0'), decoded));
+    std::string deep = header;
+    for (int i = 0; i <= MessageCodec::max_depth + 1; i++) {
+        deep += std::string{8, 1, 0, 1, 'a'};
+    }
+    EXPECT_FALSE(MessageCodec::decode(deep + '\0', decoded));
+
+    EXPECT_FALSE(MessageCodec::decode("", decoded));
+    EXPECT_FALSE(MessageCodec::decode("{\"request\": ", decoded));
+    EXPECT_FALSE(MessageCodec::decode("[1, 2]", decoded));
+    EXPECT_FALSE(MessageCodec::decode("garbage", decoded));
+}
+
+TEST(MessageCodecTests, negotiates_first_known_encoding)
+{
+    Json::Value message;
+    EXPECT_EQ(MessageCodec::negotiate(message), MessageEncoding::JSON);
+    MessageCodec::advertise(message);
+    EXPECT_EQ(MessageCodec::negotiate(message), MessageEncoding::TLV);
+    message[json_encodings] = Json::Value(Json::arrayValue);
+    message[json_encodings].append("cbor");
+    message[json_encodings].append("json");
+    message[json_encodings].append("tlv");
+    EXPECT_EQ(MessageCodec::negotiate(message), MessageEncoding::JSON);
+}
+
+TEST(MessageHeaderTests, seals_and_verifies_datagrams)
+{
+    const std::string key = MessageHeader::derive_key("network");
+    MessageHeader header;
+    header.type = MessageHeader::PAIR_REQUEST;
+    header.sender_id = MessageHeader::sender_id_from_name("gcs");
+    header.sequence = 42;
+    std::string datagram;
+    ASSERT_TRUE(header.seal(key, "payload", datagram));
+
+    MessageHeader parsed;
+    ASSERT_TRUE(MessageHeader::parse(datagram, parsed));
+    EXPECT_EQ(parsed.type, MessageHeader::PAIR_REQUEST);
+    EXPECT_EQ(parsed.sender_id, header.sender_id);
+    EXPECT_EQ(parsed.sequence, 42u);
+    EXPECT_TRUE(parsed.verify(key, datagram));
+    EXPECT_FALSE(parsed.verify(MessageHeader::derive_key("other"), datagram));
+    datagram.back() ^= 1;
+    EXPECT_FALSE(parsed.verify(key, datagram));
+    EXPECT_FALSE(MessageHeader::parse("{\"request\":\"pair\"}", parsed));
+}
+
+TEST(MessageHeaderTests, tag_is_hmac_and_fails_closed)
+{
+    const std::string key = MessageHeader::derive_key("network");
+    ASSERT_EQ(key.size(), 32u);
+    MessageHeader header;
+    header.type = MessageHeader::STATUS;
+    header.sequence = 7;
+    std::string datagram;
+    ASSERT_TRUE(header.seal(key, "payload", datagram));
+
+    std::string zeroed = datagram;
+    std::fill(zeroed.begin() + MessageHeader::tag_offset,
+              zeroed.begin() + MessageHeader::tag_offset + MessageHeader::tag_size, '\0');
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    ASSERT_NE(HMAC(EVP_sha256(), key.data(), key.size(), reinterpret_cast<const unsigned char*>(zeroed.data()),
+                   zeroed.size(), mac, &length),
+              nullptr);
+    EXPECT_EQ(memcmp(datagram.data() + MessageHeader::tag_offset, mac, MessageHeader::tag_size), 0);
+
+    // A key that could not be derived must not verify anything, not even a tag computed without a key
+    MessageHeader parsed;
+    ASSERT_TRUE(MessageHeader::parse(datagram, parsed));
+    EXPECT_FALSE(parsed.verify("", datagram));
+    EXPECT_FALSE(header.seal("", "payload", datagram));
+    EXPECT_TRUE(datagram.empty());
+}
+
+TEST(MessageHeaderTests, policy_rejects_downgrades)
+{
+    MessageHeaderPolicy receiver("network");
+    MessageHeaderPolicy sender("network");
+    const uint64_t sender_id = MessageHeader::sender_id_from_name("vehicle");
+    MessageHeader header;
+    header.type = MessageHeader::CONNECT_REQUEST;
+    header.sender_id = sender_id;
+    std::string datagram;
+    MessageHeader parsed;
+
+    EXPECT_EQ(receiver.check("{}", "10.0.0.2:1", parsed), MessageHeaderPolicy::Verdict::LEGACY);
+    header.seal(sender.send_key(sender_id, header.flags), "payload", datagram);
+    EXPECT_EQ(receiver.check(datagram, "10.0.0.2:1", parsed), MessageHeaderPolicy::Verdict::ACCEPT);
+    // Origin sent a valid header, headerless datagrams from it are a downgrade
+    EXPECT_EQ(receiver.check("{}", "10.0.0.2:1", parsed), MessageHeaderPolicy::Verdict::REJECT);
+    EXPECT_EQ(receiver.check("{}", "10.0.0.3:1", parsed), MessageHeaderPolicy::Verdict::LEGACY);
+
+    // Once a session exists network key tags are no longer accepted from the sender
+    receiver.set_session_key(sender_id, "session");
+    EXPECT_EQ(receiver.check(datagram, "10.0.0.2:1", parsed), MessageHeaderPolicy::Verdict::REJECT);
+    sender.set_session_key(sender_id, "session");
+    header.seal(sender.send_key(sender_id, header.flags), "payload", datagram);
+    EXPECT_EQ(receiver.check(datagram, "10.0.0.2:1", parsed), MessageHeaderPolicy::Verdict::ACCEPT);
+    EXPECT_TRUE(parsed.flags & MessageHeader::SESSION_KEY);
+}
+
+static bool establish_sessions(OpenSSL_Session& initiator, OpenSSL_Session& responder)
+{
+    const std::string initiator_key = initiator.start();
+    const std::string responder_key = responder.start();
+    return initiator.derive(responder_key, true) && responder.derive(initiator_key, false);
+}
+
+TEST(OpenSSLSessionTests, encrypts_both_directions_and_rejects_tampering)
+{
+    OpenSSL_Session drone;
+    OpenSSL_Session ground;
+    EXPECT_TRUE(drone.encrypt("before session").empty());
+    ASSERT_TRUE(establish_sessions(drone, ground));
+
+    std::string cipher_text;
+    std::string plain_text;
+    for (int i = 0; i < 3; i++) {
+        const std::string message = "message " + std::to_string(i);
+        ASSERT_TRUE(drone.encrypt(message.data(), message.size(), cipher_text));
+        ASSERT_TRUE(ground.decrypt(cipher_text.data(), cipher_text.size(), plain_text));
+        EXPECT_EQ(plain_text, message);
+        EXPECT_EQ(drone.decrypt(ground.encrypt(message)), message);
+    }
+    cipher_text = drone.encrypt("tampered");
+    cipher_text[OpenSSL_Session::counter_size] ^= 1;
+    EXPECT_FALSE(ground.decrypt(cipher_text.data(), cipher_text.size(), plain_text));
+    cipher_text = drone.encrypt("shifted");
+    cipher_text[OpenSSL_Session::counter_size - 1] ^= 1;
+    EXPECT_FALSE(ground.decrypt(cipher_text.data(), cipher_text.size(), plain_text));
+    EXPECT_FALSE(ground.decrypt(cipher_text.data(), OpenSSL_Session::tag_size, plain_text));
+    EXPECT_TRUE(drone.needs_rekey(3, std::chrono::hours(1)));
+    EXPECT_FALSE(drone.needs_rekey(100, std::chrono::hours(1)));
+}
+
+TEST(OpenSSLSessionTests, rejects_replayed_messages)
+{
+    OpenSSL_Session drone;
+    OpenSSL_Session ground;
+    ASSERT_TRUE(establish_sessions(drone, ground));
+
+    const std::string first = drone.encrypt("first");
+    const std::string second = drone.encrypt("second");
+    EXPECT_EQ(ground.decrypt(second), "second");
+    EXPECT_EQ(ground.decrypt(first), "first");
+    EXPECT_TRUE(ground.decrypt(first).empty());
+    EXPECT_TRUE(ground.decrypt(second).empty());
+    EXPECT_EQ(ground.decrypt(drone.encrypt("third")), "third");
+}
+
+TEST(OpenSSLSessionTests, keeps_previous_key_until_remote_switches)
+{
+    OpenSSL_Session drone;
+    OpenSSL_Session ground;
+    ASSERT_TRUE(establish_sessions(drone, ground));
+    const std::string old_key_message = drone.encrypt("old key");
+    const std::string late_old_key_message = drone.encrypt("late old key");
+    EXPECT_EQ(ground.decrypt(drone.encrypt("before rekey")), "before rekey");
+
+    // Messages sent before the rekey still decrypt, once each
+    ASSERT_TRUE(establish_sessions(drone, ground));
+    EXPECT_EQ(ground.decrypt(old_key_message), "old key");
+    EXPECT_TRUE(ground.decrypt(old_key_message).empty());
+
+    // New key restarts the counter, first message under it retires the previous key
+    const std::string new_key_message = drone.encrypt("new key");
+    EXPECT_EQ(ground.decrypt(new_key_message), "new key");
+    EXPECT_TRUE(ground.decrypt(new_key_message).empty());
+    EXPECT_TRUE(ground.decrypt(late_old_key_message).empty());
+    EXPECT_EQ(drone.decrypt(ground.encrypt("reply")), "reply");
+
+    drone.reset();
+    EXPECT_FALSE(drone.established());
+    EXPECT_TRUE(drone.decrypt(ground.encrypt("after reset")).empty());
+}
+
+TEST(BroadcastCacheTests, hits_only_identical_verified_broadcasts)
+{
+    const std::string key = MessageHeader::derive_key("network");
+    BroadcastCache cache;
+    MessageHeader header;
+    header.type = MessageHeader::BROADCAST;
+    header.sender_id = MessageHeader::sender_id_from_name("vehicle");
+    std::string datagram;
+    header.seal(key, "encrypted broadcast", datagram);
+    Json::Value parsed;
+    parsed[json_request] = json_broadcast;
+
+    Json::Value cached;
+    EXPECT_FALSE(cache.find(header, datagram, cached));
+    cache.insert(header, datagram, parsed);
+
+    // Next period: same payload, new sequence
+    header.sequence++;
+    header.seal(key, "encrypted broadcast", datagram);
+    ASSERT_TRUE(cache.find(header, datagram, cached));
+    EXPECT_EQ(cached, parsed);
+
+    header.seal(key, "changed broadcast", datagram);
+    EXPECT_FALSE(cache.find(header, datagram, cached));
+    MessageHeader other = header;
+    other.sender_id = MessageHeader::sender_id_from_name("other");
+    other.seal(key, "encrypted broadcast", datagram);
+    EXPECT_FALSE(cache.find(other, datagram, cached));
+
+    header.type = MessageHeader::PAIR_REQUEST;
+    header.seal(key, "request", datagram);
+    cache.insert(header, datagram, parsed);
+    EXPECT_FALSE(cache.find(header, datagram, cached));
+    EXPECT_EQ(cache.hits(), 1u);
+}
+
+TEST(ReplayWindowTests, accepts_each_sequence_once)
+{
+    ReplayWindow<> window;
+    EXPECT_TRUE(window.update(100));
+    EXPECT_FALSE(window.update(100));
+    EXPECT_TRUE(window.update(99));
+    EXPECT_TRUE(window.update(105));
+    EXPECT_FALSE(window.check(99));
+    EXPECT_TRUE(window.check(101));
+    EXPECT_EQ(window.highest(), 105u);
+}
+
+TEST(ReplayWindowTests, rejects_sequences_past_window_edge)
+{
+    ReplayWindow<128> window;
+    EXPECT_TRUE(window.update(1000));
+    EXPECT_TRUE(window.update(1000 - ReplayWindow<128>::window + 1));
+    EXPECT_FALSE(window.update(1000 - ReplayWindow<128>::window + 1));
+    EXPECT_FALSE(window.check(1000 - ReplayWindow<128>::window));
+    EXPECT_FALSE(window.update(1000 - ReplayWindow<128>::window));
+
+    // A large jump forward clears the recycled blocks
+    EXPECT_TRUE(window.update(100000));
+    EXPECT_TRUE(window.update(100000 - 1));
+    EXPECT_FALSE(window.update(100000 - 1));
+
+    // A sender jumping back is indistinguishable from a replay, only reset() starts over
+    EXPECT_FALSE(window.update(0));
+    EXPECT_EQ(window.highest(), 100000u);
+    window.reset();
+    EXPECT_TRUE(window.update(0));
+    EXPECT_FALSE(window.update(0));
+    EXPECT_TRUE(window.update(1));
+}
+
+TEST(ReplayWindowTests, filter_resets_sender_on_handshake)
+{
+    ReplayFilter filter;
+    EXPECT_EQ(filter.next_sequence(), 0u);
+    EXPECT_EQ(filter.next_sequence(), 1u);
+    EXPECT_TRUE(filter.accept(1, 5));
+    EXPECT_FALSE(filter.accept(1, 5));
+    EXPECT_TRUE(filter.accept(2, 5));
+    filter.reset(1);
+    EXPECT_TRUE(filter.accept(1, 5));
+}
+
+TEST(LinkQualityTests, measures_loss_once_per_probe_and_ignores_silent_remotes)
+{
+    LinkQualityProber::Settings settings;
+    settings.period = std::chrono::milliseconds(20);
+    settings.timeout = std::chrono::milliseconds(15);
+    settings.train_length = 4;
+    settings.probe_size = 128;
+    LinkQualityProber* prober_pointer = nullptr;
+    std::atomic<int> probes{0};
+    // Remote at 10.0.0.1 echoes only the first probe of every train, twice. 10.0.0.2 never echoes.
+    LinkQualityProber prober(
+        [&](const Json::Value& probe, const std::string& ip, uint16_t) {
+            probes++;
+            Json::Value echo;
+            EXPECT_TRUE(LinkQualityProber::make_echo(probe, echo));
+            EXPECT_EQ(echo[json_probe_padding], probe[json_probe_padding]);
+            if (ip == "10.0.0.1" && probe[json_sequence].asUInt() % 4 == 0) {
+                prober_pointer->probe_received(echo, ip + ":5000");
+                prober_pointer->probe_received(echo, ip + ":5000");
+            }
+            return true;
+        },
+        settings);
+    prober_pointer = &prober;
+    prober.add_target("drone", "radio", "10.0.0.1", 5000);
+    prober.add_target("drone", "lte", "10.0.0.2", 5000);
+    prober.start();
+
+    LinkQuality quality;
+    for (int i = 0; i < 100 && !(prober.get("drone", "radio", quality) && quality.samples >= 3); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    prober.stop();
+    ASSERT_TRUE(prober.get("drone", "radio", quality));
+    EXPECT_GE(quality.samples, 3u);
+    EXPECT_NEAR(quality.loss, 0.75, 1e-9);
+    EXPECT_LT(quality.rtt_ms, 15);
+    EXPECT_FALSE(prober.get("drone", "lte", quality));
+    EXPECT_EQ(probes % 8, 0);
+
+    prober.remove_target("drone");
+    EXPECT_FALSE(prober.get("drone", "radio", quality));
+    Json::Value echo;
+    EXPECT_FALSE(LinkQualityProber::make_echo(Json::Value(), echo));
+}
+
+TEST(LinkQualityTests, scores_prefer_low_loss_and_rtt)
+{
+    LinkQuality good;
+    good.rtt_ms = 20;
+    good.samples = 1;
+    LinkQuality lossy = good;
+    lossy.loss = 0.2;
+    LinkQuality slow = good;
+    slow.rtt_ms = 400;
+    EXPECT_GT(LinkQualityProber::download_score(good), LinkQualityProber::download_score(lossy));
+    EXPECT_GT(LinkQualityProber::download_score(good), LinkQualityProber::download_score(slow));
+    EXPECT_GT(LinkQualityProber::streaming_score(good), LinkQualityProber::streaming_score(lossy));
+    EXPECT_GT(LinkQualityProber::streaming_score(good), LinkQualityProber::streaming_score(slow));
+    // Streaming punishes loss harder relative to downloads
+    EXPECT_LT(LinkQualityProber::streaming_score(lossy) / LinkQualityProber::streaming_score(good),
+        LinkQualityProber::download_score(lossy) / LinkQualityProber::download_score(good));
+}
+
+TEST(LruCacheTests, evicts_least_recently_used)
+{
+    LruCache<int, std::string> cache(2);
+    cache.insert(1, "one");
+    cache.insert(2, "two");
+    ASSERT_NE(cache.find(1), nullptr);
+    cache.insert(3, "three");
+
+    EXPECT_EQ(cache.size(), 2u);
+    EXPECT_EQ(cache.find(2), nullptr);
+    ASSERT_NE(cache.find(1), nullptr);
+    EXPECT_EQ(*cache.find(1), "one");
+    ASSERT_NE(cache.find(3), nullptr);
+}
+
+TEST(LruCacheTests, insert_replaces_and_erase_removes)
+{
+    LruCache<int, std::string> cache(0);
+    EXPECT_EQ(cache.capacity(), 1u);
+    cache.insert(1, "one");
+    cache.insert(1, "uno");
+    EXPECT_EQ(cache.size(), 1u);
+    EXPECT_EQ(*cache.find(1), "uno");
+    EXPECT_TRUE(cache.erase(1));
+    EXPECT_FALSE(cache.erase(1));
+    cache.insert(2, "two");
+    cache.clear();
+    EXPECT_EQ(cache.size(), 0u);
+    EXPECT_EQ(cache.find(2), nullptr);
+}
+
+TEST(SnapshotTests, readers_keep_value_across_publish)
+{
+    Snapshot<std::vector<int>, 2> snapshot({1});
+    {
+        auto first = snapshot.read();
+        snapshot.publish({2});
+        EXPECT_EQ(*first, std::vector<int>{1});
+        EXPECT_EQ(*snapshot.read(), std::vector<int>{2});
+    }
+    snapshot.publish({3});
+    EXPECT_EQ(snapshot.read()->front(), 3);
+}
+
+TEST(SnapshotTests, concurrent_readers_see_consistent_values)
+{
+    // Every published vector holds a single repeated value, a torn read would mix values
+    Snapshot<std::vector<int>> snapshot(std::vector<int>(64, 0));
+    std::atomic<bool> done{false};
+    std::atomic<size_t> torn{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&] {
+            while (!done) {
+                auto value = snapshot.read();
+                for (int v : *value) {
+                    if (v != value->front()) {
+                        torn++;
+                    }
+                }
+            }
+        });
+    }
+    for (int i = 1; i <= 2000; i++) {
+        snapshot.publish(std::vector<int>(64, i));
+    }
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+    EXPECT_EQ(torn, 0u);
+    EXPECT_EQ(snapshot.read()->front(), 2000);
+}
+
+enum TestState { S_IDLE, S_RUN, S_DONE };
+
+constexpr size_t test_state_count = S_DONE + 1;
+
+constexpr auto test_transition_table = usm::make_transition_table<TestState, test_state_count>({
+    {S_IDLE, usm::T_NEXT1, S_RUN},
+    {S_IDLE, usm::T_ERROR, S_IDLE},
+    {S_RUN, usm::T_NEXT1, S_DONE},
+    {S_RUN, usm::T_ERROR, S_IDLE},
+    {S_DONE, usm::T_NEXT1, S_IDLE},
+    {S_DONE, usm::T_ERROR, S_IDLE},
+});
+
+static_assert(test_transition_table.well_formed(), "Test table must be well formed");
+static_assert(test_transition_table.lookup(S_RUN, usm::T_NEXT1) == S_DONE, "Lookup must be usable at compile time");
+
+TEST(TransitionTableTests, lookup_and_validation)
+{
+    EXPECT_EQ(test_transition_table.lookup(S_IDLE, usm::T_NEXT1), S_RUN);
+    EXPECT_EQ(test_transition_table.lookup(S_RUN, usm::T_ERROR), S_IDLE);
+    EXPECT_TRUE(test_transition_table.error_transitions_complete());
+    EXPECT_TRUE(test_transition_table.all_reachable(S_IDLE));
+}
+
+TEST(TransitionTableTests, detects_invalid_tables)
+{
+    constexpr auto duplicate = usm::make_transition_table<TestState, test_state_count>({
+        {S_IDLE, usm::T_NEXT1, S_RUN},
+        {S_IDLE, usm::T_NEXT1, S_DONE},
+    });
+    EXPECT_FALSE(duplicate.well_formed());
+
+    constexpr auto repeat = usm::make_transition_table<TestState, test_state_count>({
+        {S_IDLE, usm::T_REPEAT, S_RUN},
+    });
+    EXPECT_FALSE(repeat.well_formed());
+
+    constexpr auto incomplete = usm::make_transition_table<TestState, test_state_count>({
+        {S_IDLE, usm::T_NEXT1, S_RUN},
+        {S_IDLE, usm::T_ERROR, S_IDLE},
+        {S_RUN, usm::T_ERROR, S_IDLE},
+    });
+    EXPECT_TRUE(incomplete.well_formed());
+    EXPECT_FALSE(incomplete.error_transitions_complete());
+    EXPECT_FALSE(incomplete.all_reachable(S_IDLE));
+}
+
+TEST(TransitionTableTests, unmapped_transitions_take_error_transition)
+{
+    // S_IDLE is state 0, a zero filled slot would silently map to it
+    constexpr auto table = usm::make_transition_table<TestState, test_state_count>({
+        {S_IDLE, usm::T_NEXT1, S_RUN},
+        {S_IDLE, usm::T_ERROR, S_IDLE},
+        {S_RUN, usm::T_NEXT1, S_DONE},
+        {S_RUN, usm::T_ERROR, S_DONE},
+        {S_DONE, usm::T_ERROR, S_RUN},
+    });
+    static_assert(table.lookup(S_RUN, usm::T_NEXT3) == S_DONE, "Fallback must be usable at compile time");
+    EXPECT_EQ(table.lookup(S_RUN, usm::T_NEXT2), S_DONE);
+    EXPECT_EQ(table.lookup(S_DONE, usm::T_NEXT1), S_RUN);
+    EXPECT_EQ(table.lookup(S_DONE, usm::T_NEXT4), S_RUN);
+    EXPECT_EQ(table.lookup(S_RUN, usm::T_REPEAT), S_RUN);
+    EXPECT_EQ(table.lookup(S_DONE, usm::T_REPEAT), S_DONE);
+}
+
+class TestTableMachine : public usm::TableStateMachine<TestTableMachine, TestState, test_transition_table> {
+public:
+    static constexpr usm::EventMask E_GO = 1 << 0;
+    static constexpr usm::EventMask E_OTHER = 1 << 1;
+
+    TestTableMachine() : TableStateMachine(S_IDLE) {}
+
+    std::atomic<bool> go{false};
+
+    usm::Transition run_current_state(TestState state)
+    {
+        if (state == S_IDLE && !go) {
+            wait_for_events(E_GO);
+            return usm::T_REPEAT;
+        }
+        return usm::T_NEXT1;
+    }
+
+    void on_transition(TestState, TestState, usm::Transition) {}
+
+    void print_transition(TestState, TestState, usm::Transition) const {}
+};
+
+TEST(TableStateMachineTests, waits_for_declared_event_and_records_it)
+{
+    TestTableMachine machine;
+    std::thread notifier([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        machine.notify_events(TestTableMachine::E_OTHER);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        machine.go = true;
+        machine.notify_events(TestTableMachine::E_GO);
+    });
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(machine.iterate_or_wait(std::chrono::seconds(5)));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(40));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+    notifier.join();
+    EXPECT_TRUE(machine.iterate_or_wait(std::chrono::seconds(5)));
+    EXPECT_EQ(machine.get_state(), S_RUN);
+
+    const auto records = machine.get_transition_trace().records();
+    ASSERT_EQ(records.size(), 1u);
+    EXPECT_EQ(records[0].from, S_IDLE);
+    EXPECT_EQ(records[0].to, S_RUN);
+    EXPECT_EQ(records[0].transition, usm::T_NEXT1);
+    EXPECT_EQ(records[0].events, TestTableMachine::E_GO);
+    usm::StateHistogram histogram;
+    ASSERT_TRUE(machine.get_transition_trace().histogram(S_IDLE, histogram));
+    EXPECT_EQ(histogram.count, 1u);
+}
+
+class TestEventMachine : public usm::EventStateMachine<TestState> {
+public:
+    TestEventMachine() : EventStateMachine(S_IDLE) {}
+
+    mutable std::vector<std::pair<TestState, TestState>> printed;
+
+protected:
+    usm::Transition run_current_state(TestState state) override { return state == S_DONE ? usm::T_REPEAT : usm::T_NEXT1; }
+
+    TestState choose_next_state(TestState state, usm::Transition) override { return state == S_IDLE ? S_RUN : S_DONE; }
+
+    void print_transition(TestState current, TestState next, usm::Transition) const override { printed.emplace_back(current, next); }
+};
+
+TEST(EventStateMachineTests, steps_through_virtual_states)
+{
+    TestEventMachine machine;
+    EXPECT_TRUE(machine.iterate_once());
+    EXPECT_TRUE(machine.iterate_or_wait(std::chrono::milliseconds(1)));
+    EXPECT_EQ(machine.get_state(), S_DONE);
+    EXPECT_FALSE(machine.iterate_or_wait(std::chrono::milliseconds(1)));
+    EXPECT_EQ(machine.get_state(), S_DONE);
+    ASSERT_EQ(machine.printed.size(), 2u);
+    EXPECT_EQ(machine.printed[1], std::make_pair(S_RUN, S_DONE));
+    EXPECT_EQ(machine.get_transition_trace().records().size(), 2u);
+}
+
+TEST(MetricsTests, shares_metrics_and_serializes_cumulative_buckets)
+{
+    connection_manager::utility::metrics::Registry registry;
+    registry.counter("cm_test_total", "Test counter", {{"instance", "a"}})->inc(2);
+    registry.counter("cm_test_total", "Test counter", {{"instance", "a"}})->inc();
+    // Same name with another type is not exported
+    registry.gauge("cm_test_total", "Conflicting gauge")->set(7);
+    auto histogram = registry.histogram("cm_test_seconds", "Test histogram", {}, {0.1, 1});
+    histogram->observe(0.05);
+    histogram->observe(std::chrono::milliseconds(500));
+    histogram->observe(2.0);
+
+    const std::string text = registry.serialize();
+    EXPECT_NE(text.find("# TYPE cm_test_total counter\ncm_test_total{instance=\"a\"} 3\n"), std::string::npos);
+    EXPECT_EQ(text.find("gauge"), std::string::npos);
+    EXPECT_NE(text.find("cm_test_seconds_bucket{le=\"0.1\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("cm_test_seconds_bucket{le=\"1\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find("cm_test_seconds_bucket{le=\"+Inf\"} 3\n"), std::string::npos);
+    EXPECT_NE(text.find("cm_test_seconds_count 3\n"), std::string::npos);
+}
+
+TEST(MetricsTests, replaces_only_stale_sockets_at_unix_path)
+{
+    const std::string path = "/tmp/cm_metrics_test.sock";
+    std::remove(path.c_str());
+    connection_manager::utility::metrics::Registry registry;
+
+    // Regular file is never removed
+    std::ofstream(path) << "keep";
+    EXPECT_FALSE(registry.serve("unix:" + path));
+    std::ifstream kept(path);
+    std::string content;
+    kept >> content;
+    EXPECT_EQ(content, "keep");
+    std::remove(path.c_str());
+
+    // Socket left behind by a previous process is replaced
+    SOCKET stale = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    ASSERT_EQ(bind(stale, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+    closesocket(stale);
+    EXPECT_TRUE(registry.serve("unix:" + path));
+    registry.stop();
+    std::remove(path.c_str());
+}
+
+TEST(LinkLayerUDPBatchTests, sends_and_receives_batches_over_loopback)
+{
+    std::mutex mutex;
+    std::vector<LinkLayerMessage> received;
+    LinkLayerUDPBatch receiver;
+    receiver.register_batch_message_callback([&](const std::vector<LinkLayerMessage>& batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        received.insert(received.end(), batch.begin(), batch.end());
+    });
+    ASSERT_TRUE(receiver.init());
+    LinkLayerUDPBatch sender;
+    ASSERT_TRUE(sender.init());
+
+    std::vector<LinkLayerUDPBatch::Datagram> datagrams;
+    for (int i = 0; i < 8; i++) {
+        datagrams.push_back({"message " + std::to_string(i), "127.0.0.1", receiver.get_local_port(), ""});
+    }
+    EXPECT_EQ(sender.send_batch(datagrams), 8u);
+    for (int i = 0; i < 200; i++) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (received.size() == 8) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    receiver.stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(received.size(), 8u);
+    EXPECT_EQ(received[0].message, "message 0");
+    EXPECT_EQ(received[0].from, "127.0.0.1");
+    EXPECT_EQ(receiver.get_batch_statistics().received, 8u);
+    const auto statistics = sender.get_batch_statistics();
+    EXPECT_EQ(statistics.sent, 8u);
+#ifdef __linux__
+    EXPECT_EQ(statistics.send_calls, 1u);
+    EXPECT_EQ(statistics.max_send_batch, 8u);
+#endif
+}
+
+TEST(LinkLayerUDPBatchTests, sends_multicast_fan_out_in_one_call)
+{
+    const std::string group = "239.255.0.1";
+    std::vector<std::string> interfaces;
+    ifaddrs* addresses = nullptr;
+    ASSERT_EQ(getifaddrs(&addresses), 0);
+    for (ifaddrs* entry = addresses; entry; entry = entry->ifa_next) {
+        if (entry->ifa_addr && entry->ifa_addr->sa_family == AF_INET && (entry->ifa_flags & IFF_UP)) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(entry->ifa_addr)->sin_addr, ip, sizeof(ip));
+            interfaces.push_back(ip);
+        }
+    }
+    freeifaddrs(addresses);
+
+    std::mutex mutex;
+    std::set<std::string> origins;
+    LinkLayerUDPBatch receiver(0, group);
+    receiver.register_batch_message_callback([&](const std::vector<LinkLayerMessage>& batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& message : batch) {
+            origins.insert(message.from);
+        }
+    });
+    ASSERT_TRUE(receiver.init());
+    LinkLayerUDPBatch sender(0, group);
+    ASSERT_TRUE(sender.init());
+    for (const auto& ip : interfaces) {
+        receiver.add_multicast_membership(ip);
+        sender.add_multicast_membership(ip);
+    }
+
+    Json::Value params;
+    params[json_port] = receiver.get_local_port();
+    const bool sent = sender.send("announce", params);
+    for (int i = 0; i < 50; i++) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (origins.size() == interfaces.size()) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    receiver.stop();
+    if (!sent) {
+        GTEST_SKIP() << "No multicast capable interface";
+    }
+
+    const auto statistics = sender.get_batch_statistics();
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_FALSE(origins.empty());
+    EXPECT_EQ(statistics.sent, origins.size());
+#ifdef __linux__
+    EXPECT_EQ(statistics.send_calls, 1u);
+#endif
+}
+
+TEST(LinkLayerUDPBatchTests, counts_unparsable_destinations_as_drops)
+{
+    auto drops = connection_manager::utility::metrics::Registry::instance().counter(
+        "cm_udp_drops_total", "Truncated received datagrams and failed sends");
+    LinkLayerUDPBatch link;
+    ASSERT_TRUE(link.init());
+    const uint64_t before = drops->value();
+
+    EXPECT_FALSE(link.send("message", "not an address", 1));
+    EXPECT_FALSE(link.send_multicast("message", "not an address", "239.255.0.1", 1));
+    EXPECT_EQ(link.send_batch({{"message", "not an address", 1, ""}, {"message", "127.0.0.1", link.get_local_port(), ""}}), 1u);
+    EXPECT_EQ(drops->value() - before, 3u);
+}
+
+TEST(LinkLayerUDPBatchTests, refuses_second_init)
+{
+    LinkLayerUDPBatch link;
+    ASSERT_TRUE(link.init());
+    const uint16_t port = link.get_local_port();
+    EXPECT_FALSE(link.init());
+    EXPECT_FALSE(link.init(std::make_shared<EventLoop>()));
+    EXPECT_EQ(link.get_local_port(), port);
+    link.stop();
+    EXPECT_TRUE(link.init());
+}
+
+TEST(ReceivePipelineTests, delivers_in_order_per_key)
+{
+    constexpr size_t workers = 4;
+    std::mutex mutex;
+    std::map<std::string, std::vector<int>> delivered;
+    std::atomic<bool> worker_in_range{true};
+    // Key by sender carried in the message, so one sender is ordered across addresses
+    ReceivePipeline pipeline(
+        [&](size_t worker, const std::string& msg, const std::string&, Json::Value& parsed) {
+            worker_in_range = worker_in_range && worker < workers;
+            const int index = std::stoi(msg.substr(2));
+            std::this_thread::sleep_for(std::chrono::microseconds((index * 7919) % 200));
+            parsed["sender"] = msg.substr(0, 1);
+            parsed["index"] = index;
+            return index % 10 != 9;
+        },
+        [&](const Json::Value& parsed, const std::string&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            delivered[parsed["sender"].asString()].push_back(parsed["index"].asInt());
+        },
+        [](const std::string& msg, const std::string&) { return msg.substr(0, 1); });
+    ASSERT_TRUE(pipeline.start(workers));
+    for (int i = 0; i < 200; i++) {
+        pipeline.submit(std::vector<LinkLayerMessage>{{"a " + std::to_string(i), "10.0.0.1:" + std::to_string(i % 3)},
+                                                      {"b " + std::to_string(i), "10.0.0.2:1"}});
+    }
+    for (int i = 0; i < 500; i++) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (delivered["a"].size() == 180 && delivered["b"].size() == 180) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    pipeline.stop();
+
+    EXPECT_TRUE(worker_in_range);
+    for (const auto& sender : {"a", "b"}) {
+        const auto& indexes = delivered[sender];
+        ASSERT_EQ(indexes.size(), 180u);
+        EXPECT_TRUE(std::is_sorted(indexes.begin(), indexes.end()));
+    }
+    EXPECT_EQ(pipeline.dropped(), 0u);
+}
+
+TEST(ReceivePipelineTests, processes_inline_on_event_loop)
+{
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    std::vector<std::string> delivered;
+    ReceivePipeline pipeline(
+        [](size_t worker, const std::string& msg, const std::string&, Json::Value& parsed) {
+            parsed = msg;
+            return worker == 0;
+        },
+        [&](const Json::Value& parsed, const std::string&) { delivered.push_back(parsed.asString()); });
+    ASSERT_TRUE(pipeline.start(event_loop));
+
+    std::atomic<bool> checked{false};
+    bool inline_delivered = false;
+    event_loop->add_timer(std::chrono::milliseconds(1), [&] {
+        pipeline.submit("first", "10.0.0.1:1");
+        inline_delivered = delivered.size() == 1;
+        checked = true;
+    }, false);
+    while (!checked) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pipeline.submit("second", "10.0.0.1:1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pipeline.stop();
+    event_loop->stop();
+
+    EXPECT_TRUE(inline_delivered);
+    EXPECT_EQ(delivered, (std::vector<std::string>{"first", "second"}));
+}
+
+class TestTransactionContext : public RemoteTransactionContext {
+public:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> requests;
+    std::map<std::string, bool> finished;
+    int configure_rounds = 0;
+    std::function<void(const std::string&)> on_finished; // @brief Called after a finish is recorded
+
+    bool configure_drivers_for(const std::string& section) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (section != _configured_section) {
+            _configured_section = section;
+            configure_rounds++;
+        }
+        return true;
+    }
+
+    void send_pairing_request(const std::string& name) override { add_request("pair " + name); }
+
+    bool send_connection_request(const std::string& name) override
+    {
+        add_request("connect " + name);
+        return true;
+    }
+
+    bool send_reconfigure_request(const std::string& name, const Json::Value&) override
+    {
+        add_request("reconfigure " + name);
+        return true;
+    }
+
+    void transaction_finished(const std::string& name, RemoteTransactionState, bool success) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished[name] = success;
+            cv.notify_all();
+        }
+        if (on_finished) {
+            on_finished(name);
+        }
+    }
+
+    bool wait_finished(size_t count)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, std::chrono::seconds(5), [&] { return finished.size() >= count; });
+    }
+
+    size_t count_requests(const std::string& request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::count(requests.begin(), requests.end(), request);
+    }
+
+private:
+    std::string _configured_section;
+
+    void add_request(const std::string& request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(request);
+    }
+};
+
+TEST(RemoteTransactionTests, remotes_pair_and_connect_in_parallel)
+{
+    TestTransactionContext context;
+    TransactionExecutor executor;
+    ASSERT_TRUE(executor.start(2));
+    std::vector<std::string> names = {"vehicle_1", "vehicle_2", "vehicle_3"};
+    for (const auto& name : names) {
+        executor.add(std::make_shared<RemoteTransaction>(name, context, std::chrono::milliseconds(20), 3));
+        executor.find(name)->pair();
+    }
+    for (const auto& name : names) {
+        while (context.count_requests("pair " + name) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        executor.notify(name, RemoteTransaction::E_PAIR_RESPONSE);
+    }
+    for (const auto& name : names) {
+        while (context.count_requests("connect " + name) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        executor.notify(name, RemoteTransaction::E_CONNECT_RESPONSE);
+    }
+    ASSERT_TRUE(context.wait_finished(names.size()));
+    executor.stop();
+
+    for (const auto& name : names) {
+        EXPECT_TRUE(context.finished[name]);
+        EXPECT_EQ(executor.find(name)->get_state(), R_IDLE);
+    }
+    EXPECT_LE(context.configure_rounds, 4);
+    const auto records = executor.find("vehicle_1")->get_transition_trace().records();
+    ASSERT_EQ(records.size(), 5u);
+    EXPECT_EQ(records[2].from, R_PAIR);
+    EXPECT_EQ(records[2].events, RemoteTransaction::E_PAIR_RESPONSE);
+    EXPECT_NE(executor.find("vehicle_1")->export_trace().find("R_CONFIG_CONNECT"), std::string::npos);
+}
+
+TEST(RemoteTransactionTests, request_is_repeated_until_retries_are_used_up)
+{
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    TestTransactionContext context;
+    TransactionExecutor executor;
+    ASSERT_TRUE(executor.start(event_loop));
+    executor.add(std::make_shared<RemoteTransaction>("vehicle", context, std::chrono::milliseconds(10), 3));
+    executor.find("vehicle")->connect();
+    ASSERT_TRUE(context.wait_finished(1));
+    executor.stop();
+    event_loop->stop();
+
+    EXPECT_FALSE(context.finished["vehicle"]);
+    EXPECT_EQ(context.count_requests("connect vehicle"), 3u);
+}
+
+TEST(RemoteTransactionTests, transaction_removes_itself_from_callback)
+{
+    for (const bool on_event_loop : {false, true}) {
+        auto event_loop = std::make_shared<EventLoop>();
+        ASSERT_TRUE(event_loop->init());
+        ASSERT_TRUE(event_loop->start());
+        TestTransactionContext context;
+        TransactionExecutor executor;
+        context.on_finished = [&executor](const std::string& name) { executor.remove(name); };
+        ASSERT_TRUE(on_event_loop ? executor.start(event_loop) : executor.start(2));
+        executor.add(std::make_shared<RemoteTransaction>("vehicle", context, std::chrono::milliseconds(5), 1));
+        executor.find("vehicle")->connect();
+        ASSERT_TRUE(context.wait_finished(1));
+        while (executor.find("vehicle")) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        executor.stop();
+        event_loop->stop();
+
+        EXPECT_FALSE(context.finished["vehicle"]);
+    }
+}
+
+TEST(TelemetryTests, sample_tracks_changed_fields)
+{
+    TelemetrySample sample;
+    Json::Value telemetry;
+    telemetry[json_driver_telemetry_rssi] = -60;
+    telemetry["channel"] = 36;
+    EXPECT_TRUE(sample.merge(telemetry));
+    sample.clear_changed();
+    EXPECT_FALSE(sample.merge(telemetry));
+
+    telemetry[json_driver_telemetry_rssi] = -61;
+    telemetry[json_driver_telemetry_snr] = 20;
+    EXPECT_TRUE(sample.merge(telemetry));
+    const Json::Value delta = sample.to_json(true);
+    EXPECT_EQ(delta.size(), 2u);
+    EXPECT_EQ(delta[json_driver_telemetry_rssi].asFloat(), -61.f);
+    EXPECT_EQ(delta[json_driver_telemetry_snr].asFloat(), 20.f);
+    EXPECT_EQ(sample.to_json()["channel"].asInt(), 36);
+}
+
+TEST(TelemetryTests, aggregator_coalesces_updates_on_event_loop)
+{
+    auto event_loop = std::make_shared<EventLoop>();
+    ASSERT_TRUE(event_loop->init());
+    ASSERT_TRUE(event_loop->start());
+    std::mutex mutex;
+    std::vector<std::map<std::string, TelemetrySample>> batches;
+    TelemetryAggregator aggregator;
+    ASSERT_TRUE(aggregator.start(event_loop, [&](const std::map<std::string, TelemetrySample>& samples) {
+        std::lock_guard<std::mutex> lock(mutex);
+        batches.push_back(samples);
+    }, std::chrono::milliseconds(100)));
+
+    for (int i = 0; i < 10; i++) {
+        Json::Value telemetry;
+        telemetry[json_driver_telemetry_rssi] = -50 - i;
+        aggregator.update("radio", telemetry);
+        aggregator.update("modem", telemetry);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    aggregator.stop();
+    event_loop->stop();
+
+    ASSERT_EQ(batches.size(), 1u);
+    EXPECT_EQ(batches[0].size(), 2u);
+    EXPECT_EQ(batches[0]["radio"].rssi, -59.f);
+}
+
+TEST(AsyncLoggerTests, drops_lines_when_ring_is_full)
+{
+    std::vector<std::string> lines;
+    connection_manager::utility::logging::AsyncLogger logger([&lines](const std::string& line) { lines.push_back(line); },
+                                                             nullptr, 4);
+    for (int i = 0; i < 6; i++) {
+        logger.log(std::to_string(i));
+    }
+    logger.flush();
+    logger.log("6");
+    logger.flush();
+
+    EXPECT_EQ(lines, (std::vector<std::string>{"0", "1", "2", "3", "6"}));
+    const auto statistics = logger.get_statistics();
+    EXPECT_EQ(statistics.logged, 5u);
+    EXPECT_EQ(statistics.dropped, 2u);
+    EXPECT_EQ(statistics.high_watermark, 4u);
+}
+
+TEST(AsyncLoggerTests, keeps_order_of_each_producer)
+{
+    constexpr int producers = 4;
+    constexpr int lines_per_producer = 20000;
+    std::vector<int> next(producers, 0);
+    bool in_order = true;
+    connection_manager::utility::logging::AsyncLogger logger(
+        [&](const std::string& line) {
+            const int producer = line[0] - '0';
+            const int index = std::stoi(line.substr(2));
+            in_order = in_order && index >= next[producer];
+            next[producer] = index + 1;
+        },
+        nullptr, 256);
+
+    std::atomic<bool> done{false};
+    std::thread consumer([&]() {
+        while (!done) {
+            logger.flush();
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&logger, p]() {
+            for (int i = 0; i < lines_per_producer; i++) {
+                logger.log(std::to_string(p) + " " + std::to_string(i));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    done = true;
+    consumer.join();
+    logger.flush();
+
+    EXPECT_TRUE(in_order);
+    const auto statistics = logger.get_statistics();
+    EXPECT_EQ(statistics.logged + statistics.dropped, static_cast<uint64_t>(producers * lines_per_producer));
+}
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
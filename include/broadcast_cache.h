@@ -0,0 +1,159 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file broadcast_cache.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "json.h"
+#include "lru_cache.h"
+#include "message_header.h"
+
+/**
+ * @brief Cache of parsed broadcasts keyed by sender and payload. Remotes re-send the same broadcast every
+ * broadcast period, only the header sequence and tag change, so a hit skips decryption and json parsing.
+ *
+ * Only datagrams whose header was verified are cached and looked up, the tag binds the payload to the
+ * sender, so a forged copy cannot hit. The whole payload is compared on a hit, a digest collision is a miss.
+ * The cached message is handed to the normal delivery path, filters and the pairing list still see every
+ * broadcast. Thread safe.
+ */
+class BroadcastCache {
+public:
+    static constexpr size_t default_capacity = 512;
+
+    /**
+     * @brief Constructor
+     * @param capacity number of cached broadcasts, least recently received are evicted
+     */
+    explicit BroadcastCache(size_t capacity = default_capacity) : _entries(capacity) {}
+
+    /**
+     * @brief Look up parsed broadcast
+     * @param header verified header of the datagram
+     * @param datagram received datagram
+     * @param parsed cached message on return
+     * @return false if datagram is not a cached broadcast
+     */
+    bool find(const MessageHeader& header, const std::string& datagram, Json::Value& parsed);
+
+    /**
+     * @brief Cache parsed broadcast. Other message types are ignored.
+     * @param header verified header of the datagram
+     * @param datagram received datagram
+     * @param parsed message parsed from the datagram
+     */
+    void insert(const MessageHeader& header, const std::string& datagram, const Json::Value& parsed);
+
+    /**
+     * @brief Drop cached broadcasts, e.g. when the encryption key changes
+     */
+    void clear();
+
+    uint64_t hits() const { return _hits; }
+
+    uint64_t misses() const { return _misses; }
+
+private:
+    /**
+     * @brief Cached broadcast
+     */
+    struct Entry {
+        uint64_t sender_id = 0; // @brief Sender id of the header
+        std::string payload; // @brief Datagram without header, compared on every hit
+        Json::Value parsed; // @brief Parsed message
+    };
+
+    std::mutex _mutex;
+    LruCache<uint64_t, Entry> _entries; // @brief Keyed by digest of sender id and payload
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+
+    /**
+     * @brief FNV-1a digest of sender id and payload, the header is skipped since its sequence changes on every send
+     */
+    static uint64_t digest(uint64_t sender_id, const std::string& datagram);
+
+    /**
+     * @brief Check if payload of datagram equals cached payload
+     */
+    static bool same_payload(const std::string& payload, const std::string& datagram);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool BroadcastCache::find(const MessageHeader& header, const std::string& datagram, Json::Value& parsed)
+{
+    if (header.type != MessageHeader::BROADCAST || datagram.size() < MessageHeader::size) {
+        return false;
+    }
+    const uint64_t key = digest(header.sender_id, datagram);
+    std::lock_guard<std::mutex> lock(_mutex);
+    const Entry* entry = _entries.find(key);
+    if (!entry || entry->sender_id != header.sender_id || !same_payload(entry->payload, datagram)) {
+        _misses++;
+        return false;
+    }
+    _hits++;
+    parsed = entry->parsed;
+    return true;
+}
+
+inline void BroadcastCache::insert(const MessageHeader& header, const std::string& datagram, const Json::Value& parsed)
+{
+    if (header.type != MessageHeader::BROADCAST || datagram.size() < MessageHeader::size) {
+        return;
+    }
+    Entry entry;
+    entry.sender_id = header.sender_id;
+    entry.payload = datagram.substr(MessageHeader::size);
+    entry.parsed = parsed;
+    const uint64_t key = digest(header.sender_id, datagram);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.insert(key, std::move(entry));
+}
+
+inline void BroadcastCache::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+}
+
+inline uint64_t BroadcastCache::digest(uint64_t sender_id, const std::string& datagram)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < 8; i++) {
+        hash ^= static_cast<uint8_t>(sender_id >> (8 * i));
+        hash *= 0x100000001b3ULL;
+    }
+    for (size_t i = MessageHeader::size; i < datagram.size(); i++) {
+        hash ^= static_cast<uint8_t>(datagram[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline bool BroadcastCache::same_payload(const std::string& payload, const std::string& datagram)
+{
+    return payload.size() == datagram.size() - MessageHeader::size
+           && datagram.compare(MessageHeader::size, std::string::npos, payload) == 0;
+}
@@ -0,0 +1,186 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file deadline_queue.h
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+/**
+ * @brief Min-heap of per-key deadlines. Each key has at most one active deadline, rescheduling a key
+ * invalidates its previous deadline. Invalidated entries are dropped lazily when they reach the top of
+ * the heap, or all at once when they outnumber active entries. Not thread safe, callers hold the lock
+ * of the map the keys belong to.
+ */
+template<typename Key>
+class DeadlineQueue {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    /**
+     * @brief Schedule or reschedule deadline for key
+     * @param key key to schedule
+     * @param deadline time at which key expires
+     */
+    void schedule(const Key& key, TimePoint deadline);
+
+    /**
+     * @brief Cancel deadline for key
+     * @param key key to cancel
+     */
+    void cancel(const Key& key);
+
+    /**
+     * @brief Pop all keys whose deadline has passed
+     * @param now current time
+     * @param expired called for each expired key
+     * @return number of expired keys
+     */
+    size_t expire(TimePoint now, const std::function<void(const Key&)>& expired);
+
+    /**
+     * @brief Get the earliest active deadline
+     * @param deadline set on return
+     * @return false if there are no active deadlines
+     */
+    bool next_deadline(TimePoint& deadline);
+
+    /**
+     * @brief Number of keys with active deadline
+     */
+    size_t size() const { return _generations.size(); }
+
+    void clear();
+
+private:
+    struct Entry {
+        TimePoint deadline;
+        uint64_t generation;
+        Key key;
+
+        bool operator>(const Entry& other) const { return deadline > other.deadline; }
+    };
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> _heap;
+    std::map<Key, uint64_t> _generations;
+    uint64_t _next_generation = 0;
+
+    /**
+     * @brief Check if heap entry is still the active deadline of its key
+     */
+    bool active(const Entry& entry) const;
+
+    /**
+     * @brief Drop invalidated entries from the top of the heap
+     */
+    void drop_stale();
+
+    /**
+     * @brief Rebuild heap from active entries only
+     */
+    void compact();
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+template<typename Key>
+void DeadlineQueue<Key>::schedule(const Key& key, TimePoint deadline)
+{
+    const uint64_t generation = _next_generation++;
+    _generations[key] = generation;
+    _heap.push(Entry{deadline, generation, key});
+    if (_heap.size() > 2 * _generations.size() + 64) {
+        compact();
+    }
+}
+
+template<typename Key>
+void DeadlineQueue<Key>::cancel(const Key& key)
+{
+    _generations.erase(key);
+    drop_stale();
+}
+
+template<typename Key>
+size_t DeadlineQueue<Key>::expire(TimePoint now, const std::function<void(const Key&)>& expired)
+{
+    size_t count = 0;
+    drop_stale();
+    while (!_heap.empty() && _heap.top().deadline <= now) {
+        const Key key = _heap.top().key;
+        _heap.pop();
+        _generations.erase(key);
+        count++;
+        // Callback may reschedule the key, so the entry is removed before calling it
+        expired(key);
+        drop_stale();
+    }
+    return count;
+}
+
+template<typename Key>
+bool DeadlineQueue<Key>::next_deadline(TimePoint& deadline)
+{
+    drop_stale();
+    if (_heap.empty()) {
+        return false;
+    }
+    deadline = _heap.top().deadline;
+    return true;
+}
+
+template<typename Key>
+void DeadlineQueue<Key>::clear()
+{
+    _heap = decltype(_heap)();
+    _generations.clear();
+}
+
+template<typename Key>
+bool DeadlineQueue<Key>::active(const Entry& entry) const
+{
+    auto it = _generations.find(entry.key);
+    return it != _generations.end() && it->second == entry.generation;
+}
+
+template<typename Key>
+void DeadlineQueue<Key>::drop_stale()
+{
+    while (!_heap.empty() && !active(_heap.top())) {
+        _heap.pop();
+    }
+}
+
+template<typename Key>
+void DeadlineQueue<Key>::compact()
+{
+    std::vector<Entry> entries;
+    entries.reserve(_generations.size());
+    while (!_heap.empty()) {
+        if (active(_heap.top())) {
+            entries.push_back(_heap.top());
+        }
+        _heap.pop();
+    }
+    _heap = decltype(_heap)(std::greater<Entry>(), std::move(entries));
+}
@@ -0,0 +1,260 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file driver_configurator.h
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "connection_driver.h"
+#include "json.h"
+#include "utility/metrics/metrics.h"
+
+/**
+ * @brief Configures several connection drivers concurrently, so configuring all of them takes as long as the
+ * slowest one instead of the sum. ConnectionDriver::configure() blocks and cannot be cancelled, so each call runs
+ * on its own thread and the configurator only bounds how long it waits.
+ *
+ * A driver whose configure() outlives the timeout is reported as timed out and its thread is abandoned: it keeps
+ * running in the background with its own reference to the driver, and its result is discarded. Until it returns,
+ * the driver stays in flight. A later configure() starts all idle drivers first and starts a driver with an
+ * abandoned call as soon as that call returns, all within one timeout. If the abandoned call is still running
+ * at the timeout, the driver is reported as busy and no second, concurrent configure() is started. Destroying the configurator does not wait for abandoned threads, so owners call wait_idle()
+ * before stopping the drivers.
+ *
+ * Drivers are tracked by identity, so all configures of a set of drivers must go through one configurator.
+ * Time spent in configure(), including abandoned calls, is recorded in cm_driver_configure_seconds and timeouts
+ * in cm_driver_configure_timeouts_total, both labeled with the driver instance. Thread safe.
+ */
+class DriverConfigurator {
+public:
+    static constexpr std::chrono::milliseconds default_timeout{30000};
+
+    /**
+     * @brief Driver with the configuration to apply
+     */
+    struct Request {
+        std::shared_ptr<ConnectionDriver> driver;
+        Json::Value configuration;
+    };
+
+    /**
+     * @brief Result of configuring a single driver instance
+     */
+    struct Result {
+        bool success = false; // @brief Driver reported successful configuration
+        bool timed_out = false; // @brief configure() did not return within the timeout and was abandoned
+        bool busy = false; // @brief Previous abandoned configure() was still running, driver was not configured
+        std::chrono::milliseconds duration{0}; // @brief Time spent configuring the driver
+    };
+
+    /**
+     * @brief Constructor
+     * @param timeout time to wait for all drivers of one configure() call
+     */
+    explicit DriverConfigurator(std::chrono::milliseconds timeout = default_timeout) : _timeout(timeout) {}
+
+    DriverConfigurator(const DriverConfigurator&) = delete;
+    DriverConfigurator& operator=(const DriverConfigurator&) = delete;
+
+    /**
+     * @brief Configure drivers concurrently and wait until all finished or the timeout passed
+     * @param requests drivers and their configurations
+     * @param results per driver instance results
+     * @return true if configuration of all drivers was successful
+     */
+    bool configure(const std::list<Request>& requests, std::map<std::string, Result>& results);
+
+    /**
+     * @brief Configure drivers concurrently and wait until all finished or the timeout passed
+     * @param requests drivers and their configurations
+     * @return true if configuration of all drivers was successful
+     */
+    bool configure(const std::list<Request>& requests);
+
+    /**
+     * @brief Wait until no configure() call is running, including abandoned ones
+     * @param timeout maximum time to wait
+     * @return true if no call is running
+     */
+    bool wait_idle(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Number of drivers with a running configure() call
+     */
+    size_t in_flight() const;
+
+private:
+    /**
+     * @brief State shared with configure threads, outlives the configurator while abandoned threads run
+     */
+    struct Shared {
+        struct Job {
+            bool done = false;
+            bool success = false;
+            std::chrono::milliseconds duration{0};
+        };
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::map<const ConnectionDriver*, uint64_t> in_flight; // @brief Driver to id of its running job
+        std::map<uint64_t, Job> awaited; // @brief Jobs a configure() call still waits for, abandoned jobs are erased
+        uint64_t next_job = 0;
+    };
+
+    const std::chrono::milliseconds _timeout;
+    std::shared_ptr<Shared> _shared = std::make_shared<Shared>();
+
+    /**
+     * @brief Start configure() of a driver on its own thread, called with the shared mutex held
+     * @param request driver and its configuration
+     * @param job id of the started job
+     * @return false if the thread could not be started
+     */
+    bool launch(const Request& request, uint64_t& job);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool DriverConfigurator::configure(const std::list<Request>& requests, std::map<std::string, Result>& results)
+{
+    const auto deadline = std::chrono::steady_clock::now() + _timeout;
+    std::map<std::string, uint64_t> jobs;
+    std::list<const Request*> busy;
+    bool success = true;
+    results.clear();
+
+    std::unique_lock<std::mutex> lock(_shared->mutex);
+    for (const auto& request : requests) {
+        if (request.driver) {
+            results[request.driver->instance()];
+            busy.push_back(&request);
+        }
+    }
+
+    // Start every idle driver right away, drivers still running an abandoned configure() start as soon as it
+    // returns. Never run two configure() calls on one driver.
+    for (;;) {
+        for (auto it = busy.begin(); it != busy.end();) {
+            const Request& request = **it;
+            if (_shared->in_flight.count(request.driver.get())) {
+                ++it;
+                continue;
+            }
+            uint64_t job;
+            if (launch(request, job)) {
+                jobs[request.driver->instance()] = job;
+            } else {
+                success = false;
+            }
+            it = busy.erase(it);
+        }
+        bool done = busy.empty();
+        for (const auto& j : jobs) {
+            done = done && _shared->awaited[j.second].done;
+        }
+        if (done || _shared->cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            break;
+        }
+    }
+
+    for (const Request* request : busy) {
+        Result& result = results[request->driver->instance()];
+        result.busy = true;
+        result.timed_out = true;
+        success = false;
+    }
+    for (const auto& j : jobs) {
+        Result& result = results[j.first];
+        const Shared::Job job = _shared->awaited[j.second];
+        // Abandoned threads find no entry and drop their result
+        _shared->awaited.erase(j.second);
+        if (!job.done) {
+            result.timed_out = true;
+            result.duration = _timeout;
+            success = false;
+            connection_manager::utility::metrics::Registry::instance()
+                .counter("cm_driver_configure_timeouts_total", "Driver configurations abandoned after timeout", {{"instance", j.first}})
+                ->inc();
+            continue;
+        }
+        result.success = job.success;
+        result.duration = job.duration;
+        success = success && job.success;
+    }
+    return success;
+}
+
+inline bool DriverConfigurator::launch(const Request& request, uint64_t& job)
+{
+    std::shared_ptr<Shared> shared = _shared;
+    const std::string instance = request.driver->instance();
+    job = shared->next_job++;
+    shared->in_flight[request.driver.get()] = job;
+    shared->awaited[job] = Shared::Job();
+    try {
+        std::thread([shared, job, instance, driver = request.driver, configuration = request.configuration] {
+            const auto start = std::chrono::steady_clock::now();
+            const bool res = driver->configure(configuration);
+            const auto duration = std::chrono::steady_clock::now() - start;
+            connection_manager::utility::metrics::Registry::instance()
+                .histogram("cm_driver_configure_seconds", "Time spent in ConnectionDriver::configure()", {{"instance", instance}})
+                ->observe(duration);
+            std::lock_guard<std::mutex> job_lock(shared->mutex);
+            shared->in_flight.erase(driver.get());
+            auto it = shared->awaited.find(job);
+            if (it != shared->awaited.end()) {
+                it->second.done = true;
+                it->second.success = res;
+                it->second.duration = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
+            }
+            shared->cv.notify_all();
+        }).detach();
+    } catch (const std::system_error&) {
+        shared->in_flight.erase(request.driver.get());
+        shared->awaited.erase(job);
+        return false;
+    }
+    return true;
+}
+
+inline bool DriverConfigurator::configure(const std::list<Request>& requests)
+{
+    std::map<std::string, Result> results;
+    return configure(requests, results);
+}
+
+inline bool DriverConfigurator::wait_idle(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(_shared->mutex);
+    return _shared->cv.wait_for(lock, timeout, [this] { return _shared->in_flight.empty(); });
+}
+
+inline size_t DriverConfigurator::in_flight() const
+{
+    std::lock_guard<std::mutex> lock(_shared->mutex);
+    return _shared->in_flight.size();
+}
@@ -0,0 +1,421 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file event_loop.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "sockets.h"
+
+/**
+ * @brief Single threaded reactor hosting sockets, timers and wakeups. Built on epoll, timerfd and eventfd.
+ * Components that accept an EventLoop register their sockets and timers here instead of starting their own
+ * threads, so one loop thread serves all of them. On platforms without epoll init() fails and components
+ * fall back to their own worker threads. Callbacks run on the loop thread and must not block.
+ */
+class EventLoop {
+public:
+    using Handle = uint64_t;
+
+    static constexpr Handle invalid_handle = 0;
+
+    /**
+     * @brief Constructor
+     */
+    EventLoop() = default;
+
+    /**
+     * @brief Destructor
+     */
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    /**
+     * @brief Create epoll instance and internal stop eventfd
+     * @return false if reactor is not supported on this platform
+     */
+    bool init();
+
+    /**
+     * @brief Start the loop thread
+     * @param thread_name name of the loop thread
+     * @return true if thread was started
+     */
+    bool start(const std::string& thread_name = "cm_event_loop");
+
+    /**
+     * @brief Stop the loop thread and close all registered timers and wakeups
+     */
+    void stop();
+
+    /**
+     * @brief Watch socket for readability
+     * @param fd socket to watch. Ownership stays with the caller.
+     * @param readable callback called from the loop thread when data can be read
+     * @return handle or invalid_handle on error
+     */
+    Handle add_socket(SOCKET fd, std::function<void()> readable);
+
+    /**
+     * @brief Add timer
+     * @param period timer period, also the time of the first expiration
+     * @param expired callback called from the loop thread on expiration
+     * @param periodic if false timer fires only once
+     * @return handle or invalid_handle on error
+     */
+    Handle add_timer(std::chrono::milliseconds period, std::function<void()> expired, bool periodic = true);
+
+    /**
+     * @brief Rearm existing timer with new period, keeping its periodic setting
+     * @param handle timer handle
+     * @param period new period
+     * @return true if timer exists
+     */
+    bool rearm_timer(Handle handle, std::chrono::milliseconds period);
+
+    /**
+     * @brief Add wakeup source that can be signalled from any thread
+     * @param woken callback called from the loop thread after wakeup() was called
+     * @return handle or invalid_handle on error
+     */
+    Handle add_wakeup(std::function<void()> woken);
+
+    /**
+     * @brief Signal wakeup source. Multiple signals before the loop runs are coalesced.
+     * @param handle wakeup handle
+     */
+    void wakeup(Handle handle);
+
+    /**
+     * @brief Remove socket, timer or wakeup source. Its callback is not called after remove() returns. If the
+     * callback is running on the loop thread, remove() waits for it to return, unless called from the loop thread.
+     * @param handle handle to remove
+     */
+    void remove(Handle handle);
+
+    /**
+     * @brief Check if called from the loop thread
+     * @return true if current thread is the loop thread
+     */
+    bool in_loop_thread() const { return std::this_thread::get_id() == _loop_thread_id; }
+
+private:
+    /**
+     * @brief Registered event source
+     */
+    struct Source {
+        int fd = -1; // @brief Watched file descriptor
+        bool owned = false; // @brief True for timerfd & eventfd that are closed on removal
+        bool periodic = false; // @brief Timer rearms itself after expiration
+        std::function<void()> callback; // @brief Called when fd becomes readable
+    };
+
+    int _epoll_fd = -1;
+    int _stop_fd = -1;
+    std::atomic<bool> _should_exit{false};
+    std::thread _loop_thread;
+    std::atomic<std::thread::id> _loop_thread_id{};
+    std::mutex _sources_mutex; // @brief Never held while a callback runs
+    std::map<Handle, Source> _sources;
+    Handle _running = invalid_handle; // @brief Source whose callback is running, guarded by _sources_mutex
+    std::condition_variable _callback_done;
+    Handle _next_handle = invalid_handle + 1;
+
+    /**
+     * @brief Loop thread worker
+     */
+    void worker();
+
+    /**
+     * @brief Register file descriptor in epoll
+     * @param fd file descriptor
+     * @param owned close the descriptor on removal
+     * @param periodic timer rearms itself
+     * @param callback readable callback
+     * @return handle or invalid_handle on error
+     */
+    Handle add_source(int fd, bool owned, bool periodic, std::function<void()> callback);
+
+    /**
+     * @brief Set timerfd expiration
+     * @return false on error
+     */
+    static bool set_timer(int fd, std::chrono::milliseconds period, bool periodic);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline EventLoop::~EventLoop()
+{
+    stop();
+#ifdef __linux__
+    if (_stop_fd >= 0) {
+        close(_stop_fd);
+    }
+    if (_epoll_fd >= 0) {
+        close(_epoll_fd);
+    }
+#endif
+}
+
+inline bool EventLoop::init()
+{
+#ifdef __linux__
+    if (_epoll_fd >= 0) {
+        return true;
+    }
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_epoll_fd < 0 || _stop_fd < 0) {
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = invalid_handle;
+    return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _stop_fd, &event) == 0;
+#else
+    return false;
+#endif
+}
+
+inline bool EventLoop::start(const std::string& thread_name)
+{
+    if (_epoll_fd < 0 || _loop_thread.joinable()) {
+        return false;
+    }
+    _should_exit = false;
+    _loop_thread = std::thread([this, thread_name] {
+        _loop_thread_id = std::this_thread::get_id();
+#ifdef __linux__
+        pthread_setname_np(pthread_self(), thread_name.substr(0, 15).c_str());
+#endif
+        worker();
+    });
+    return true;
+}
+
+inline void EventLoop::stop()
+{
+    _should_exit = true;
+#ifdef __linux__
+    if (_stop_fd >= 0) {
+        const uint64_t one = 1;
+        (void)!write(_stop_fd, &one, sizeof(one));
+    }
+#endif
+    if (_loop_thread.joinable() && !in_loop_thread()) {
+        _loop_thread.join();
+    }
+    std::map<Handle, Source> sources;
+    {
+        std::lock_guard<std::mutex> lock(_sources_mutex);
+        sources.swap(_sources);
+    }
+#ifdef __linux__
+    for (const auto& source : sources) {
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, source.second.fd, nullptr);
+        if (source.second.owned) {
+            close(source.second.fd);
+        }
+    }
+#endif
+}
+
+inline EventLoop::Handle EventLoop::add_source(int fd, bool owned, bool periodic, std::function<void()> callback)
+{
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(_sources_mutex);
+    const Handle handle = _next_handle++;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = handle;
+    if (_epoll_fd < 0 || epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        if (owned) {
+            close(fd);
+        }
+        return invalid_handle;
+    }
+    _sources[handle] = {fd, owned, periodic, std::move(callback)};
+    return handle;
+#else
+    (void)fd;
+    (void)owned;
+    (void)periodic;
+    (void)callback;
+    return invalid_handle;
+#endif
+}
+
+inline EventLoop::Handle EventLoop::add_socket(SOCKET fd, std::function<void()> readable)
+{
+    return add_source(static_cast<int>(fd), false, false, std::move(readable));
+}
+
+inline bool EventLoop::set_timer(int fd, std::chrono::milliseconds period, bool periodic)
+{
+#ifdef __linux__
+    // Zero it_value disarms timerfd, so the shortest timer is one nanosecond
+    const auto ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(period).count(), 1);
+    itimerspec spec{};
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (periodic) {
+        spec.it_interval = spec.it_value;
+    }
+    return timerfd_settime(fd, 0, &spec, nullptr) == 0;
+#else
+    (void)fd;
+    (void)period;
+    (void)periodic;
+    return false;
+#endif
+}
+
+inline EventLoop::Handle EventLoop::add_timer(std::chrono::milliseconds period, std::function<void()> expired, bool periodic)
+{
+#ifdef __linux__
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0 || !set_timer(fd, period, periodic)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return invalid_handle;
+    }
+    return add_source(fd, true, periodic, [fd, expired = std::move(expired)] {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            expired();
+        }
+    });
+#else
+    (void)period;
+    (void)expired;
+    (void)periodic;
+    return invalid_handle;
+#endif
+}
+
+inline bool EventLoop::rearm_timer(Handle handle, std::chrono::milliseconds period)
+{
+    std::lock_guard<std::mutex> lock(_sources_mutex);
+    auto it = _sources.find(handle);
+    return it != _sources.end() && set_timer(it->second.fd, period, it->second.periodic);
+}
+
+inline EventLoop::Handle EventLoop::add_wakeup(std::function<void()> woken)
+{
+#ifdef __linux__
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return invalid_handle;
+    }
+    return add_source(fd, true, false, [fd, woken = std::move(woken)] {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+            woken();
+        }
+    });
+#else
+    (void)woken;
+    return invalid_handle;
+#endif
+}
+
+inline void EventLoop::wakeup(Handle handle)
+{
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(_sources_mutex);
+    auto it = _sources.find(handle);
+    if (it != _sources.end()) {
+        const uint64_t one = 1;
+        (void)!write(it->second.fd, &one, sizeof(one));
+    }
+#else
+    (void)handle;
+#endif
+}
+
+inline void EventLoop::remove(Handle handle)
+{
+#ifdef __linux__
+    std::unique_lock<std::mutex> lock(_sources_mutex);
+    if (!in_loop_thread()) {
+        _callback_done.wait(lock, [this, handle] { return _running != handle; });
+    }
+    auto it = _sources.find(handle);
+    if (it == _sources.end()) {
+        return;
+    }
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    if (it->second.owned) {
+        close(it->second.fd);
+    }
+    _sources.erase(it);
+#else
+    (void)handle;
+#endif
+}
+
+inline void EventLoop::worker()
+{
+#ifdef __linux__
+    std::vector<epoll_event> events(64);
+    while (!_should_exit) {
+        const int count = epoll_wait(_epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+        for (int i = 0; i < count && !_should_exit; i++) {
+            std::function<void()> callback;
+            {
+                // Source may have been removed by an earlier callback of this round
+                std::lock_guard<std::mutex> lock(_sources_mutex);
+                auto it = _sources.find(events[i].data.u64);
+                if (it == _sources.end()) {
+                    continue;
+                }
+                callback = it->second.callback;
+                _running = it->first;
+            }
+            callback();
+            {
+                std::lock_guard<std::mutex> lock(_sources_mutex);
+                _running = invalid_handle;
+            }
+            _callback_done.notify_all();
+        }
+    }
+#endif
+}
@@ -0,0 +1,542 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file icmp_prober.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/ip_icmp.h>
+#include <poll.h>
+#endif
+
+#include "deadline_queue.h"
+#include "event_loop.h"
+#include "sockets.h"
+
+/**
+ * @brief In-process reachability and RTT prober.
+ *
+ * Uses an unprivileged ICMP datagram socket (SOCK_DGRAM, IPPROTO_ICMP, allowed by net.ipv4.ping_group_range),
+ * where replies are matched by echo sequence and source address. If that is not permitted it falls back to UDP
+ * probes to unused ports. An ICMP port unreachable reported through IP_RECVERR then also proves the host is
+ * reachable. All UDP probes share one socket, so they are matched by destination (address, port) taken from the
+ * original destination of the queued error, and each outstanding probe uses its own destination port. Errors
+ * reported by a different host than the destination (host or network unreachable) complete the probe as not
+ * reachable.
+ *
+ * Replies and timeouts are handled by an own receive thread or by a shared EventLoop. Linux only, elsewhere
+ * init() fails. This is an alternative to the ping_time() / can_ping() helpers of util.h, which spawn ping.
+ */
+class IcmpProber {
+public:
+    /**
+     * @brief Result of a single probe
+     */
+    struct Result {
+        std::string address; // @brief Probed address
+        bool reachable = false; // @brief True if echo or port unreachable was received before timeout
+        float rtt_ms = -1.f; // @brief Round trip time in milliseconds, -1 if not reachable
+    };
+
+    /**
+     * @brief Constructor
+     * @param try_icmp use the ICMP datagram socket if permitted, false always probes with UDP
+     */
+    explicit IcmpProber(bool try_icmp = true) : _try_icmp(try_icmp) {}
+
+    ~IcmpProber() { stop(); }
+
+    IcmpProber(const IcmpProber&) = delete;
+    IcmpProber& operator=(const IcmpProber&) = delete;
+
+    /**
+     * @brief Get prober shared by the whole process, initialized with an own thread on first use
+     */
+    static IcmpProber& instance();
+
+    /**
+     * @brief Open probe socket and start receive thread
+     * @return false if neither ICMP nor UDP probing is available
+     */
+    bool init();
+
+    /**
+     * @brief Open probe socket and serve it and the probe timeouts from event loop
+     * @param event_loop event loop hosting socket and timer
+     * @return false if neither ICMP nor UDP probing is available
+     */
+    bool init(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Stop receiving, outstanding probes complete as not reachable
+     */
+    void stop();
+
+    /**
+     * @brief Check if ICMP datagram socket is used, false for UDP fallback
+     */
+    bool uses_icmp() const { return _use_icmp; }
+
+    /**
+     * @brief Probe single address
+     * @param address IPv4 address
+     * @param timeout timeout in milliseconds
+     * @return future result
+     */
+    std::future<Result> probe(const std::string& address, int timeout);
+
+    /**
+     * @brief Probe addresses in parallel
+     * @param addresses IPv4 addresses
+     * @param timeout timeout in milliseconds
+     * @param callback called once for each address, from the receive thread or the event loop, or from the caller
+     * if the probe could not be sent
+     */
+    void probe(const std::vector<std::string>& addresses, int timeout, std::function<void(const Result&)> callback);
+
+    /**
+     * @brief Probe addresses in parallel and wait for all results, takes at most one timeout
+     * @param addresses IPv4 addresses
+     * @param timeout timeout in milliseconds
+     * @return results in the same order as addresses
+     */
+    std::vector<Result> probe_all(const std::vector<std::string>& addresses, int timeout);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint16_t udp_base_port = 33434; // @brief traceroute range, normally unused
+    static constexpr uint16_t udp_port_count = 4096;
+    static constexpr std::chrono::milliseconds idle_poll_timeout{100};
+
+    /**
+     * @brief Outstanding probe
+     */
+    struct Pending {
+        std::string address; // @brief Probed address
+        uint32_t ip = 0; // @brief Probed address, network byte order
+        Clock::time_point sent; // @brief Send time
+        std::function<void(const Result&)> callback; // @brief Result callback
+    };
+
+    SOCKET _sock = INVALID_SOCKET;
+    const bool _try_icmp;
+    bool _use_icmp = true;
+    std::atomic<bool> _should_exit{true};
+    std::thread _worker_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _socket_handle = EventLoop::invalid_handle;
+    EventLoop::Handle _timeout_timer = EventLoop::invalid_handle;
+    std::mutex _pending_mutex;
+    std::map<uint64_t, Pending> _pending; // @brief Keyed by ICMP sequence, or by UDP destination (address, port)
+    DeadlineQueue<uint64_t> _timeouts; // @brief Guarded by _pending_mutex
+    uint16_t _next_sequence = 0; // @brief ICMP sequence or UDP destination port offset, guarded by _pending_mutex
+
+    bool open_socket();
+
+    /**
+     * @brief Receive thread, matches replies to pending probes and expires timed out probes
+     */
+    void worker();
+
+    /**
+     * @brief Receive replies and queued errors and complete matching probes
+     */
+    void drain();
+
+    /**
+     * @brief Complete probes whose timeout passed
+     */
+    void expire();
+
+    /**
+     * @brief Arm event loop timer for the earliest probe timeout
+     */
+    void schedule_timeout();
+
+    /**
+     * @brief Remove pending probe and collect its result. Called with _pending_mutex held.
+     * @param key probe key
+     * @param reachable true if reply was received
+     * @param completed results to deliver after _pending_mutex is released
+     */
+    void complete(uint64_t key, bool reachable, std::vector<std::pair<std::function<void(const Result&)>, Result>>& completed);
+
+    static uint64_t udp_key(uint32_t ip, uint16_t port) { return (static_cast<uint64_t>(ip) << 16) | port; }
+
+    static uint16_t checksum(const uint8_t* data, size_t size);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline IcmpProber& IcmpProber::instance()
+{
+    static IcmpProber prober;
+    static std::once_flag once;
+    std::call_once(once, [] { prober.init(); });
+    return prober;
+}
+
+inline bool IcmpProber::init()
+{
+    if (!open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _worker_thread = std::thread(&IcmpProber::worker, this);
+    return true;
+}
+
+inline bool IcmpProber::init(std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop || !open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _event_loop = event_loop;
+    _socket_handle = _event_loop->add_socket(_sock, [this] { drain(); });
+    _timeout_timer = _event_loop->add_timer(idle_poll_timeout, [this] {
+        expire();
+        schedule_timeout();
+    }, false);
+    if (_socket_handle == EventLoop::invalid_handle || _timeout_timer == EventLoop::invalid_handle) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+inline void IcmpProber::stop()
+{
+    _should_exit = true;
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+    if (_event_loop) {
+        _event_loop->remove(_socket_handle);
+        _event_loop->remove(_timeout_timer);
+        _socket_handle = EventLoop::invalid_handle;
+        _timeout_timer = EventLoop::invalid_handle;
+        _event_loop.reset();
+    }
+    std::vector<std::pair<std::function<void(const Result&)>, Result>> completed;
+    {
+        std::lock_guard<std::mutex> lock(_pending_mutex);
+        while (!_pending.empty()) {
+            complete(_pending.begin()->first, false, completed);
+        }
+        _timeouts.clear();
+        if (_sock != INVALID_SOCKET) {
+            closesocket(_sock);
+            _sock = INVALID_SOCKET;
+        }
+    }
+    for (auto& c : completed) {
+        c.first(c.second);
+    }
+}
+
+inline bool IcmpProber::open_socket()
+{
+#ifdef __linux__
+    if (_sock != INVALID_SOCKET) {
+        return false;
+    }
+    _use_icmp = _try_icmp;
+    if (_use_icmp) {
+        _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+    }
+    if (_sock == INVALID_SOCKET) {
+        _use_icmp = false;
+        _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (_sock == INVALID_SOCKET) {
+            return false;
+        }
+        int enable = 1;
+        if (setsockopt(_sock, SOL_IP, IP_RECVERR, &enable, sizeof(enable)) != 0) {
+            closesocket(_sock);
+            _sock = INVALID_SOCKET;
+            return false;
+        }
+    }
+    fcntl(_sock, F_SETFL, fcntl(_sock, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline std::future<IcmpProber::Result> IcmpProber::probe(const std::string& address, int timeout)
+{
+    auto promise = std::make_shared<std::promise<Result>>();
+    auto future = promise->get_future();
+    probe({address}, timeout, [promise](const Result& result) { promise->set_value(result); });
+    return future;
+}
+
+inline void IcmpProber::probe(const std::vector<std::string>& addresses, int timeout, std::function<void(const Result&)> callback)
+{
+    std::vector<std::pair<std::function<void(const Result&)>, Result>> failed;
+    {
+        std::lock_guard<std::mutex> lock(_pending_mutex);
+        for (const auto& address : addresses) {
+            Result result;
+            result.address = address;
+            sockaddr_in destination{};
+            destination.sin_family = AF_INET;
+            if (_sock == INVALID_SOCKET || inet_pton(AF_INET, address.c_str(), &destination.sin_addr) != 1) {
+                failed.emplace_back(callback, result);
+                continue;
+            }
+            const uint16_t sequence = _next_sequence++;
+            uint64_t key;
+            std::string packet;
+            if (_use_icmp) {
+#ifdef __linux__
+                key = sequence;
+                icmphdr header{};
+                header.type = ICMP_ECHO;
+                header.un.echo.sequence = htons(sequence);
+                packet.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+                packet.append(32, '\0');
+                header.checksum = checksum(reinterpret_cast<const uint8_t*>(packet.data()), packet.size());
+                std::memcpy(&packet[0], &header, sizeof(header));
+#endif
+            } else {
+                const uint16_t port = static_cast<uint16_t>(udp_base_port + sequence % udp_port_count);
+                destination.sin_port = htons(port);
+                key = udp_key(destination.sin_addr.s_addr, port);
+                packet.assign(1, '\0');
+            }
+            if (_pending.count(key) != 0) {
+                // Sequence space or port range wrapped onto an outstanding probe
+                failed.emplace_back(callback, result);
+                continue;
+            }
+            const auto now = Clock::now();
+            auto sent = sendto(_sock, packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&destination), sizeof(destination));
+#ifdef __linux__
+            if (sent < 0 && (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)) {
+                // Error of an earlier probe was reported instead of sending, its details are in the error queue
+                sent = sendto(_sock, packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&destination), sizeof(destination));
+            }
+#endif
+            if (sent < 0) {
+                failed.emplace_back(callback, result);
+                continue;
+            }
+            _pending[key] = Pending{address, destination.sin_addr.s_addr, now, callback};
+            _timeouts.schedule(key, now + std::chrono::milliseconds(timeout));
+        }
+    }
+    if (_event_loop) {
+        schedule_timeout();
+    }
+    for (auto& f : failed) {
+        f.first(f.second);
+    }
+}
+
+inline std::vector<IcmpProber::Result> IcmpProber::probe_all(const std::vector<std::string>& addresses, int timeout)
+{
+    std::vector<std::future<Result>> futures;
+    futures.reserve(addresses.size());
+    for (const auto& address : addresses) {
+        futures.push_back(probe(address, timeout));
+    }
+    std::vector<Result> results;
+    results.reserve(addresses.size());
+    for (auto& f : futures) {
+        results.push_back(f.get());
+    }
+    return results;
+}
+
+inline void IcmpProber::worker()
+{
+#ifdef __linux__
+    while (!_should_exit) {
+        auto timeout = idle_poll_timeout;
+        {
+            std::lock_guard<std::mutex> lock(_pending_mutex);
+            Clock::time_point deadline;
+            if (_timeouts.next_deadline(deadline)) {
+                const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+                timeout = std::max(std::chrono::milliseconds(0), std::min(remaining, idle_poll_timeout));
+            }
+        }
+        pollfd fd{_sock, POLLIN, 0};
+        if (poll(&fd, 1, static_cast<int>(timeout.count())) > 0) {
+            drain();
+        }
+        expire();
+    }
+#endif
+}
+
+inline void IcmpProber::drain()
+{
+#ifdef __linux__
+    std::vector<std::pair<std::function<void(const Result&)>, Result>> completed;
+    uint8_t buffer[1024];
+    for (;;) {
+        sockaddr_in from{};
+        char control[512];
+        iovec iov{buffer, sizeof(buffer)};
+        msghdr message{};
+        message.msg_name = &from;
+        message.msg_namelen = sizeof(from);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        bool error_queue = false;
+        ssize_t received = recvmsg(_sock, &message, 0);
+        if (received < 0 && !_use_icmp) {
+            message.msg_controllen = sizeof(control);
+            message.msg_namelen = sizeof(from);
+            received = recvmsg(_sock, &message, MSG_ERRQUEUE);
+            error_queue = true;
+        }
+        if (received < 0) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(_pending_mutex);
+        if (_use_icmp) {
+            icmphdr header{};
+            if (static_cast<size_t>(received) < sizeof(header)) {
+                continue;
+            }
+            std::memcpy(&header, buffer, sizeof(header));
+            const uint64_t key = ntohs(header.un.echo.sequence);
+            auto it = _pending.find(key);
+            if (header.type == ICMP_ECHOREPLY && it != _pending.end() && it->second.ip == from.sin_addr.s_addr) {
+                complete(key, true, completed);
+            }
+            continue;
+        }
+        if (!error_queue) {
+            // Something listens on the probed port and answered, host is reachable as well
+            complete(udp_key(from.sin_addr.s_addr, ntohs(from.sin_port)), true, completed);
+            continue;
+        }
+        // msg_name holds the original destination of the probe that caused the error
+        const uint64_t key = udp_key(from.sin_addr.s_addr, ntohs(from.sin_port));
+        if (_pending.count(key) == 0) {
+            continue;
+        }
+        for (cmsghdr* c = CMSG_FIRSTHDR(&message); c != nullptr; c = CMSG_NXTHDR(&message, c)) {
+            if (c->cmsg_level != SOL_IP || c->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            const auto* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(c));
+            if (error->ee_origin != SO_EE_ORIGIN_ICMP) {
+                continue;
+            }
+            const auto* offender = reinterpret_cast<const sockaddr_in*>(SO_EE_OFFENDER(error));
+            // Port unreachable from the destination itself proves it is up, anything else from a router does not
+            const bool reachable = error->ee_type == ICMP_DEST_UNREACH && error->ee_code == ICMP_PORT_UNREACH &&
+                                   offender->sin_family == AF_INET && offender->sin_addr.s_addr == from.sin_addr.s_addr;
+            complete(key, reachable, completed);
+            break;
+        }
+    }
+    for (auto& c : completed) {
+        c.first(c.second);
+    }
+#endif
+}
+
+inline void IcmpProber::expire()
+{
+    std::vector<std::pair<std::function<void(const Result&)>, Result>> completed;
+    {
+        std::lock_guard<std::mutex> lock(_pending_mutex);
+        std::vector<uint64_t> expired;
+        _timeouts.expire(Clock::now(), [&expired](const uint64_t& key) { expired.push_back(key); });
+        for (auto key : expired) {
+            complete(key, false, completed);
+        }
+    }
+    for (auto& c : completed) {
+        c.first(c.second);
+    }
+}
+
+inline void IcmpProber::schedule_timeout()
+{
+    Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(_pending_mutex);
+        if (!_timeouts.next_deadline(deadline)) {
+            return;
+        }
+    }
+    const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+    _event_loop->rearm_timer(_timeout_timer, std::max(remaining, std::chrono::milliseconds(1)));
+}
+
+inline void IcmpProber::complete(uint64_t key, bool reachable, std::vector<std::pair<std::function<void(const Result&)>, Result>>& completed)
+{
+    auto it = _pending.find(key);
+    if (it == _pending.end()) {
+        return;
+    }
+    Result result;
+    result.address = it->second.address;
+    result.reachable = reachable;
+    if (reachable) {
+        result.rtt_ms = std::chrono::duration<float, std::milli>(Clock::now() - it->second.sent).count();
+    }
+    completed.emplace_back(std::move(it->second.callback), std::move(result));
+    _pending.erase(it);
+    _timeouts.cancel(key);
+}
+
+inline uint16_t IcmpProber::checksum(const uint8_t* data, size_t size)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        sum += static_cast<uint32_t>(data[i] << 8 | data[i + 1]);
+    }
+    if (size % 2) {
+        sum += static_cast<uint32_t>(data[size - 1] << 8);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons(static_cast<uint16_t>(~sum));
+}
@@ -0,0 +1,483 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file interface_monitor.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "event_loop.h"
+
+/**
+ * @brief Network interface or address change
+ */
+struct InterfaceEvent {
+    enum class Type { LINK_UP, LINK_DOWN, ADDRESS_ADDED, ADDRESS_REMOVED };
+
+    Type type; // @brief Kind of change
+    std::string interface_name; // @brief Interface name, e.g. eth0
+    int index = 0; // @brief Interface index
+    std::string address; // @brief IPv4 address for ADDRESS_ADDED & ADDRESS_REMOVED, empty otherwise
+    int prefix_length = 0; // @brief Address prefix length
+};
+
+/**
+ * @brief rtnetlink subscriber pushing link up/down and IPv4 address add/remove events.
+ *
+ * On start the current links and addresses are dumped. Current addresses are reported as ADDRESS_ADDED events
+ * from the calling thread before start() returns, so callers do not need a separate scan. After that every
+ * change of the operational state of a link (IFF_RUNNING) and every added or removed IPv4 address is reported
+ * from the own thread or from the event loop. Repeated notifications for an unchanged link state or an already
+ * known address are suppressed. On platforms without rtnetlink start() fails.
+ */
+class InterfaceMonitor {
+public:
+    InterfaceMonitor() = default;
+
+    ~InterfaceMonitor() { stop(); }
+
+    InterfaceMonitor(const InterfaceMonitor&) = delete;
+    InterfaceMonitor& operator=(const InterfaceMonitor&) = delete;
+
+    /**
+     * @brief Open netlink socket and start monitoring on own thread
+     * @param callback called for every event
+     * @return false if netlink is not available
+     */
+    bool start(std::function<void(const InterfaceEvent&)> callback);
+
+    /**
+     * @brief Open netlink socket and monitor it on the event loop
+     * @param event_loop event loop hosting the socket
+     * @param callback called for every event, for current addresses from the calling thread, afterwards from the
+     * event loop thread
+     * @return false if netlink is not available
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop, std::function<void(const InterfaceEvent&)> callback);
+
+    /**
+     * @brief Stop monitoring and close netlink socket. Callback is not called after stop() returns.
+     */
+    void stop();
+
+    /**
+     * @brief Get currently assigned IPv4 addresses
+     * @return ADDRESS_ADDED events for all current addresses
+     */
+    std::vector<InterfaceEvent> get_addresses();
+
+private:
+    static constexpr std::chrono::milliseconds poll_timeout{100};
+    static constexpr std::chrono::milliseconds dump_timeout{2000};
+    static constexpr size_t receive_buffer_size = 16384;
+
+    /**
+     * @brief Last reported state of a link
+     */
+    struct Link {
+        std::string name; // @brief Interface name
+        bool running = false; // @brief Operational state, IFF_RUNNING
+    };
+
+    int _sock = -1;
+    std::atomic<bool> _should_exit{true};
+    std::thread _worker_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _socket_handle = EventLoop::invalid_handle;
+    std::function<void(const InterfaceEvent&)> _callback;
+    uint32_t _dump_sequence = 0; // @brief Sequence of the dump request in progress, 0 if none
+    bool _dump_done = false;
+    bool _dump_failed = false;
+    std::map<int, Link> _links; // @brief Link state by interface index, only accessed from the reading thread
+    std::mutex _addresses_mutex;
+    std::vector<InterfaceEvent> _addresses;
+
+    /**
+     * @brief Open & bind netlink socket and dump current links and addresses
+     * @return true if successful
+     */
+    bool open_socket();
+
+    /**
+     * @brief Request dump and read until it completes, dispatching all messages received meanwhile
+     * @param type RTM_GETLINK or RTM_GETADDR
+     * @return true if dump completed
+     */
+    bool dump(uint16_t type);
+
+    /**
+     * @brief Close netlink socket and forget state
+     */
+    void close_socket();
+
+    /**
+     * @brief Thread worker
+     */
+    void worker();
+
+    /**
+     * @brief Read and dispatch pending netlink messages
+     * @return false on socket error
+     */
+    bool read_messages();
+
+    /**
+     * @brief Dispatch single netlink message
+     * @param header netlink message
+     * @param events collected events
+     */
+    void handle_message(const void* header, std::vector<InterfaceEvent>& events);
+
+    /**
+     * @brief Update known addresses
+     * @param event ADDRESS_ADDED or ADDRESS_REMOVED event
+     * @return true if the set of addresses changed and event has to be reported
+     */
+    bool update_addresses(const InterfaceEvent& event);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool InterfaceMonitor::start(std::function<void(const InterfaceEvent&)> callback)
+{
+    _callback = std::move(callback);
+    if (!open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _worker_thread = std::thread(&InterfaceMonitor::worker, this);
+    return true;
+}
+
+inline bool InterfaceMonitor::start(std::shared_ptr<EventLoop> event_loop, std::function<void(const InterfaceEvent&)> callback)
+{
+    if (!event_loop) {
+        return false;
+    }
+    _callback = std::move(callback);
+    if (!open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _event_loop = event_loop;
+    _socket_handle = _event_loop->add_socket(_sock, [this] {
+        if (!read_messages()) {
+            // Socket failed and would stay readable, stop watching it
+            _event_loop->remove(_socket_handle);
+        }
+    });
+    if (_socket_handle == EventLoop::invalid_handle) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+inline void InterfaceMonitor::stop()
+{
+    _should_exit = true;
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+    if (_event_loop) {
+        _event_loop->remove(_socket_handle);
+        _socket_handle = EventLoop::invalid_handle;
+        _event_loop.reset();
+    }
+    close_socket();
+}
+
+inline std::vector<InterfaceEvent> InterfaceMonitor::get_addresses()
+{
+    std::lock_guard<std::mutex> lock(_addresses_mutex);
+    return _addresses;
+}
+
+inline bool InterfaceMonitor::open_socket()
+{
+#ifdef __linux__
+    if (_sock >= 0) {
+        return false;
+    }
+    _sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (_sock < 0) {
+        return false;
+    }
+    sockaddr_nl local{};
+    local.nl_family = AF_NETLINK;
+    // Subscribe before dumping, so that no change between dump and subscription is lost
+    local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind(_sock, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+        close_socket();
+        return false;
+    }
+    fcntl(_sock, F_SETFL, fcntl(_sock, F_GETFL, 0) | O_NONBLOCK);
+    // Kernel handles one dump per socket at a time, links first so that address events know the link names
+    if (!dump(RTM_GETLINK) || !dump(RTM_GETADDR)) {
+        close_socket();
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool InterfaceMonitor::dump(uint16_t type)
+{
+#ifdef __linux__
+    struct {
+        nlmsghdr header;
+        rtgenmsg message;
+    } request{};
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(rtgenmsg));
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = type == RTM_GETLINK ? 1 : 2;
+    request.message.rtgen_family = type == RTM_GETLINK ? AF_UNSPEC : AF_INET;
+
+    sockaddr_nl kernel{};
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(_sock, &request, request.header.nlmsg_len, 0, reinterpret_cast<sockaddr*>(&kernel), sizeof(kernel)) < 0) {
+        return false;
+    }
+    _dump_sequence = request.header.nlmsg_seq;
+    _dump_done = false;
+    _dump_failed = false;
+    const auto deadline = std::chrono::steady_clock::now() + dump_timeout;
+    while (!_dump_done && !_dump_failed) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            _dump_failed = true;
+            break;
+        }
+        pollfd fd{_sock, POLLIN, 0};
+        if (poll(&fd, 1, static_cast<int>(remaining.count())) > 0 && !read_messages()) {
+            _dump_failed = true;
+        }
+    }
+    _dump_sequence = 0;
+    return !_dump_failed;
+#else
+    (void)type;
+    return false;
+#endif
+}
+
+inline void InterfaceMonitor::close_socket()
+{
+#ifdef __linux__
+    if (_sock >= 0) {
+        close(_sock);
+        _sock = -1;
+    }
+#endif
+    _links.clear();
+    std::lock_guard<std::mutex> lock(_addresses_mutex);
+    _addresses.clear();
+}
+
+inline void InterfaceMonitor::worker()
+{
+#ifdef __linux__
+    while (!_should_exit) {
+        pollfd fd{_sock, POLLIN, 0};
+        if (poll(&fd, 1, static_cast<int>(poll_timeout.count())) > 0 && !read_messages()) {
+            break;
+        }
+    }
+#endif
+}
+
+inline bool InterfaceMonitor::read_messages()
+{
+#ifdef __linux__
+    std::vector<InterfaceEvent> events;
+    alignas(nlmsghdr) char buffer[receive_buffer_size];
+    for (;;) {
+        const ssize_t received = recv(_sock, buffer, sizeof(buffer), 0);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                // Receive buffer overrun, notifications were dropped by the kernel. Keep monitoring, the next
+                // notification of an affected link or address brings the state up to date again.
+                continue;
+            }
+            return false;
+        }
+        auto* header = reinterpret_cast<nlmsghdr*>(buffer);
+        for (int length = static_cast<int>(received); NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+            handle_message(header, events);
+        }
+    }
+    if (_callback) {
+        for (const auto& event : events) {
+            _callback(event);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline void InterfaceMonitor::handle_message(const void* message, std::vector<InterfaceEvent>& events)
+{
+#ifdef __linux__
+    const auto* header = static_cast<const nlmsghdr*>(message);
+    const bool dump_reply = _dump_sequence != 0 && header->nlmsg_seq == _dump_sequence;
+    switch (header->nlmsg_type) {
+    case NLMSG_DONE:
+        if (dump_reply) {
+            _dump_done = true;
+        }
+        break;
+
+    case NLMSG_ERROR:
+        if (dump_reply) {
+            _dump_failed = true;
+        }
+        break;
+
+    case RTM_NEWLINK:
+    case RTM_DELLINK: {
+        const auto* info = static_cast<const ifinfomsg*>(NLMSG_DATA(header));
+        std::string name;
+        int length = static_cast<int>(IFLA_PAYLOAD(header));
+        for (const rtattr* attribute = IFLA_RTA(info); RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+            if (attribute->rta_type == IFLA_IFNAME) {
+                name = static_cast<const char*>(RTA_DATA(attribute));
+            }
+        }
+        const bool running = header->nlmsg_type == RTM_NEWLINK && (info->ifi_flags & IFF_RUNNING) != 0;
+        auto it = _links.find(info->ifi_index);
+        const bool known = it != _links.end();
+        const bool changed = known ? it->second.running != running : running;
+        if (header->nlmsg_type == RTM_DELLINK) {
+            if (known) {
+                name = name.empty() ? it->second.name : name;
+                _links.erase(it);
+            }
+        } else {
+            _links[info->ifi_index] = Link{name, running};
+        }
+        // Dumped links are the initial state, not a change
+        if (changed && !dump_reply) {
+            InterfaceEvent event;
+            event.type = running ? InterfaceEvent::Type::LINK_UP : InterfaceEvent::Type::LINK_DOWN;
+            event.interface_name = name;
+            event.index = info->ifi_index;
+            events.push_back(event);
+        }
+        break;
+    }
+
+    case RTM_NEWADDR:
+    case RTM_DELADDR: {
+        const auto* info = static_cast<const ifaddrmsg*>(NLMSG_DATA(header));
+        if (info->ifa_family != AF_INET) {
+            break;
+        }
+        InterfaceEvent event;
+        event.type = header->nlmsg_type == RTM_NEWADDR ? InterfaceEvent::Type::ADDRESS_ADDED : InterfaceEvent::Type::ADDRESS_REMOVED;
+        event.index = static_cast<int>(info->ifa_index);
+        event.prefix_length = info->ifa_prefixlen;
+        std::string local;
+        std::string address;
+        int length = static_cast<int>(IFA_PAYLOAD(header));
+        for (const rtattr* attribute = IFA_RTA(info); RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+            char text[INET_ADDRSTRLEN] = {};
+            switch (attribute->rta_type) {
+            case IFA_LOCAL:
+                local = inet_ntop(AF_INET, RTA_DATA(attribute), text, sizeof(text)) ? text : "";
+                break;
+            case IFA_ADDRESS:
+                address = inet_ntop(AF_INET, RTA_DATA(attribute), text, sizeof(text)) ? text : "";
+                break;
+            case IFA_LABEL:
+                event.interface_name = static_cast<const char*>(RTA_DATA(attribute));
+                break;
+            }
+        }
+        // IFA_ADDRESS is the peer address on point-to-point links, IFA_LOCAL is always the own one
+        event.address = local.empty() ? address : local;
+        if (event.address.empty()) {
+            break;
+        }
+        if (event.interface_name.empty()) {
+            auto it = _links.find(event.index);
+            if (it != _links.end()) {
+                event.interface_name = it->second.name;
+            }
+        }
+        if (update_addresses(event)) {
+            events.push_back(event);
+        }
+        break;
+    }
+    }
+#else
+    (void)message;
+    (void)events;
+#endif
+}
+
+inline bool InterfaceMonitor::update_addresses(const InterfaceEvent& event)
+{
+    std::lock_guard<std::mutex> lock(_addresses_mutex);
+    for (auto it = _addresses.begin(); it != _addresses.end(); ++it) {
+        if (it->index == event.index && it->address == event.address) {
+            if (event.type == InterfaceEvent::Type::ADDRESS_REMOVED) {
+                _addresses.erase(it);
+                return true;
+            }
+            // Lifetime or flag update of an already known address
+            it->prefix_length = event.prefix_length;
+            it->interface_name = event.interface_name;
+            return false;
+        }
+    }
+    if (event.type == InterfaceEvent::Type::ADDRESS_REMOVED) {
+        return false;
+    }
+    _addresses.push_back(event);
+    return true;
+}
@@ -34,6 +34,8 @@ const std::string json_connect = "connect";
 const std::string json_disconnect = "disconnect";
 const std::string json_reconfigure = "reconfigure";
 const std::string json_status = "status";
+const std::string json_probe = "probe";
+const std::string json_probe_padding = "padding";
 const std::string json_remote_ip = "remote_ip";
 const std::string json_port = "port";
 const std::string json_coalesce_bytes = "coalesce_bytes";
@@ -57,6 +59,11 @@ const std::string json_section_local = "local";
 const std::string json_sequence = "seq";
 const std::string json_timestamp = "timestamp";
 const std::string json_multicast_ip = "multicast_ip";
+const std::string json_encodings = "encodings";
+const std::string json_journal_operation = "op";
+const std::string json_journal_paired = "paired";
+const std::string json_journal_removed = "removed";
+const std::string json_journal_value = "value";
 
 const std::string json_setting_name = "name";
 const std::string json_setting_description = "description";
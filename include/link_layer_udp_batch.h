@@ -0,0 +1,670 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file link_layer_udp_batch.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+#include "event_loop.h"
+#include "json.h"
+#include "link_layer.h"
+#include "sockets.h"
+#include "utility/metrics/metrics.h"
+
+/**
+ * @brief Received message together with its origin
+ */
+struct LinkLayerMessage {
+    std::string message; // @brief Received message
+    std::string from; // @brief Origin of the message
+};
+
+/**
+ * @brief UDP link layer draining up to receive_batch_size datagrams per wakeup (recvmmsg on Linux) and
+ * sending fan-out with as few syscalls as possible (sendmmsg on Linux). Received datagrams are delivered
+ * as one batch to the batch callback, or one by one to the LinkLayer message callback if no batch callback
+ * is registered. Other platforms fall back to one recvfrom / sendto per datagram. The socket is served either
+ * by an own receive thread or by a shared EventLoop. Packets, bytes and drops are counted in the cm_udp_* metrics.
+ */
+class LinkLayerUDPBatch : public LinkLayer {
+public:
+    static constexpr size_t default_receive_batch_size = 16;
+    static constexpr size_t default_max_datagram_size = 8192;
+
+    /**
+     * @brief Outgoing datagram used for batched sending
+     */
+    struct Datagram {
+        std::string msg; // @brief Message to send
+        std::string ip; // @brief Destination address
+        uint16_t port = 0; // @brief Destination port
+        std::string local_ip; // @brief Address of the interface to send from, empty to let routing decide
+    };
+
+    /**
+     * @brief Counters describing achieved batch sizes
+     */
+    struct BatchStatistics {
+        uint64_t receive_calls = 0; // @brief Number of receive syscalls that returned datagrams
+        uint64_t received = 0; // @brief Number of received datagrams
+        uint64_t max_receive_batch = 0; // @brief Largest number of datagrams received in one syscall
+        uint64_t truncated = 0; // @brief Datagrams longer than max_datagram_size, dropped
+        uint64_t send_calls = 0; // @brief Number of send syscalls
+        uint64_t sent = 0; // @brief Number of sent datagrams
+        uint64_t max_send_batch = 0; // @brief Largest number of datagrams sent in one syscall
+    };
+
+    /**
+     * @brief Constructor
+     * @param port UDP listening port
+     * @param multicast_ip Multicast IP, if empty then use broadcast
+     * @param receive_batch_size maximum number of datagrams drained per wakeup, 1 disables batching
+     * @param max_datagram_size size of one receive slot. Longer datagrams are counted as truncated and dropped.
+     * Receive buffer takes receive_batch_size * max_datagram_size bytes.
+     */
+    LinkLayerUDPBatch(
+        uint16_t port = 0,
+        const std::string& multicast_ip = "",
+        size_t receive_batch_size = default_receive_batch_size,
+        size_t max_datagram_size = default_max_datagram_size);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~LinkLayerUDPBatch();
+
+    /**
+     * @brief Stop link layer
+     */
+    void stop() override;
+
+    /**
+     * @brief Initialize socket and start receive thread
+     * @return Result of the initialization, false if already initialized
+     */
+    bool init() override;
+
+    /**
+     * @brief Initialize socket and register it in the event loop instead of starting a receive thread
+     * @param event_loop event loop hosting the socket
+     * @return Result of the initialization, false if already initialized
+     */
+    bool init(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Send message
+     * @param ip address where to send to
+     * @param port port where to send to
+     * @return true if sending succeeded
+     */
+    bool send(const std::string& msg, const std::string& ip, uint16_t port);
+
+    /**
+     * @brief Send multicast message
+     * @param local_ip address to send from
+     * @param multicast_ip multicast address where to send to
+     * @param port port where to send to
+     * @return true if sending succeeded
+     */
+    bool send_multicast(const std::string& msg, const std::string& local_ip, const std::string& multicast_ip, uint16_t port);
+
+    /**
+     * @brief Send message
+     * @param message to be sent
+     * @param params json object containing json_remote_ip & json_port. Without json_remote_ip message is sent
+     * to the multicast group from every joined interface with one send_batch(), or broadcasted if multicast is
+     * not used.
+     * @return true if sending succeeded
+     */
+    bool send(const std::string& message, const Json::Value& params) override;
+
+    /**
+     * @brief Send several messages with as few syscalls as possible. On Linux the sending interface of a datagram
+     * with local_ip is selected with IP_PKTINFO, so datagrams for different interfaces share one sendmmsg.
+     * @param datagrams messages to send
+     * @return number of messages that were sent
+     */
+    size_t send_batch(const std::vector<Datagram>& datagrams);
+
+    /**
+     * @brief Get local port on which UDP socket is bound
+     * @return local port
+     */
+    uint16_t get_local_port();
+
+    /**
+     * @brief Add interface to multicast group
+     * @param interface_ip ip of the local interface
+     */
+    void add_multicast_membership(const std::string& interface_ip);
+
+    /**
+     * @brief Register callback function to be called with all messages received in one wakeup.
+     * If registered it is used instead of the per-message callback.
+     * @param batch_received callback function
+     */
+    void register_batch_message_callback(std::function<void(const std::vector<LinkLayerMessage>&)> batch_received);
+
+    /**
+     * @brief Get batching counters
+     * @return copy of the current counters
+     */
+    BatchStatistics get_batch_statistics() const;
+
+private:
+    std::atomic<bool> _should_exit{false};
+    std::thread _worker_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _socket_handle = EventLoop::invalid_handle;
+    SOCKET _sock = INVALID_SOCKET;
+    uint16_t _port;
+    std::string _multicast_ip;
+    std::mutex _interfaces_mutex;
+    std::set<std::string> _local_interfaces;
+    size_t _receive_batch_size;
+    size_t _max_datagram_size;
+    std::vector<char> _receive_buffer; // @brief _receive_batch_size * _max_datagram_size bytes, allocated in init()
+    std::vector<LinkLayerMessage> _batch; // @brief Reused between wakeups, only touched by the receiving thread
+#ifdef __linux__
+    std::vector<sockaddr_in> _receive_addresses; // @brief recvmmsg descriptors pointing into _receive_buffer, set up in init()
+    std::vector<iovec> _receive_iov;
+    std::vector<mmsghdr> _receive_messages;
+#endif
+    std::function<void(const std::vector<LinkLayerMessage>&)> _batch_received; // @brief Guarded by _message_received_mutex
+    std::atomic<uint64_t> _receive_calls{0};
+    std::atomic<uint64_t> _received{0};
+    std::atomic<uint64_t> _max_receive_batch{0};
+    std::atomic<uint64_t> _truncated{0};
+    std::atomic<uint64_t> _send_calls{0};
+    std::atomic<uint64_t> _sent{0};
+    std::atomic<uint64_t> _max_send_batch{0};
+    std::shared_ptr<connection_manager::utility::metrics::Counter> _rx_packets_metric;
+    std::shared_ptr<connection_manager::utility::metrics::Counter> _rx_bytes_metric;
+    std::shared_ptr<connection_manager::utility::metrics::Counter> _tx_packets_metric;
+    std::shared_ptr<connection_manager::utility::metrics::Counter> _tx_bytes_metric;
+    std::shared_ptr<connection_manager::utility::metrics::Counter> _drops_metric; // @brief Truncated datagrams and failed sends
+
+    /**
+     * @brief Create, bind and set up the socket and receive buffers
+     * @return false if the socket is already open or on socket error
+     */
+    bool open_socket();
+
+    /**
+     * @brief Thread worker
+     */
+    void worker();
+
+    /**
+     * @brief Read all pending datagrams and deliver them
+     * @return false on socket error
+     */
+    bool drain();
+
+    /**
+     * @brief Receive up to _receive_batch_size datagrams in one syscall and append them to _batch
+     * @return number of datagrams read including truncated ones, negative on socket error
+     */
+    int receive_batch();
+
+    /**
+     * @brief Deliver _batch to the registered callback under _message_received_mutex
+     */
+    void deliver();
+
+    /**
+     * @brief Raise maximum to value
+     */
+    static void update_max(std::atomic<uint64_t>& max, uint64_t value);
+
+    /**
+     * @brief Fill IPv4 socket address
+     * @return false if ip is not valid
+     */
+    static bool make_address(const std::string& ip, uint16_t port, sockaddr_in& address);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline LinkLayerUDPBatch::LinkLayerUDPBatch(
+    uint16_t port, const std::string& multicast_ip, size_t receive_batch_size, size_t max_datagram_size)
+    : _port(port)
+    , _multicast_ip(multicast_ip)
+    , _receive_batch_size(std::max<size_t>(receive_batch_size, 1))
+    , _max_datagram_size(std::max<size_t>(max_datagram_size, 1))
+{
+    auto& registry = connection_manager::utility::metrics::Registry::instance();
+    _rx_packets_metric = registry.counter("cm_udp_rx_packets_total", "Received UDP datagrams");
+    _rx_bytes_metric = registry.counter("cm_udp_rx_bytes_total", "Received UDP payload bytes");
+    _tx_packets_metric = registry.counter("cm_udp_tx_packets_total", "Sent UDP datagrams");
+    _tx_bytes_metric = registry.counter("cm_udp_tx_bytes_total", "Sent UDP payload bytes");
+    _drops_metric = registry.counter("cm_udp_drops_total", "Truncated received datagrams and failed sends");
+}
+
+inline LinkLayerUDPBatch::~LinkLayerUDPBatch()
+{
+    stop();
+}
+
+inline void LinkLayerUDPBatch::stop()
+{
+    _should_exit = true;
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+    if (_event_loop) {
+        _event_loop->remove(_socket_handle);
+        _socket_handle = EventLoop::invalid_handle;
+        _event_loop.reset();
+    }
+    if (_sock != INVALID_SOCKET) {
+        closesocket(_sock);
+        _sock = INVALID_SOCKET;
+    }
+}
+
+inline bool LinkLayerUDPBatch::init()
+{
+    if (!open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _worker_thread = std::thread(&LinkLayerUDPBatch::worker, this);
+    return true;
+}
+
+inline bool LinkLayerUDPBatch::init(std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop || !open_socket()) {
+        return false;
+    }
+    _event_loop = event_loop;
+    _socket_handle = _event_loop->add_socket(_sock, [this] { drain(); });
+    if (_socket_handle == EventLoop::invalid_handle) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+inline bool LinkLayerUDPBatch::open_socket()
+{
+    if (_sock != INVALID_SOCKET) {
+        return false;
+    }
+    _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (_sock == INVALID_SOCKET) {
+        return false;
+    }
+    int enable = 1;
+    setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&enable), sizeof(enable));
+    setsockopt(_sock, SOL_SOCKET, SO_BROADCAST, reinterpret_cast<const char*>(&enable), sizeof(enable));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(_port);
+    if (bind(_sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        closesocket(_sock);
+        _sock = INVALID_SOCKET;
+        return false;
+    }
+#ifndef _WIN32
+    fcntl(_sock, F_SETFL, fcntl(_sock, F_GETFL, 0) | O_NONBLOCK);
+#else
+    u_long non_blocking = 1;
+    ioctlsocket(_sock, FIONBIO, &non_blocking);
+#endif
+    _receive_buffer.assign(_receive_batch_size * _max_datagram_size, 0);
+    _batch.reserve(_receive_batch_size);
+#ifdef __linux__
+    _receive_addresses.resize(_receive_batch_size);
+    _receive_iov.resize(_receive_batch_size);
+    _receive_messages.resize(_receive_batch_size);
+    for (size_t i = 0; i < _receive_batch_size; i++) {
+        _receive_iov[i].iov_base = &_receive_buffer[i * _max_datagram_size];
+        _receive_iov[i].iov_len = _max_datagram_size;
+    }
+#endif
+    return true;
+}
+
+inline bool LinkLayerUDPBatch::make_address(const std::string& ip, uint16_t port, sockaddr_in& address)
+{
+    address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    return inet_pton(AF_INET, ip.c_str(), &address.sin_addr) == 1;
+}
+
+inline bool LinkLayerUDPBatch::send(const std::string& msg, const std::string& ip, uint16_t port)
+{
+    sockaddr_in address;
+    if (_sock == INVALID_SOCKET) {
+        return false;
+    }
+    if (!make_address(ip, port, address)) {
+        _drops_metric->inc();
+        return false;
+    }
+    _send_calls++;
+    if (sendto(_sock, msg.data(), static_cast<int>(msg.size()), 0, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        _drops_metric->inc();
+        return false;
+    }
+    _sent++;
+    _tx_packets_metric->inc();
+    _tx_bytes_metric->inc(msg.size());
+    update_max(_max_send_batch, 1);
+    return true;
+}
+
+inline bool LinkLayerUDPBatch::send_multicast(
+    const std::string& msg, const std::string& local_ip, const std::string& multicast_ip, uint16_t port)
+{
+    in_addr local{};
+    if (_sock == INVALID_SOCKET) {
+        return false;
+    }
+    if (inet_pton(AF_INET, local_ip.c_str(), &local) != 1) {
+        _drops_metric->inc();
+        return false;
+    }
+    // IP_MULTICAST_IF is socket wide, so selecting interface and sending must not interleave with another multicast send
+    std::lock_guard<std::mutex> lock(_interfaces_mutex);
+    if (setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char*>(&local), sizeof(local)) != 0) {
+        return false;
+    }
+    return send(msg, multicast_ip, port);
+}
+
+inline bool LinkLayerUDPBatch::send(const std::string& message, const Json::Value& params)
+{
+    const uint16_t port = static_cast<uint16_t>(params[json_port].asUInt());
+    const std::string ip = params[json_remote_ip].asString();
+    if (!ip.empty()) {
+        return send(message, ip, port);
+    }
+    if (_multicast_ip.empty()) {
+        return send(message, "255.255.255.255", port);
+    }
+    std::vector<Datagram> datagrams;
+    {
+        std::lock_guard<std::mutex> lock(_interfaces_mutex);
+        for (const auto& local_ip : _local_interfaces) {
+            datagrams.push_back({message, _multicast_ip, port, local_ip});
+        }
+    }
+    return send_batch(datagrams) > 0;
+}
+
+inline size_t LinkLayerUDPBatch::send_batch(const std::vector<Datagram>& datagrams)
+{
+    if (_sock == INVALID_SOCKET || datagrams.empty()) {
+        return 0;
+    }
+#ifdef __linux__
+    using Control = std::array<char, CMSG_SPACE(sizeof(in_pktinfo))>;
+    std::vector<sockaddr_in> addresses(datagrams.size());
+    std::vector<iovec> iov(datagrams.size());
+    std::vector<mmsghdr> messages(datagrams.size());
+    std::vector<Control> controls(datagrams.size());
+    size_t count = 0;
+    for (const auto& datagram : datagrams) {
+        in_addr local{};
+        if (!make_address(datagram.ip, datagram.port, addresses[count])
+            || (!datagram.local_ip.empty() && inet_pton(AF_INET, datagram.local_ip.c_str(), &local) != 1)) {
+            continue;
+        }
+        iov[count].iov_base = const_cast<char*>(datagram.msg.data());
+        iov[count].iov_len = datagram.msg.size();
+        messages[count] = {};
+        messages[count].msg_hdr.msg_name = &addresses[count];
+        messages[count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[count].msg_hdr.msg_iov = &iov[count];
+        messages[count].msg_hdr.msg_iovlen = 1;
+        if (!datagram.local_ip.empty()) {
+            // Source address selects the interface, for multicast as IP_MULTICAST_IF would
+            controls[count].fill(0);
+            messages[count].msg_hdr.msg_control = controls[count].data();
+            messages[count].msg_hdr.msg_controllen = controls[count].size();
+            cmsghdr* control = CMSG_FIRSTHDR(&messages[count].msg_hdr);
+            control->cmsg_level = IPPROTO_IP;
+            control->cmsg_type = IP_PKTINFO;
+            control->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+            in_pktinfo info{};
+            info.ipi_spec_dst = local;
+            memcpy(CMSG_DATA(control), &info, sizeof(info));
+        }
+        count++;
+    }
+    size_t sent = 0;
+    while (sent < count) {
+        const int res = sendmmsg(_sock, &messages[sent], static_cast<unsigned int>(count - sent), 0);
+        if (res <= 0) {
+            break;
+        }
+        _send_calls++;
+        update_max(_max_send_batch, static_cast<uint64_t>(res));
+        sent += static_cast<size_t>(res);
+    }
+    _sent += sent;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < sent; i++) {
+        bytes += iov[i].iov_len;
+    }
+    _tx_packets_metric->inc(sent);
+    _tx_bytes_metric->inc(bytes);
+    _drops_metric->inc(datagrams.size() - sent);
+    return sent;
+#else
+    size_t sent = 0;
+    for (const auto& datagram : datagrams) {
+        if (datagram.local_ip.empty()) {
+            sent += send(datagram.msg, datagram.ip, datagram.port) ? 1 : 0;
+        } else {
+            sent += send_multicast(datagram.msg, datagram.local_ip, datagram.ip, datagram.port) ? 1 : 0;
+        }
+    }
+    return sent;
+#endif
+}
+
+inline uint16_t LinkLayerUDPBatch::get_local_port()
+{
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (_sock == INVALID_SOCKET || getsockname(_sock, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+inline void LinkLayerUDPBatch::add_multicast_membership(const std::string& interface_ip)
+{
+    if (_multicast_ip.empty() || _sock == INVALID_SOCKET) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_interfaces_mutex);
+    if (_local_interfaces.count(interface_ip)) {
+        return;
+    }
+    ip_mreq membership{};
+    if (inet_pton(AF_INET, _multicast_ip.c_str(), &membership.imr_multiaddr) != 1
+        || inet_pton(AF_INET, interface_ip.c_str(), &membership.imr_interface) != 1) {
+        return;
+    }
+    if (setsockopt(_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, reinterpret_cast<const char*>(&membership), sizeof(membership)) == 0) {
+        _local_interfaces.insert(interface_ip);
+    }
+}
+
+inline void LinkLayerUDPBatch::register_batch_message_callback(std::function<void(const std::vector<LinkLayerMessage>&)> batch_received)
+{
+    std::lock_guard<std::mutex> lock(_message_received_mutex);
+    _batch_received = batch_received;
+}
+
+inline LinkLayerUDPBatch::BatchStatistics LinkLayerUDPBatch::get_batch_statistics() const
+{
+    BatchStatistics statistics;
+    statistics.receive_calls = _receive_calls;
+    statistics.received = _received;
+    statistics.max_receive_batch = _max_receive_batch;
+    statistics.truncated = _truncated;
+    statistics.send_calls = _send_calls;
+    statistics.sent = _sent;
+    statistics.max_send_batch = _max_send_batch;
+    return statistics;
+}
+
+inline void LinkLayerUDPBatch::worker()
+{
+    while (!_should_exit) {
+#ifndef _WIN32
+        pollfd fd{_sock, POLLIN, 0};
+        const int res = poll(&fd, 1, 100);
+#else
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(_sock, &read_set);
+        timeval timeout{0, 100000};
+        const int res = select(0, &read_set, nullptr, nullptr, &timeout);
+#endif
+        if (res > 0 && !drain()) {
+            break;
+        }
+    }
+}
+
+inline bool LinkLayerUDPBatch::drain()
+{
+    // Stop after one partial batch, the socket is empty then and the next wakeup picks up the rest
+    for (;;) {
+        _batch.clear();
+        const int res = receive_batch();
+        if (res < 0) {
+            return false;
+        }
+        if (!_batch.empty()) {
+            deliver();
+        }
+        if (static_cast<size_t>(res) < _receive_batch_size) {
+            return true;
+        }
+    }
+}
+
+inline int LinkLayerUDPBatch::receive_batch()
+{
+#ifdef __linux__
+    auto& messages = _receive_messages;
+    for (size_t i = 0; i < _receive_batch_size; i++) {
+        messages[i] = {};
+        messages[i].msg_hdr.msg_name = &_receive_addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &_receive_iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    const int res = recvmmsg(_sock, messages.data(), static_cast<unsigned int>(_receive_batch_size), MSG_DONTWAIT, nullptr);
+    if (res < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (res > 0) {
+        _receive_calls++;
+        update_max(_max_receive_batch, static_cast<uint64_t>(res));
+    }
+    char ip[INET_ADDRSTRLEN];
+    for (int i = 0; i < res; i++) {
+        if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            _truncated++;
+            _drops_metric->inc();
+            continue;
+        }
+        inet_ntop(AF_INET, &_receive_addresses[i].sin_addr, ip, sizeof(ip));
+        _batch.push_back({std::string(&_receive_buffer[i * _max_datagram_size], messages[i].msg_len), ip});
+    }
+    _received += _batch.size();
+    return res;
+#else
+    int count = 0;
+    char ip[INET_ADDRSTRLEN];
+    while (static_cast<size_t>(count) < _receive_batch_size) {
+        sockaddr_in address{};
+        socklen_t length = sizeof(address);
+        // One extra byte detects datagrams longer than a slot
+        const int res = recvfrom(
+            _sock, _receive_buffer.data(), static_cast<int>(std::min(_receive_buffer.size(), _max_datagram_size + 1)), 0,
+            reinterpret_cast<sockaddr*>(&address), &length);
+        if (res < 0) {
+            break;
+        }
+        _receive_calls++;
+        count++;
+        if (static_cast<size_t>(res) > _max_datagram_size) {
+            _truncated++;
+            _drops_metric->inc();
+            continue;
+        }
+        inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+        _batch.push_back({std::string(_receive_buffer.data(), static_cast<size_t>(res)), ip});
+    }
+    update_max(_max_receive_batch, count ? 1 : 0);
+    _received += _batch.size();
+    return count;
+#endif
+}
+
+inline void LinkLayerUDPBatch::deliver()
+{
+    uint64_t bytes = 0;
+    for (const auto& message : _batch) {
+        bytes += message.message.size();
+    }
+    _rx_packets_metric->inc(_batch.size());
+    _rx_bytes_metric->inc(bytes);
+    std::lock_guard<std::mutex> lock(_message_received_mutex);
+    if (_batch_received) {
+        _batch_received(_batch);
+    } else if (_message_received) {
+        for (const auto& message : _batch) {
+            _message_received(message.message, message.from);
+        }
+    }
+}
+
+inline void LinkLayerUDPBatch::update_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+    uint64_t current = max.load();
+    while (value > current && !max.compare_exchange_weak(current, value)) {
+    }
+}
@@ -0,0 +1,433 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file link_quality.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+#include "json.h"
+
+/**
+ * @brief Measured quality of one remote driver instance link, all values are EWMA estimates
+ */
+struct LinkQuality {
+    double rtt_ms = 0; // @brief Round trip time in milliseconds
+    double loss = 0; // @brief Probe loss ratio 0..1
+    uint32_t samples = 0; // @brief Number of probe rounds with at least one echo
+
+    bool valid() const { return samples > 0; }
+};
+
+/**
+ * @brief Prober measuring RTT and loss of connected driver instances.
+ *
+ * Every period a train of train_length json_probe requests of probe_size bytes is sent to each target and
+ * echoed back by the remote. RTT comes from the first echo, loss from probes without echo after timeout. Each
+ * probe counts once, duplicated echoes (e.g. over several interfaces) are ignored. Size and rate are set with
+ * Settings, the defaults cost about 50 bytes/s per target. Throughput is not estimated: trains this short do
+ * not load the link, so their dispersion says nothing about the achievable rate.
+ *
+ * The prober only measures and scores. Ranking instances by score is up to the caller, e.g. when choosing
+ * among the instances ConnectionManager reports, and remotes answer probes with make_echo().
+ *
+ * Rounds without any echo are not samples, so remotes that do not echo probes (older slaves) stay unmeasured
+ * and callers rank them by configured download_bandwidth / streaming_priority. After silent_rounds consecutive
+ * rounds without echo the estimates of a measured target are dropped as well, so a dead link falls back to the
+ * configured ranking instead of keeping its last good estimate.
+ *
+ * Trains are sent either from an own thread or from a periodic timer on a shared EventLoop.
+ */
+class LinkQualityProber {
+public:
+    static constexpr double ewma_alpha = 0.2;
+    static constexpr int silent_rounds = 3;
+
+    /**
+     * @brief Probe size and rate
+     */
+    struct Settings {
+        std::chrono::milliseconds period{10000}; // @brief Time between trains
+        std::chrono::milliseconds timeout{1000}; // @brief Echoes arriving later are lost, at most period
+        int train_length = 2; // @brief Probes per train, 1..64
+        size_t probe_size = 256; // @brief Serialized probe size in bytes, padding included
+    };
+
+    /**
+     * @brief Constructor
+     * @param send function sending probe message to ip & port
+     * @param settings probe size and rate
+     */
+    LinkQualityProber(std::function<bool(const Json::Value& probe, const std::string& ip, uint16_t port)> send, Settings settings);
+
+    /**
+     * @brief Constructor with default Settings
+     * @param send function sending probe message to ip & port
+     */
+    explicit LinkQualityProber(std::function<bool(const Json::Value& probe, const std::string& ip, uint16_t port)> send);
+
+    ~LinkQualityProber() { stop(); }
+
+    LinkQualityProber(const LinkQualityProber&) = delete;
+    LinkQualityProber& operator=(const LinkQualityProber&) = delete;
+
+    /**
+     * @brief Start own prober thread
+     */
+    void start();
+
+    /**
+     * @brief Send trains from a periodic timer on the event loop
+     * @param event_loop event loop hosting the timer
+     * @return true if timer was added
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop);
+
+    void stop();
+
+    /**
+     * @brief Start probing remote driver instance
+     * @param name remote name
+     * @param instance driver instance
+     * @param ip remote ip for this instance
+     * @param port remote pairing port
+     */
+    void add_target(const std::string& name, const std::string& instance, const std::string& ip, uint16_t port);
+
+    /**
+     * @brief Stop probing remote driver instance and forget its estimates
+     * @param name remote name
+     * @param instance driver instance, if empty remove all instances of the remote
+     */
+    void remove_target(const std::string& name, const std::string& instance = "");
+
+    /**
+     * @brief Process echoed json_probe response
+     * @param val received response
+     * @param from origin of the message
+     */
+    void probe_received(const Json::Value& val, const std::string& from);
+
+    /**
+     * @brief Build the echo a remote sends back for a received json_probe request
+     * @param request received request
+     * @param echo response to send back to the origin of the request
+     * @return false if request is not a probe
+     */
+    static bool make_echo(const Json::Value& request, Json::Value& echo);
+
+    /**
+     * @brief Get current estimates
+     * @param name remote name
+     * @param instance driver instance
+     * @param quality returned estimates
+     * @return false if instance is not probed or is unmeasured
+     */
+    bool get(const std::string& name, const std::string& instance, LinkQuality& quality);
+
+    /**
+     * @brief Score link for bulk downloads, higher is better. Loss costs retransmissions, RTT slows the window.
+     */
+    static double download_score(const LinkQuality& quality);
+
+    /**
+     * @brief Score link for video streaming, higher is better. Loss and RTT weigh more than for downloads.
+     */
+    static double streaming_score(const LinkQuality& quality);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Probe state of one remote driver instance
+     */
+    struct Target {
+        std::string ip; // @brief Remote ip
+        uint16_t port = 0; // @brief Remote port
+        bool in_train = false; // @brief A train was sent and not yet folded into the estimates
+        uint32_t sequence = 0; // @brief Sequence of the first probe in the current train
+        Clock::time_point sent; // @brief Time the current train was sent
+        Clock::time_point first_echo; // @brief Arrival of first echo of the current train
+        uint64_t echoed = 0; // @brief Bit per probe of the current train that was echoed
+        int echoes = 0; // @brief Probes of the current train that were echoed
+        int silent = 0; // @brief Consecutive rounds without echo
+        LinkQuality quality; // @brief Current estimates
+    };
+
+    std::function<bool(const Json::Value& probe, const std::string& ip, uint16_t port)> _send;
+    const Settings _settings;
+    std::atomic<bool> _should_exit{true};
+    std::thread _worker_thread;
+    std::mutex _exit_thread_mutex;
+    std::condition_variable _cv_exit_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _timer = EventLoop::invalid_handle;
+    std::mutex _targets_mutex;
+    std::map<std::pair<std::string, std::string>, Target> _targets;
+    uint32_t _next_sequence = 0;
+
+    /**
+     * @brief Thread worker, calls round() every period
+     */
+    void worker();
+
+    /**
+     * @brief Close previous trains and send the next ones
+     */
+    void round();
+
+    /**
+     * @brief Fold finished train into EWMA estimates. Called with _targets_mutex held.
+     * @param target probed target
+     */
+    void update_estimates(Target& target);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline LinkQualityProber::LinkQualityProber(
+    std::function<bool(const Json::Value& probe, const std::string& ip, uint16_t port)> send, Settings settings)
+    : _send(std::move(send)), _settings([&settings] {
+          settings.train_length = std::clamp(settings.train_length, 1, 64);
+          settings.period = std::max(settings.period, std::chrono::milliseconds(1));
+          settings.timeout = std::min(settings.timeout, settings.period);
+          return settings;
+      }())
+{}
+
+inline LinkQualityProber::LinkQualityProber(std::function<bool(const Json::Value& probe, const std::string& ip, uint16_t port)> send)
+    : LinkQualityProber(std::move(send), Settings())
+{}
+
+inline void LinkQualityProber::start()
+{
+    if (!_should_exit || _event_loop) {
+        return;
+    }
+    _should_exit = false;
+    _worker_thread = std::thread(&LinkQualityProber::worker, this);
+}
+
+inline bool LinkQualityProber::start(std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop || !_should_exit || _event_loop) {
+        return false;
+    }
+    _timer = event_loop->add_timer(_settings.period, [this] { round(); });
+    if (_timer == EventLoop::invalid_handle) {
+        return false;
+    }
+    _event_loop = event_loop;
+    return true;
+}
+
+inline void LinkQualityProber::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_exit_thread_mutex);
+        _should_exit = true;
+    }
+    _cv_exit_thread.notify_all();
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+    if (_event_loop) {
+        _event_loop->remove(_timer);
+        _timer = EventLoop::invalid_handle;
+        _event_loop.reset();
+    }
+}
+
+inline void LinkQualityProber::add_target(const std::string& name, const std::string& instance, const std::string& ip, uint16_t port)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    Target& target = _targets[{name, instance}];
+    if (target.ip != ip || target.port != port) {
+        target = Target();
+        target.ip = ip;
+        target.port = port;
+    }
+}
+
+inline void LinkQualityProber::remove_target(const std::string& name, const std::string& instance)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    if (!instance.empty()) {
+        _targets.erase({name, instance});
+        return;
+    }
+    for (auto it = _targets.begin(); it != _targets.end();) {
+        it = it->first.first == name ? _targets.erase(it) : std::next(it);
+    }
+}
+
+inline void LinkQualityProber::probe_received(const Json::Value& val, const std::string& from)
+{
+    if (val[json_response].asString() != json_probe || !val[json_sequence].isUInt()) {
+        return;
+    }
+    const uint32_t sequence = val[json_sequence].asUInt();
+    const auto now = Clock::now();
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    for (auto& t : _targets) {
+        Target& target = t.second;
+        const uint32_t index = sequence - target.sequence;
+        if (!target.in_train || index >= static_cast<uint32_t>(_settings.train_length)) {
+            continue;
+        }
+        // from is "ip:port" or "ip"
+        if (from.substr(0, from.find(':')) != target.ip || now - target.sent > _settings.timeout
+            || (target.echoed & (uint64_t(1) << index))) {
+            return;
+        }
+        if (target.echoes == 0) {
+            target.first_echo = now;
+        }
+        target.echoed |= uint64_t(1) << index;
+        target.echoes++;
+        return;
+    }
+}
+
+inline bool LinkQualityProber::make_echo(const Json::Value& request, Json::Value& echo)
+{
+    if (request[json_request].asString() != json_probe || !request[json_sequence].isUInt()) {
+        return false;
+    }
+    // Padding is sent back, so both directions carry probe_size bytes
+    echo = Json::Value();
+    echo[json_response] = json_probe;
+    echo[json_sequence] = request[json_sequence];
+    echo[json_probe_padding] = request[json_probe_padding];
+    return true;
+}
+
+inline bool LinkQualityProber::get(const std::string& name, const std::string& instance, LinkQuality& quality)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    auto it = _targets.find({name, instance});
+    if (it == _targets.end() || !it->second.quality.valid()) {
+        return false;
+    }
+    quality = it->second.quality;
+    return true;
+}
+
+inline double LinkQualityProber::download_score(const LinkQuality& quality)
+{
+    return (1.0 - quality.loss) / (1.0 + quality.rtt_ms / 1000.0);
+}
+
+inline double LinkQualityProber::streaming_score(const LinkQuality& quality)
+{
+    const double delivered = 1.0 - quality.loss;
+    return delivered * delivered * delivered / (1.0 + quality.rtt_ms / 100.0);
+}
+
+inline void LinkQualityProber::worker()
+{
+    std::unique_lock<std::mutex> lock(_exit_thread_mutex);
+    while (!_cv_exit_thread.wait_for(lock, _settings.period, [this] { return _should_exit.load(); })) {
+        lock.unlock();
+        round();
+        lock.lock();
+    }
+}
+
+inline void LinkQualityProber::round()
+{
+    struct Probe {
+        Json::Value message;
+        std::string ip;
+        uint16_t port;
+    };
+    std::vector<Probe> probes;
+    {
+        std::lock_guard<std::mutex> lock(_targets_mutex);
+        const auto now = Clock::now();
+        for (auto& t : _targets) {
+            Target& target = t.second;
+            if (target.in_train) {
+                update_estimates(target);
+            }
+            target.in_train = true;
+            target.sequence = _next_sequence;
+            target.sent = now;
+            target.echoed = 0;
+            target.echoes = 0;
+            for (int i = 0; i < _settings.train_length; i++) {
+                Json::Value probe;
+                probe[json_request] = json_probe;
+                probe[json_sequence] = _next_sequence++;
+                probes.push_back({probe, target.ip, target.port});
+            }
+        }
+    }
+    if (probes.empty()) {
+        return;
+    }
+
+    // Pad to probe_size, measured on the first probe since all of them serialize to about the same size
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    const size_t size = Json::writeString(builder, probes.front().message).size() + 16;
+    const std::string padding(_settings.probe_size > size ? _settings.probe_size - size : 0, '0');
+    for (auto& probe : probes) {
+        probe.message[json_probe_padding] = padding;
+        _send(probe.message, probe.ip, probe.port);
+    }
+}
+
+inline void LinkQualityProber::update_estimates(Target& target)
+{
+    target.in_train = false;
+    if (target.echoes == 0) {
+        // Not a sample, the remote may not echo probes at all
+        if (++target.silent >= silent_rounds) {
+            target.quality = LinkQuality();
+        }
+        return;
+    }
+    target.silent = 0;
+
+    const double rtt_ms = std::chrono::duration<double, std::milli>(target.first_echo - target.sent).count();
+    const double loss = 1.0 - static_cast<double>(target.echoes) / _settings.train_length;
+
+    LinkQuality& q = target.quality;
+    if (!q.valid()) {
+        q.rtt_ms = rtt_ms;
+        q.loss = loss;
+    } else {
+        q.rtt_ms += ewma_alpha * (rtt_ms - q.rtt_ms);
+        q.loss += ewma_alpha * (loss - q.loss);
+    }
+    q.samples++;
+}
@@ -0,0 +1,111 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file lru_cache.h
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Bounded cache evicting the least recently used entry. Lookup, insertion and eviction are O(1).
+ * Not thread safe, callers hold the lock of the data the cached values refer to.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+public:
+    /**
+     * @brief Constructor
+     * @param capacity maximum number of entries, at least 1
+     */
+    explicit LruCache(size_t capacity) : _capacity(capacity ? capacity : 1) {}
+
+    /**
+     * @brief Find entry and mark it as most recently used
+     * @param key entry key
+     * @return pointer to cached value, valid until the next insert or erase, nullptr if not cached
+     */
+    Value* find(const Key& key)
+    {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            return nullptr;
+        }
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return &it->second->second;
+    }
+
+    /**
+     * @brief Insert or replace entry and mark it as most recently used. Evicts the least recently used entry when full.
+     * @param key entry key
+     * @param value value to cache
+     */
+    void insert(const Key& key, Value value)
+    {
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            it->second->second = std::move(value);
+            _entries.splice(_entries.begin(), _entries, it->second);
+            return;
+        }
+        if (_entries.size() >= _capacity) {
+            _index.erase(_entries.back().first);
+            _entries.pop_back();
+        }
+        _entries.emplace_front(key, std::move(value));
+        _index.emplace(key, _entries.begin());
+    }
+
+    /**
+     * @brief Remove entry
+     * @param key entry key
+     * @return true if entry was cached
+     */
+    bool erase(const Key& key)
+    {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            return false;
+        }
+        _entries.erase(it->second);
+        _index.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Remove all entries
+     */
+    void clear()
+    {
+        _index.clear();
+        _entries.clear();
+    }
+
+    size_t size() const { return _entries.size(); }
+
+    size_t capacity() const { return _capacity; }
+
+private:
+    using Entries = std::list<std::pair<Key, Value>>;
+
+    size_t _capacity;
+    Entries _entries; // @brief Most recently used first
+    std::unordered_map<Key, typename Entries::iterator, Hash> _index;
+};
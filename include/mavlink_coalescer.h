@@ -0,0 +1,306 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file mavlink_coalescer.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <cstdlib>
+#include <string>
+
+#include "json.h"
+
+/**
+ * @brief Packs small MAVLink frames forwarded on a driver mavlink_port into larger UDP datagrams.
+ *
+ * Frames are appended to a pending datagram until adding the next frame would exceed coalesce_bytes,
+ * or until coalesce_ms passed since the first pending frame. With coalesce_nodelay set, high priority
+ * frames (commands, acks, parameter & mission protocol) flush the pending datagram immediately
+ * together with the high priority frame. Frames are never split or reordered.
+ *
+ * push() is fed by the forwarding path and poll() by its flush timer at next_flush(), see MavlinkForwarder.
+ * The send function is called with the coalescer lock held and must not call back into the coalescer.
+ */
+class MavlinkCoalescer {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    /**
+     * @brief Coalescing counters
+     */
+    struct Statistics {
+        uint64_t frames = 0; // @brief Frames pushed
+        uint64_t frame_bytes = 0; // @brief Bytes pushed
+        uint64_t datagrams = 0; // @brief Datagrams sent
+        uint64_t flushed_full = 0; // @brief Datagrams sent because coalesce_bytes was reached
+        uint64_t flushed_timeout = 0; // @brief Datagrams sent because coalesce_ms passed
+        uint64_t flushed_nodelay = 0; // @brief Datagrams sent because of high priority frame
+        uint64_t malformed = 0; // @brief Input that could not be parsed as MAVLink and was passed through unchanged
+    };
+
+    /**
+     * @brief Constructor
+     * @param send function sending one coalesced datagram
+     */
+    explicit MavlinkCoalescer(std::function<void(const char* data, size_t size)> send) : _send(std::move(send)) {}
+
+    /**
+     * @brief Configure coalescing from driver configuration (coalesce_bytes, coalesce_ms, coalesce_nodelay)
+     * @param configuration json object containing driver configuration
+     * @return true if coalescing is enabled (coalesce_bytes > 0)
+     */
+    bool configure(const Json::Value& configuration);
+
+    /**
+     * @brief Configure coalescing
+     * @param coalesce_bytes maximum datagram size, 0 disables coalescing
+     * @param coalesce_ms maximum time a frame waits in the pending datagram
+     * @param nodelay flush immediately on high priority frames
+     */
+    void configure(size_t coalesce_bytes, int coalesce_ms, bool nodelay);
+
+    /**
+     * @brief Push received datagram containing one or more MAVLink frames
+     * @param data datagram data
+     * @param size datagram size
+     * @param now current time
+     */
+    void push(const char* data, size_t size, TimePoint now = std::chrono::steady_clock::now());
+
+    /**
+     * @brief Flush pending datagram if coalesce_ms passed
+     * @param now current time
+     */
+    void poll(TimePoint now = std::chrono::steady_clock::now());
+
+    /**
+     * @brief Get time when pending datagram has to be flushed
+     * @param deadline set on return
+     * @return false if nothing is pending
+     */
+    bool next_flush(TimePoint& deadline);
+
+    /**
+     * @brief Flush pending datagram
+     */
+    void flush();
+
+    Statistics get_statistics() const;
+
+    /**
+     * @brief Get length of the MAVLink v1 or v2 frame at the start of data
+     * @param data frame data
+     * @param size available bytes
+     * @param msgid message id of the frame
+     * @return frame length or 0 if data does not start with a complete frame
+     */
+    static size_t frame_length(const char* data, size_t size, uint32_t& msgid);
+
+    /**
+     * @brief Should message bypass coalescing delay when coalesce_nodelay is set
+     * @param msgid MAVLink message id
+     * @return true for high priority messages
+     */
+    static bool high_priority(uint32_t msgid);
+
+private:
+    std::function<void(const char* data, size_t size)> _send;
+    mutable std::mutex _mutex;
+    size_t _coalesce_bytes = 0;
+    std::chrono::milliseconds _coalesce_ms{0};
+    bool _nodelay = false;
+    std::string _pending;
+    TimePoint _pending_since;
+    Statistics _statistics;
+
+    /**
+     * @brief Send pending datagram. Called with _mutex held.
+     */
+    void send_pending();
+
+    /**
+     * @brief Read numeric setting that may be stored as number or string
+     */
+    static int setting(const Json::Value& configuration, const std::string& key);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool MavlinkCoalescer::configure(const Json::Value& configuration)
+{
+    const int coalesce_bytes = setting(configuration, json_coalesce_bytes);
+    configure(coalesce_bytes > 0 ? static_cast<size_t>(coalesce_bytes) : 0,
+        setting(configuration, json_coalesce_ms),
+        setting(configuration, json_coalesce_nodelay) != 0);
+    return coalesce_bytes > 0;
+}
+
+inline void MavlinkCoalescer::configure(size_t coalesce_bytes, int coalesce_ms, bool nodelay)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _coalesce_bytes = coalesce_bytes;
+    _coalesce_ms = std::chrono::milliseconds(coalesce_ms > 0 ? coalesce_ms : 0);
+    _nodelay = nodelay;
+    if (_coalesce_bytes == 0 && !_pending.empty()) {
+        send_pending();
+    }
+}
+
+inline void MavlinkCoalescer::push(const char* data, size_t size, TimePoint now)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_coalesce_bytes == 0) {
+        _statistics.frames++;
+        _statistics.frame_bytes += size;
+        _statistics.datagrams++;
+        _send(data, size);
+        return;
+    }
+    size_t offset = 0;
+    while (offset < size) {
+        uint32_t msgid = 0;
+        const size_t length = frame_length(data + offset, size - offset, msgid);
+        if (length == 0) {
+            // Not MAVLink or truncated, keep order by flushing first and pass the rest through unchanged
+            if (!_pending.empty()) {
+                send_pending();
+            }
+            _statistics.malformed++;
+            _statistics.datagrams++;
+            _send(data + offset, size - offset);
+            return;
+        }
+        if (!_pending.empty() && _pending.size() + length > _coalesce_bytes) {
+            _statistics.flushed_full++;
+            send_pending();
+        }
+        if (_pending.empty()) {
+            _pending_since = now;
+        }
+        _pending.append(data + offset, length);
+        _statistics.frames++;
+        _statistics.frame_bytes += length;
+        offset += length;
+        if (_nodelay && high_priority(msgid)) {
+            _statistics.flushed_nodelay++;
+            send_pending();
+        } else if (_pending.size() >= _coalesce_bytes) {
+            _statistics.flushed_full++;
+            send_pending();
+        }
+    }
+}
+
+inline void MavlinkCoalescer::poll(TimePoint now)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_pending.empty() && now - _pending_since >= _coalesce_ms) {
+        _statistics.flushed_timeout++;
+        send_pending();
+    }
+}
+
+inline bool MavlinkCoalescer::next_flush(TimePoint& deadline)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_pending.empty()) {
+        return false;
+    }
+    deadline = _pending_since + _coalesce_ms;
+    return true;
+}
+
+inline void MavlinkCoalescer::flush()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_pending.empty()) {
+        send_pending();
+    }
+}
+
+inline MavlinkCoalescer::Statistics MavlinkCoalescer::get_statistics() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _statistics;
+}
+
+inline size_t MavlinkCoalescer::frame_length(const char* data, size_t size, uint32_t& msgid)
+{
+    const auto* bytes = reinterpret_cast<const uint8_t*>(data);
+    size_t length = 0;
+    if (size >= 8 && bytes[0] == 0xFE) {
+        // v1: magic, len, seq, sysid, compid, msgid, payload, crc
+        length = 8 + bytes[1];
+        msgid = bytes[5];
+    } else if (size >= 12 && bytes[0] == 0xFD) {
+        // v2: magic, len, incompat, compat, seq, sysid, compid, msgid[3], payload, crc, optional signature
+        const bool signed_frame = (bytes[2] & 0x01) != 0;
+        length = 12 + bytes[1] + (signed_frame ? 13 : 0);
+        msgid = bytes[7] | (bytes[8] << 8) | (static_cast<uint32_t>(bytes[9]) << 16);
+    }
+    return length <= size ? length : 0;
+}
+
+inline bool MavlinkCoalescer::high_priority(uint32_t msgid)
+{
+    switch (msgid) {
+        case 11: // SET_MODE
+        case 20: // PARAM_REQUEST_READ
+        case 21: // PARAM_REQUEST_LIST
+        case 22: // PARAM_VALUE
+        case 23: // PARAM_SET
+        case 39: // MISSION_ITEM
+        case 40: // MISSION_REQUEST
+        case 41: // MISSION_SET_CURRENT
+        case 43: // MISSION_REQUEST_LIST
+        case 44: // MISSION_COUNT
+        case 45: // MISSION_CLEAR_ALL
+        case 47: // MISSION_ACK
+        case 51: // MISSION_REQUEST_INT
+        case 73: // MISSION_ITEM_INT
+        case 75: // COMMAND_INT
+        case 76: // COMMAND_LONG
+        case 77: // COMMAND_ACK
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline void MavlinkCoalescer::send_pending()
+{
+    _statistics.datagrams++;
+    _send(_pending.data(), _pending.size());
+    _pending.clear();
+}
+
+inline int MavlinkCoalescer::setting(const Json::Value& configuration, const std::string& key)
+{
+    const Json::Value& value = configuration[key];
+    if (value.isIntegral()) {
+        return value.asInt();
+    }
+    if (value.isBool()) {
+        return value.asBool() ? 1 : 0;
+    }
+    return value.isString() ? std::atoi(value.asCString()) : 0;
+}
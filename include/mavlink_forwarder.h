@@ -0,0 +1,329 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file mavlink_forwarder.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+#include "event_loop.h"
+#include "json.h"
+#include "mavlink_coalescer.h"
+#include "sockets.h"
+
+/**
+ * @brief Forwarding path for MAVLink traffic towards a driver mavlink_port with coalescing.
+ *
+ * Datagrams received on the local listen port, typically a mavlink-router UDP endpoint, are pushed into a
+ * MavlinkCoalescer, and the coalesced datagrams are sent to the destination address, the remote IP and
+ * mavlink_port of a connected driver instance. The coalescer is configured from the driver configuration
+ * (coalesce_bytes, coalesce_ms, coalesce_nodelay). With coalescing disabled, datagrams are forwarded unchanged.
+ *
+ * Both directions share the listen socket, so datagrams are told apart by their source. Datagrams from the
+ * destination address are replies from the remote and are sent uncoalesced to the local peer that forwarded
+ * last, they are dropped while no local peer is known. Everything else is local traffic for the destination.
+ *
+ * Pending frames are flushed at MavlinkCoalescer::next_flush() by a one shot timer. The timer runs on a shared
+ * EventLoop, or it is the poll timeout of the own receive thread.
+ */
+class MavlinkForwarder {
+public:
+    /**
+     * @brief Constructor
+     * @param listen_port local UDP port receiving MAVLink traffic, 0 picks a free port
+     * @param destination_ip address coalesced datagrams are sent to
+     * @param destination_port port coalesced datagrams are sent to
+     */
+    MavlinkForwarder(uint16_t listen_port, const std::string& destination_ip, uint16_t destination_port);
+
+    ~MavlinkForwarder();
+
+    MavlinkForwarder(const MavlinkForwarder&) = delete;
+    MavlinkForwarder& operator=(const MavlinkForwarder&) = delete;
+
+    /**
+     * @brief Configure coalescing from driver configuration
+     * @param configuration json object containing driver configuration
+     * @return true if coalescing is enabled
+     */
+    bool configure(const Json::Value& configuration) { return _coalescer.configure(configuration); }
+
+    /**
+     * @brief Open socket and start own receive thread
+     * @return true if successful
+     */
+    bool init();
+
+    /**
+     * @brief Open socket and serve it and the flush timer from event loop
+     * @param event_loop event loop hosting socket and timer
+     * @return true if successful
+     */
+    bool init(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Flush pending frames, stop thread or remove socket and timer from event loop, close socket
+     */
+    void stop();
+
+    /**
+     * @brief Get local port on which the listen socket is bound
+     * @return local port, 0 if socket is not open
+     */
+    uint16_t get_local_port() const;
+
+    MavlinkCoalescer::Statistics get_statistics() const { return _coalescer.get_statistics(); }
+
+private:
+    static constexpr size_t max_datagram_size = 65536;
+    static constexpr std::chrono::milliseconds idle_poll_timeout{100};
+
+    uint16_t _listen_port;
+    sockaddr_in _destination{};
+    bool _destination_valid = false;
+    sockaddr_in _local_peer{}; // @brief Last source of local traffic, accessed from the receiving thread only
+    bool _local_peer_valid = false;
+    SOCKET _sock = INVALID_SOCKET;
+    std::string _receive_buffer;
+    std::atomic<bool> _should_exit{false};
+    std::thread _worker_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _socket_handle = EventLoop::invalid_handle;
+    EventLoop::Handle _flush_timer = EventLoop::invalid_handle;
+    MavlinkCoalescer::TimePoint _armed_flush{}; // @brief Deadline the flush timer is armed for, accessed from the loop thread only
+    MavlinkCoalescer _coalescer;
+
+    bool open_socket();
+
+    /**
+     * @brief Own receive thread, polls the socket until the next flush deadline
+     */
+    void worker();
+
+    /**
+     * @brief Receive all queued datagrams, push local traffic to the coalescer and pass replies to the local peer
+     * @return false on socket error
+     */
+    bool drain();
+
+    /**
+     * @brief Rearm the flush timer if the flush deadline changed. Called from the loop thread.
+     */
+    void schedule_flush();
+
+    /**
+     * @brief Send coalesced datagram to destination
+     */
+    void send(const char* data, size_t size);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline MavlinkForwarder::MavlinkForwarder(uint16_t listen_port, const std::string& destination_ip, uint16_t destination_port)
+    : _listen_port(listen_port), _coalescer([this](const char* data, size_t size) { send(data, size); })
+{
+    _destination.sin_family = AF_INET;
+    _destination.sin_port = htons(destination_port);
+    _destination_valid = inet_pton(AF_INET, destination_ip.c_str(), &_destination.sin_addr) == 1;
+}
+
+inline MavlinkForwarder::~MavlinkForwarder()
+{
+    stop();
+}
+
+inline bool MavlinkForwarder::init()
+{
+    if (!open_socket()) {
+        return false;
+    }
+    _should_exit = false;
+    _worker_thread = std::thread(&MavlinkForwarder::worker, this);
+    return true;
+}
+
+inline bool MavlinkForwarder::init(std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop || !open_socket()) {
+        return false;
+    }
+    _event_loop = event_loop;
+    // Armed on demand by schedule_flush(), the first expiration finds nothing pending. Added before the socket,
+    // whose callback rearms it.
+    _flush_timer = _event_loop->add_timer(idle_poll_timeout, [this] {
+        _armed_flush = {};
+        _coalescer.poll();
+        schedule_flush();
+    }, false);
+    _socket_handle = _event_loop->add_socket(_sock, [this] {
+        drain();
+        schedule_flush();
+    });
+    if (_socket_handle == EventLoop::invalid_handle || _flush_timer == EventLoop::invalid_handle) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+inline void MavlinkForwarder::stop()
+{
+    _should_exit = true;
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+    if (_event_loop) {
+        _event_loop->remove(_socket_handle);
+        _event_loop->remove(_flush_timer);
+        _socket_handle = EventLoop::invalid_handle;
+        _flush_timer = EventLoop::invalid_handle;
+        _event_loop.reset();
+    }
+    if (_sock != INVALID_SOCKET) {
+        _coalescer.flush();
+        closesocket(_sock);
+        _sock = INVALID_SOCKET;
+    }
+}
+
+inline uint16_t MavlinkForwarder::get_local_port() const
+{
+    if (_sock == INVALID_SOCKET) {
+        return 0;
+    }
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (getsockname(_sock, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+inline bool MavlinkForwarder::open_socket()
+{
+    if (!_destination_valid || _sock != INVALID_SOCKET) {
+        return false;
+    }
+    _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (_sock == INVALID_SOCKET) {
+        return false;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(_listen_port);
+    if (bind(_sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        closesocket(_sock);
+        _sock = INVALID_SOCKET;
+        return false;
+    }
+#ifndef _WIN32
+    fcntl(_sock, F_SETFL, fcntl(_sock, F_GETFL, 0) | O_NONBLOCK);
+#else
+    u_long non_blocking = 1;
+    ioctlsocket(_sock, FIONBIO, &non_blocking);
+#endif
+    _receive_buffer.assign(max_datagram_size, 0);
+    return true;
+}
+
+inline void MavlinkForwarder::worker()
+{
+    while (!_should_exit) {
+        auto timeout = idle_poll_timeout;
+        MavlinkCoalescer::TimePoint deadline;
+        if (_coalescer.next_flush(deadline)) {
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            timeout = std::clamp(remaining, std::chrono::milliseconds(0), idle_poll_timeout);
+        }
+#ifndef _WIN32
+        pollfd fd{_sock, POLLIN, 0};
+        const int res = poll(&fd, 1, static_cast<int>(timeout.count()));
+#else
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(_sock, &read_set);
+        timeval tv{0, static_cast<long>(timeout.count() * 1000)};
+        const int res = select(0, &read_set, nullptr, nullptr, &tv);
+#endif
+        if (res > 0 && !drain()) {
+            break;
+        }
+        _coalescer.poll();
+    }
+}
+
+inline bool MavlinkForwarder::drain()
+{
+    for (;;) {
+        sockaddr_in source{};
+        socklen_t source_length = sizeof(source);
+        const auto received = recvfrom(
+            _sock, &_receive_buffer[0], static_cast<int>(_receive_buffer.size()), 0, reinterpret_cast<sockaddr*>(&source), &source_length);
+        if (received < 0) {
+#ifndef _WIN32
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#else
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+#endif
+        }
+        if (received <= 0) {
+            continue;
+        }
+        if (source.sin_addr.s_addr == _destination.sin_addr.s_addr && source.sin_port == _destination.sin_port) {
+            if (_local_peer_valid) {
+                sendto(_sock, _receive_buffer.data(), static_cast<int>(received), 0, reinterpret_cast<const sockaddr*>(&_local_peer),
+                    sizeof(_local_peer));
+            }
+            continue;
+        }
+        _local_peer = source;
+        _local_peer_valid = true;
+        _coalescer.push(_receive_buffer.data(), static_cast<size_t>(received));
+    }
+}
+
+inline void MavlinkForwarder::schedule_flush()
+{
+    MavlinkCoalescer::TimePoint deadline;
+    if (!_coalescer.next_flush(deadline) || deadline == _armed_flush) {
+        return;
+    }
+    const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (_event_loop->rearm_timer(_flush_timer, std::max(remaining, std::chrono::milliseconds(1)))) {
+        _armed_flush = deadline;
+    }
+}
+
+inline void MavlinkForwarder::send(const char* data, size_t size)
+{
+    if (_sock != INVALID_SOCKET) {
+        sendto(_sock, data, static_cast<int>(size), 0, reinterpret_cast<const sockaddr*>(&_destination), sizeof(_destination));
+    }
+}
@@ -0,0 +1,476 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file message_codec.h
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json.h"
+
+/**
+ * @brief Wire encoding of pairing protocol messages
+ */
+enum class MessageEncoding {
+    JSON = 0, /**< @brief Json string, understood by all peers */
+    TLV = 1 /**< @brief Compact binary tag-length-value encoding keyed on json.h field names */
+};
+
+/**
+ * @brief Encoder & decoder of pairing protocol messages.
+ *
+ * TLV messages start with tlv_magic followed by a version byte, so they can never be confused with
+ * JSON messages that always start with '{'. Each value is a type byte followed by its payload, integers
+ * and lengths are LEB128 varints. Object keys found in the field table are sent as a one byte index, unknown
+ * keys fall back to a name string so that new fields do not break older peers. The field table is append only,
+ * reordering it breaks compatibility with deployed peers.
+ */
+class MessageCodec {
+public:
+    static constexpr uint8_t tlv_magic = 0xC5;
+    static constexpr uint8_t tlv_version = 1;
+    static constexpr int max_depth = 32;
+
+    /**
+     * @brief Encode message
+     * @param val message to encode
+     * @param encoding encoding to use
+     * @param out encoded message. TLV encoding reuses its capacity, JSON is written by jsoncpp into a new string.
+     * @return false if message is not an object
+     */
+    static bool encode(const Json::Value& val, MessageEncoding encoding, std::string& out);
+
+    /**
+     * @brief Decode message, encoding is detected from the first byte
+     * @param data encoded message
+     * @param val decoded message
+     * @return false if message is malformed
+     */
+    static bool decode(const std::string& data, Json::Value& val);
+
+    /**
+     * @brief Detect message encoding
+     * @param data encoded message
+     * @return detected encoding
+     */
+    static MessageEncoding detect(const std::string& data);
+
+    /**
+     * @brief Convert encoding to its name used in json_encodings list
+     * @param encoding encoding to convert
+     * @return encoding name
+     */
+    static std::string encoding_to_string(MessageEncoding encoding);
+
+    /**
+     * @brief Convert encoding name to encoding
+     * @param name encoding name
+     * @param encoding resulting encoding
+     * @return false if encoding is not known
+     */
+    static bool string_to_encoding(const std::string& name, MessageEncoding& encoding);
+
+    /**
+     * @brief Choose best encoding supported by both sides
+     * @param message broadcast, pair or connect message received from remote
+     * @return negotiated encoding, JSON if remote did not advertise json_encodings
+     */
+    static MessageEncoding negotiate(const Json::Value& message);
+
+    /**
+     * @brief Add json_encodings list of locally supported encodings, best first, to broadcast, pair or connect message
+     * @param message message to be sent
+     */
+    static void advertise(Json::Value& message);
+
+private:
+    enum Type : uint8_t {
+        T_NULL = 0,
+        T_FALSE = 1,
+        T_TRUE = 2,
+        T_INT = 3,
+        T_UINT = 4,
+        T_REAL = 5,
+        T_STRING = 6,
+        T_ARRAY = 7,
+        T_OBJECT = 8
+    };
+
+    /**
+     * @brief Field names sent as one byte index, index 0 means name follows as string
+     */
+    static const std::vector<std::string>& fields();
+
+    /**
+     * @brief Field name to its index in fields()
+     */
+    static const std::unordered_map<std::string, uint8_t>& field_indices();
+
+    static void put_varint(uint64_t value, std::string& out);
+
+    static bool get_varint(const std::string& data, size_t& pos, uint64_t& value);
+
+    static void encode_value(const Json::Value& val, std::string& out);
+
+    static bool decode_value(const std::string& data, size_t& pos, int depth, Json::Value& val);
+
+    static bool decode_string(const std::string& data, size_t& pos, std::string& str);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline const std::vector<std::string>& MessageCodec::fields()
+{
+    static const std::vector<std::string> table = {
+        "",
+        json_machine_name,
+        json_request,
+        json_response,
+        json_broadcast,
+        json_pair,
+        json_connect,
+        json_disconnect,
+        json_reconfigure,
+        json_status,
+        json_remote_ip,
+        json_port,
+        json_coalesce_bytes,
+        json_coalesce_ms,
+        json_coalesce_nodelay,
+        json_auto_connect,
+        json_public_key,
+        json_encryption_key,
+        json_rsa_encrypted,
+        json_section_pairing,
+        json_section_connection,
+        json_section_local,
+        json_sequence,
+        json_timestamp,
+        json_multicast_ip,
+        json_encodings,
+        json_drivers,
+        json_driver_name,
+        json_driver_instance,
+        json_driver_ip,
+        json_driver_ip_status,
+        json_driver_vlan,
+        json_driver_mavlink,
+        json_driver_mavlink_port,
+        json_driver_simplified,
+        json_driver_autopair,
+        json_driver_download_bandwidth,
+        json_driver_streaming_priority,
+        json_driver_section,
+        json_driver_mode,
+        json_driver_network_id,
+        json_driver_channel,
+        json_driver_bandwidth,
+        json_driver_tx_power,
+        json_driver_tx_rate,
+        json_driver_telemetry_rssi,
+        json_driver_telemetry_snr,
+        json_driver_telemetry_soc};
+    return table;
+}
+
+inline const std::unordered_map<std::string, uint8_t>& MessageCodec::field_indices()
+{
+    static const std::unordered_map<std::string, uint8_t> indices = [] {
+        std::unordered_map<std::string, uint8_t> map;
+        for (size_t i = 1; i < fields().size(); i++) {
+            map.emplace(fields()[i], static_cast<uint8_t>(i));
+        }
+        return map;
+    }();
+    return indices;
+}
+
+inline void MessageCodec::put_varint(uint64_t value, std::string& out)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool MessageCodec::get_varint(const std::string& data, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        const uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void MessageCodec::encode_value(const Json::Value& val, std::string& out)
+{
+    switch (val.type()) {
+        case Json::nullValue:
+            out.push_back(static_cast<char>(T_NULL));
+            break;
+        case Json::booleanValue:
+            out.push_back(static_cast<char>(val.asBool() ? T_TRUE : T_FALSE));
+            break;
+        case Json::intValue: {
+            // Zigzag keeps small negative numbers short
+            const int64_t i = val.asInt64();
+            out.push_back(static_cast<char>(T_INT));
+            put_varint((static_cast<uint64_t>(i) << 1) ^ static_cast<uint64_t>(i >> 63), out);
+            break;
+        }
+        case Json::uintValue:
+            out.push_back(static_cast<char>(T_UINT));
+            put_varint(val.asUInt64(), out);
+            break;
+        case Json::realValue: {
+            const double d = val.asDouble();
+            uint64_t bits;
+            std::memcpy(&bits, &d, sizeof(bits));
+            out.push_back(static_cast<char>(T_REAL));
+            for (int i = 0; i < 8; i++) {
+                out.push_back(static_cast<char>(bits >> (8 * i)));
+            }
+            break;
+        }
+        case Json::stringValue: {
+            const char* begin = nullptr;
+            const char* end = nullptr;
+            val.getString(&begin, &end);
+            out.push_back(static_cast<char>(T_STRING));
+            put_varint(static_cast<uint64_t>(end - begin), out);
+            out.append(begin, end);
+            break;
+        }
+        case Json::arrayValue:
+            out.push_back(static_cast<char>(T_ARRAY));
+            put_varint(val.size(), out);
+            for (const auto& item : val) {
+                encode_value(item, out);
+            }
+            break;
+        case Json::objectValue: {
+            out.push_back(static_cast<char>(T_OBJECT));
+            put_varint(val.size(), out);
+            const auto& indices = field_indices();
+            for (auto it = val.begin(); it != val.end(); ++it) {
+                const std::string name = it.name();
+                auto index = indices.find(name);
+                if (index != indices.end()) {
+                    out.push_back(static_cast<char>(index->second));
+                } else {
+                    out.push_back(0);
+                    put_varint(name.size(), out);
+                    out.append(name);
+                }
+                encode_value(*it, out);
+            }
+            break;
+        }
+    }
+}
+
+inline bool MessageCodec::encode(const Json::Value& val, MessageEncoding encoding, std::string& out)
+{
+    out.clear();
+    if (!val.isObject()) {
+        return false;
+    }
+    if (encoding == MessageEncoding::JSON) {
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        out = Json::writeString(builder, val);
+        return true;
+    }
+    out.push_back(static_cast<char>(tlv_magic));
+    out.push_back(static_cast<char>(tlv_version));
+    encode_value(val, out);
+    return true;
+}
+
+inline bool MessageCodec::decode_string(const std::string& data, size_t& pos, std::string& str)
+{
+    uint64_t length;
+    if (!get_varint(data, pos, length) || length > data.size() - pos) {
+        return false;
+    }
+    str.assign(data, pos, static_cast<size_t>(length));
+    pos += static_cast<size_t>(length);
+    return true;
+}
+
+inline bool MessageCodec::decode_value(const std::string& data, size_t& pos, int depth, Json::Value& val)
+{
+    if (pos >= data.size() || depth > max_depth) {
+        return false;
+    }
+    const uint8_t type = static_cast<uint8_t>(data[pos++]);
+    uint64_t u;
+    switch (type) {
+        case T_NULL:
+            val = Json::Value();
+            return true;
+        case T_FALSE:
+        case T_TRUE:
+            val = Json::Value(type == T_TRUE);
+            return true;
+        case T_INT:
+            if (!get_varint(data, pos, u)) {
+                return false;
+            }
+            val = Json::Value(static_cast<Json::Int64>((u >> 1) ^ (~(u & 1) + 1)));
+            return true;
+        case T_UINT:
+            if (!get_varint(data, pos, u)) {
+                return false;
+            }
+            val = Json::Value(static_cast<Json::UInt64>(u));
+            return true;
+        case T_REAL: {
+            if (data.size() - pos < 8) {
+                return false;
+            }
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) {
+                bits |= static_cast<uint64_t>(static_cast<uint8_t>(data[pos++])) << (8 * i);
+            }
+            double d;
+            std::memcpy(&d, &bits, sizeof(d));
+            val = Json::Value(d);
+            return true;
+        }
+        case T_STRING: {
+            std::string str;
+            if (!decode_string(data, pos, str)) {
+                return false;
+            }
+            val = Json::Value(str);
+            return true;
+        }
+        case T_ARRAY: {
+            // Every element takes at least one byte, so a count above the remaining size is malformed
+            if (!get_varint(data, pos, u) || u > data.size() - pos) {
+                return false;
+            }
+            val = Json::Value(Json::arrayValue);
+            for (uint64_t i = 0; i < u; i++) {
+                if (!decode_value(data, pos, depth + 1, val[static_cast<Json::ArrayIndex>(i)])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case T_OBJECT: {
+            if (!get_varint(data, pos, u) || u > (data.size() - pos) / 2) {
+                return false;
+            }
+            val = Json::Value(Json::objectValue);
+            const auto& table = fields();
+            for (uint64_t i = 0; i < u; i++) {
+                if (pos >= data.size()) {
+                    return false;
+                }
+                const uint8_t index = static_cast<uint8_t>(data[pos++]);
+                std::string name;
+                if (index == 0) {
+                    if (!decode_string(data, pos, name)) {
+                        return false;
+                    }
+                } else if (index < table.size()) {
+                    name = table[index];
+                } else {
+                    return false;
+                }
+                if (!decode_value(data, pos, depth + 1, val[name])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+inline bool MessageCodec::decode(const std::string& data, Json::Value& val)
+{
+    if (detect(data) == MessageEncoding::JSON) {
+        Json::CharReaderBuilder builder;
+        std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        std::string errors;
+        return reader->parse(data.data(), data.data() + data.size(), &val, &errors) && val.isObject();
+    }
+    if (data.size() < 2 || static_cast<uint8_t>(data[1]) != tlv_version) {
+        return false;
+    }
+    size_t pos = 2;
+    return decode_value(data, pos, 0, val) && pos == data.size() && val.isObject();
+}
+
+inline MessageEncoding MessageCodec::detect(const std::string& data)
+{
+    return !data.empty() && static_cast<uint8_t>(data[0]) == tlv_magic ? MessageEncoding::TLV : MessageEncoding::JSON;
+}
+
+inline std::string MessageCodec::encoding_to_string(MessageEncoding encoding)
+{
+    return encoding == MessageEncoding::TLV ? "tlv" : "json";
+}
+
+inline bool MessageCodec::string_to_encoding(const std::string& name, MessageEncoding& encoding)
+{
+    if (name == "tlv") {
+        encoding = MessageEncoding::TLV;
+    } else if (name == "json") {
+        encoding = MessageEncoding::JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline MessageEncoding MessageCodec::negotiate(const Json::Value& message)
+{
+    // Remote list is ordered best first, pick its first entry we understand
+    const Json::Value& encodings = message[json_encodings];
+    if (encodings.isArray()) {
+        for (const auto& name : encodings) {
+            MessageEncoding encoding;
+            if (name.isString() && string_to_encoding(name.asString(), encoding)) {
+                return encoding;
+            }
+        }
+    }
+    return MessageEncoding::JSON;
+}
+
+inline void MessageCodec::advertise(Json::Value& message)
+{
+    Json::Value encodings(Json::arrayValue);
+    encodings.append(encoding_to_string(MessageEncoding::TLV));
+    encodings.append(encoding_to_string(MessageEncoding::JSON));
+    message[json_encodings] = encodings;
+}
@@ -0,0 +1,405 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file message_header.h
+ */
+
+#pragma once
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "json.h"
+#include "lru_cache.h"
+
+/**
+ * @brief Small cleartext header prepended to pairing protocol datagrams.
+ *
+ * Layout (network byte order):
+ *   magic(1) version(1) type(1) flags(1) sender_id(8) sequence(8) tag(8) payload...
+ *
+ * It lets the receiver drop irrelevant, duplicate or unknown-sender datagrams before any RSA/AES work.
+ * The tag is a truncated HMAC-SHA256 over the datagram with the tag field zeroed, keyed with the remote
+ * session key once a session exists, otherwise with a key derived from the configured encryption_key.
+ * Verifying it costs two hash passes, so forged datagrams are rejected without private key operations.
+ * Datagrams without the header (first byte '{' or MessageCodec::tlv_magic) come from older peers and take
+ * the legacy path.
+ *
+ * The network key is shared by every node configured with the same encryption_key, so a network key tag
+ * only proves the sender is one of them: any paired node can forge sender_id. Only session key tags bind
+ * a datagram to a single remote.
+ */
+struct MessageHeader {
+    static constexpr uint8_t magic = 0xA7;
+    static constexpr uint8_t version = 1;
+    static constexpr size_t size = 28;
+    static constexpr size_t tag_offset = 20;
+    static constexpr size_t tag_size = 8;
+
+    /**
+     * @brief Message type, mirrors json_request / json_response values
+     */
+    enum Type : uint8_t {
+        BROADCAST = 0,
+        PAIR_REQUEST = 1,
+        PAIR_RESPONSE = 2,
+        CONNECT_REQUEST = 3,
+        CONNECT_RESPONSE = 4,
+        DISCONNECT = 5,
+        RECONFIGURE = 6,
+        STATUS = 7,
+        SESSION = 8,
+        PROBE = 9,
+        UNKNOWN = 0xFF
+    };
+
+    /**
+     * @brief Header flags
+     */
+    enum Flags : uint8_t {
+        SESSION_KEY = 1 << 0 /**< @brief Tag is keyed with session key instead of network key */
+    };
+
+    Type type = UNKNOWN; // @brief Message type
+    uint8_t flags = 0; // @brief Flags bits
+    uint64_t sender_id = 0; // @brief Hash of sender machine name
+    uint64_t sequence = 0; // @brief Per-sender monotonic sequence
+    uint64_t tag = 0; // @brief Authentication tag
+
+    /**
+     * @brief Compute sender id from machine name
+     * @param machine_name sender machine name
+     * @return stable 64 bit id, FNV-1a
+     */
+    static uint64_t sender_id_from_name(const std::string& machine_name);
+
+    /**
+     * @brief Derive tag key from a shared secret, so the secret itself is never used as MAC key
+     * @param secret configured encryption_key or session key
+     * @return 32 byte key, empty on OpenSSL failure
+     */
+    static std::string derive_key(const std::string& secret);
+
+    /**
+     * @brief Check if datagram starts with a header, without validating it
+     */
+    static bool present(const std::string& datagram) { return !datagram.empty() && static_cast<uint8_t>(datagram[0]) == magic; }
+
+    /**
+     * @brief Parse header fields. Does not verify the tag.
+     * @param datagram received datagram
+     * @param header parsed header
+     * @return false if datagram is too short or version is not supported
+     */
+    static bool parse(const std::string& datagram, MessageHeader& header);
+
+    /**
+     * @brief Compute tag and prepend header to payload
+     * @param key tag key
+     * @param payload encrypted message
+     * @param out resulting datagram, capacity is reused
+     * @return false if key is empty or the tag could not be computed
+     */
+    bool seal(const std::string& key, const std::string& payload, std::string& out);
+
+    /**
+     * @brief Verify tag of parsed datagram
+     * @param key tag key
+     * @param datagram whole received datagram
+     * @return true if tag matches, false if key is empty or the tag could not be computed
+     */
+    bool verify(const std::string& key, const std::string& datagram) const;
+
+    /**
+     * @brief Get header type of a json message
+     * @param message message with json_request or json_response
+     * @return header type, UNKNOWN if not a pairing protocol message
+     */
+    static Type type_from_json(const Json::Value& message);
+
+private:
+    /**
+     * @brief Compute truncated HMAC-SHA256 over datagram
+     * @param key tag key, must not be empty
+     * @param datagram header with zeroed tag field followed by payload
+     * @param tag first tag_size bytes of the MAC, big endian
+     * @return false if key is empty or on OpenSSL failure
+     */
+    static bool compute_tag(const std::string& key, const std::string& datagram, uint64_t& tag);
+
+    static void put_u64(std::string& out, size_t offset, uint64_t value);
+
+    static uint64_t get_u64(const std::string& in, size_t offset);
+};
+
+/**
+ * @brief Receive side header policy, checked before any decryption.
+ *
+ * Once an origin sent a datagram with a valid header, headerless datagrams from it are rejected, so an
+ * attacker spoofing that origin cannot fall back to the legacy path. Once a session exists with a sender,
+ * only headers tagged with its session key are accepted from it. Thread safe.
+ */
+class MessageHeaderPolicy {
+public:
+    static constexpr size_t default_max_origins = 4096;
+
+    /**
+     * @brief Result of checking a datagram
+     */
+    enum class Verdict {
+        ACCEPT, /**< @brief Header present and tag verified */
+        LEGACY, /**< @brief No header, origin never sent one, take the legacy path */
+        REJECT /**< @brief Drop without decrypting */
+    };
+
+    /**
+     * @brief Constructor
+     * @param encryption_key configured network encryption key
+     * @param max_origins number of origins remembered as sending headers, least recently seen are forgotten
+     */
+    explicit MessageHeaderPolicy(const std::string& encryption_key, size_t max_origins = default_max_origins);
+
+    /**
+     * @brief Check received datagram
+     * @param datagram received datagram
+     * @param from origin of the datagram
+     * @param header parsed header, valid if ACCEPT is returned
+     * @return verdict
+     */
+    Verdict check(const std::string& datagram, const std::string& from, MessageHeader& header);
+
+    /**
+     * @brief Require session key tags from sender once a session exists
+     * @param sender_id sender id of the remote
+     * @param session_key session key shared with the remote
+     */
+    void set_session_key(uint64_t sender_id, const std::string& session_key);
+
+    /**
+     * @brief Accept network key tags from sender again, e.g. when the remote is unpaired
+     * @param sender_id sender id of the remote
+     */
+    void remove_session(uint64_t sender_id);
+
+    /**
+     * @brief Get tag key for sending to a remote
+     * @param sender_id sender id of the remote, 0 for broadcast
+     * @param flags set to SESSION_KEY if the session key is used
+     * @return tag key
+     */
+    std::string send_key(uint64_t sender_id, uint8_t& flags);
+
+private:
+    std::mutex _mutex;
+    std::string _network_key; // @brief Tag key derived from encryption_key
+    std::map<uint64_t, std::string> _session_keys; // @brief Tag keys derived from session keys, by sender id
+    LruCache<std::string, bool> _header_origins; // @brief Origins that sent a valid header
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline uint64_t MessageHeader::sender_id_from_name(const std::string& machine_name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : machine_name) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline std::string MessageHeader::derive_key(const std::string& secret)
+{
+    static const std::string label = "cm message header";
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (!HMAC(EVP_sha256(), secret.data(), static_cast<int>(secret.size()),
+              reinterpret_cast<const unsigned char*>(label.data()), label.size(), mac, &length)) {
+        return std::string();
+    }
+    return std::string(reinterpret_cast<const char*>(mac), length);
+}
+
+inline bool MessageHeader::parse(const std::string& datagram, MessageHeader& header)
+{
+    if (datagram.size() < size || !present(datagram) || static_cast<uint8_t>(datagram[1]) != version) {
+        return false;
+    }
+    header.type = static_cast<Type>(static_cast<uint8_t>(datagram[2]));
+    header.flags = static_cast<uint8_t>(datagram[3]);
+    header.sender_id = get_u64(datagram, 4);
+    header.sequence = get_u64(datagram, 12);
+    header.tag = get_u64(datagram, tag_offset);
+    return true;
+}
+
+inline bool MessageHeader::seal(const std::string& key, const std::string& payload, std::string& out)
+{
+    out.assign(size, '\0');
+    out[0] = static_cast<char>(magic);
+    out[1] = static_cast<char>(version);
+    out[2] = static_cast<char>(type);
+    out[3] = static_cast<char>(flags);
+    put_u64(out, 4, sender_id);
+    put_u64(out, 12, sequence);
+    out.append(payload);
+    if (!compute_tag(key, out, tag)) {
+        out.clear();
+        return false;
+    }
+    put_u64(out, tag_offset, tag);
+    return true;
+}
+
+inline bool MessageHeader::verify(const std::string& key, const std::string& datagram) const
+{
+    if (datagram.size() < size) {
+        return false;
+    }
+    std::string zeroed = datagram;
+    put_u64(zeroed, tag_offset, 0);
+    uint64_t computed = 0;
+    if (!compute_tag(key, zeroed, computed)) {
+        return false;
+    }
+    unsigned char expected[tag_size];
+    unsigned char received[tag_size];
+    for (size_t i = 0; i < tag_size; i++) {
+        expected[i] = static_cast<unsigned char>(computed >> (8 * (tag_size - 1 - i)));
+        received[i] = static_cast<unsigned char>(datagram[tag_offset + i]);
+    }
+    return CRYPTO_memcmp(expected, received, tag_size) == 0;
+}
+
+inline MessageHeader::Type MessageHeader::type_from_json(const Json::Value& message)
+{
+    const bool response = message.isMember(json_response);
+    const std::string value = (response ? message[json_response] : message[json_request]).asString();
+    if (value == json_broadcast) {
+        return BROADCAST;
+    } else if (value == json_pair) {
+        return response ? PAIR_RESPONSE : PAIR_REQUEST;
+    } else if (value == json_connect) {
+        return response ? CONNECT_RESPONSE : CONNECT_REQUEST;
+    } else if (value == json_disconnect) {
+        return DISCONNECT;
+    } else if (value == json_reconfigure) {
+        return RECONFIGURE;
+    } else if (value == json_status) {
+        return STATUS;
+    } else if (value == json_probe) {
+        return PROBE;
+    }
+    return UNKNOWN;
+}
+
+inline bool MessageHeader::compute_tag(const std::string& key, const std::string& datagram, uint64_t& tag)
+{
+    if (key.empty()) {
+        return false;
+    }
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (!HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+              reinterpret_cast<const unsigned char*>(datagram.data()), datagram.size(), mac, &length)
+        || length < tag_size) {
+        return false;
+    }
+    tag = 0;
+    for (size_t i = 0; i < tag_size; i++) {
+        tag = (tag << 8) | mac[i];
+    }
+    return true;
+}
+
+inline void MessageHeader::put_u64(std::string& out, size_t offset, uint64_t value)
+{
+    for (size_t i = 0; i < 8; i++) {
+        out[offset + i] = static_cast<char>(value >> (8 * (7 - i)));
+    }
+}
+
+inline uint64_t MessageHeader::get_u64(const std::string& in, size_t offset)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++) {
+        value = (value << 8) | static_cast<uint8_t>(in[offset + i]);
+    }
+    return value;
+}
+
+inline MessageHeaderPolicy::MessageHeaderPolicy(const std::string& encryption_key, size_t max_origins)
+    : _network_key(MessageHeader::derive_key(encryption_key)), _header_origins(max_origins)
+{}
+
+inline MessageHeaderPolicy::Verdict MessageHeaderPolicy::check(const std::string& datagram, const std::string& from,
+                                                                MessageHeader& header)
+{
+    if (!MessageHeader::present(datagram)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _header_origins.find(from) ? Verdict::REJECT : Verdict::LEGACY;
+    }
+    if (!MessageHeader::parse(datagram, header)) {
+        return Verdict::REJECT;
+    }
+    std::string key;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _session_keys.find(header.sender_id);
+        const bool session = it != _session_keys.end();
+        if (session != ((header.flags & MessageHeader::SESSION_KEY) != 0)) {
+            return Verdict::REJECT;
+        }
+        key = session ? it->second : _network_key;
+    }
+    if (!header.verify(key, datagram)) {
+        return Verdict::REJECT;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _header_origins.insert(from, true);
+    return Verdict::ACCEPT;
+}
+
+inline void MessageHeaderPolicy::set_session_key(uint64_t sender_id, const std::string& session_key)
+{
+    const std::string key = MessageHeader::derive_key(session_key);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _session_keys[sender_id] = key;
+}
+
+inline void MessageHeaderPolicy::remove_session(uint64_t sender_id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _session_keys.erase(sender_id);
+}
+
+inline std::string MessageHeaderPolicy::send_key(uint64_t sender_id, uint8_t& flags)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _session_keys.find(sender_id);
+    if (sender_id != 0 && it != _session_keys.end()) {
+        flags |= MessageHeader::SESSION_KEY;
+        return it->second;
+    }
+    flags &= ~MessageHeader::SESSION_KEY;
+    return _network_key;
+}
@@ -0,0 +1,359 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file openssl_session.h
+ */
+
+#pragma once
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "replay_window.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error "OpenSSL_Session needs X25519 raw key support from OpenSSL 1.1.1"
+#endif
+
+/**
+ * @brief Per-remote session: ephemeral X25519 key agreement, HKDF-SHA256 key derivation and AES-256-GCM
+ * message protection. Authentication of the exchanged public keys is done by the caller with RSA.
+ *
+ * Encrypted message is an 8 byte big endian counter, the cipher text and the 16 byte GCM tag. The counter
+ * forms the nonce and restarts with every new key, each direction has its own key so nonces never repeat.
+ * After rekeying the previous receive key is kept until the first message under the new key verifies, so
+ * messages the remote sent before it switched keys are not lost. Received counters are recorded in a replay
+ * window per receive key once the message authenticated, so a replayed message or one older than the window
+ * is rejected. Windows start over with each derived key.
+ */
+class OpenSSL_Session {
+public:
+    static const size_t key_size = 32;
+    static const size_t iv_size = 12;
+    static const size_t tag_size = 16;
+    static const size_t counter_size = 8;
+
+    OpenSSL_Session();
+
+    ~OpenSSL_Session();
+
+    OpenSSL_Session(const OpenSSL_Session&) = delete;
+
+    OpenSSL_Session& operator=(const OpenSSL_Session&) = delete;
+
+    /**
+     * @brief Generate new ephemeral key pair. Previous session keys stay valid until derive() succeeds.
+     * @return raw public key to be sent to remote, empty on error
+     */
+    std::string start();
+
+    /**
+     * @brief Derive session keys from remote ephemeral public key. Ephemeral private key is erased afterwards.
+     * @param remote_public_key raw remote public key
+     * @param initiator true on the side that sent its public key first, selects tx/rx key order
+     * @return true if session keys were derived
+     */
+    bool derive(const std::string& remote_public_key, bool initiator);
+
+    bool established() const { return _established; }
+
+    /**
+     * @brief Should session be renegotiated
+     * @param max_messages maximum number of messages encrypted with the same keys
+     * @param max_age maximum age of session keys
+     * @return true if rekeying is needed
+     */
+    bool needs_rekey(uint64_t max_messages, std::chrono::milliseconds max_age) const;
+
+    std::string encrypt(const std::string& plain_text);
+
+    std::string decrypt(const std::string& cipher_text);
+
+    /**
+     * @brief Encrypt into caller provided buffer. Buffer capacity is reused, so steady state encryption does not allocate.
+     * @return false if there is no session or encryption failed
+     */
+    bool encrypt(const char* plain_text, size_t size, std::string& cipher_text);
+
+    /**
+     * @brief Decrypt into caller provided buffer. Buffer capacity is reused, so steady state decryption does not allocate.
+     * @return false if there is no session, the counter was already received, decryption or authentication failed
+     */
+    bool decrypt(const char* cipher_text, size_t size, std::string& plain_text);
+
+    /**
+     * @brief Erase all keys
+     */
+    void reset();
+
+private:
+    EVP_PKEY* _ephemeral_key = nullptr;
+    EVP_CIPHER_CTX* _enc_cipher_context = nullptr;
+    EVP_CIPHER_CTX* _dec_cipher_context = nullptr;
+    bool _established = false;
+    bool _previous_rx_valid = false; // @brief Remote may still send with _previous_rx_key
+    unsigned char _tx_key[key_size] = {};
+    unsigned char _rx_key[key_size] = {};
+    unsigned char _previous_rx_key[key_size] = {};
+    uint64_t _tx_counter = 0; // @brief Used as GCM nonce, never repeats for the same key
+    ReplayWindow<> _rx_window; // @brief Counters received under _rx_key
+    ReplayWindow<> _previous_rx_window; // @brief Counters received under _previous_rx_key
+    std::chrono::steady_clock::time_point _established_time;
+
+    /**
+     * @brief Decrypt and authenticate with one key
+     * @return false if authentication failed
+     */
+    bool decrypt_with(const unsigned char* key, const char* cipher_text, size_t size, std::string& plain_text);
+
+    /**
+     * @brief Build GCM nonce from message counter
+     */
+    static void make_iv(uint64_t counter, unsigned char* iv);
+
+    /**
+     * @brief Read message counter from the start of an encrypted message
+     */
+    static uint64_t read_counter(const char* cipher_text);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline OpenSSL_Session::OpenSSL_Session()
+    : _enc_cipher_context(EVP_CIPHER_CTX_new())
+    , _dec_cipher_context(EVP_CIPHER_CTX_new())
+{
+    EVP_EncryptInit_ex(_enc_cipher_context, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+    EVP_DecryptInit_ex(_dec_cipher_context, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+}
+
+inline OpenSSL_Session::~OpenSSL_Session()
+{
+    reset();
+    EVP_CIPHER_CTX_free(_enc_cipher_context);
+    EVP_CIPHER_CTX_free(_dec_cipher_context);
+}
+
+inline std::string OpenSSL_Session::start()
+{
+    EVP_PKEY_free(_ephemeral_key);
+    _ephemeral_key = nullptr;
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    if (!context || EVP_PKEY_keygen_init(context) <= 0 || EVP_PKEY_keygen(context, &_ephemeral_key) <= 0) {
+        EVP_PKEY_CTX_free(context);
+        return {};
+    }
+    EVP_PKEY_CTX_free(context);
+    std::string public_key(key_size, '\0');
+    size_t length = public_key.size();
+    if (EVP_PKEY_get_raw_public_key(_ephemeral_key, reinterpret_cast<unsigned char*>(&public_key[0]), &length) <= 0) {
+        return {};
+    }
+    public_key.resize(length);
+    return public_key;
+}
+
+inline bool OpenSSL_Session::derive(const std::string& remote_public_key, bool initiator)
+{
+    if (!_ephemeral_key || remote_public_key.size() != key_size) {
+        return false;
+    }
+    unsigned char local_public_key[key_size];
+    size_t local_length = key_size;
+    EVP_PKEY* remote_key = EVP_PKEY_new_raw_public_key(
+        EVP_PKEY_X25519, nullptr, reinterpret_cast<const unsigned char*>(remote_public_key.data()), remote_public_key.size());
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new(_ephemeral_key, nullptr);
+    unsigned char shared[key_size];
+    size_t shared_length = sizeof(shared);
+    const bool agreed = remote_key && context && EVP_PKEY_get_raw_public_key(_ephemeral_key, local_public_key, &local_length) > 0
+                        && EVP_PKEY_derive_init(context) > 0 && EVP_PKEY_derive_set_peer(context, remote_key) > 0
+                        && EVP_PKEY_derive(context, shared, &shared_length) > 0;
+    EVP_PKEY_CTX_free(context);
+    EVP_PKEY_free(remote_key);
+    EVP_PKEY_free(_ephemeral_key);
+    _ephemeral_key = nullptr;
+    if (!agreed) {
+        OPENSSL_cleanse(shared, sizeof(shared));
+        return false;
+    }
+
+    // Salt binds both public keys in initiator, responder order, so both sides derive the same keys
+    unsigned char salt[2 * key_size];
+    const unsigned char* remote = reinterpret_cast<const unsigned char*>(remote_public_key.data());
+    std::memcpy(salt, initiator ? local_public_key : remote, key_size);
+    std::memcpy(salt + key_size, initiator ? remote : local_public_key, key_size);
+    static const char info[] = "connection manager session v1";
+    unsigned char keys[2 * key_size];
+    size_t keys_length = sizeof(keys);
+    EVP_PKEY_CTX* hkdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    const bool derived = hkdf && EVP_PKEY_derive_init(hkdf) > 0 && EVP_PKEY_CTX_set_hkdf_md(hkdf, EVP_sha256()) > 0
+                         && EVP_PKEY_CTX_set1_hkdf_salt(hkdf, salt, sizeof(salt)) > 0
+                         && EVP_PKEY_CTX_set1_hkdf_key(hkdf, shared, static_cast<int>(shared_length)) > 0
+                         && EVP_PKEY_CTX_add1_hkdf_info(hkdf, reinterpret_cast<const unsigned char*>(info), sizeof(info) - 1) > 0
+                         && EVP_PKEY_derive(hkdf, keys, &keys_length) > 0;
+    EVP_PKEY_CTX_free(hkdf);
+    OPENSSL_cleanse(shared, sizeof(shared));
+    if (!derived) {
+        OPENSSL_cleanse(keys, sizeof(keys));
+        return false;
+    }
+    if (_established) {
+        std::memcpy(_previous_rx_key, _rx_key, key_size);
+        _previous_rx_window = _rx_window;
+        _previous_rx_valid = true;
+    }
+    _rx_window.reset();
+    // First half protects initiator to responder direction
+    std::memcpy(_tx_key, initiator ? keys : keys + key_size, key_size);
+    std::memcpy(_rx_key, initiator ? keys + key_size : keys, key_size);
+    OPENSSL_cleanse(keys, sizeof(keys));
+    _tx_counter = 0;
+    _established = true;
+    _established_time = std::chrono::steady_clock::now();
+    return true;
+}
+
+inline bool OpenSSL_Session::needs_rekey(uint64_t max_messages, std::chrono::milliseconds max_age) const
+{
+    return !_established || _tx_counter >= max_messages || std::chrono::steady_clock::now() - _established_time >= max_age;
+}
+
+inline void OpenSSL_Session::make_iv(uint64_t counter, unsigned char* iv)
+{
+    std::memset(iv, 0, iv_size);
+    for (size_t i = 0; i < counter_size; i++) {
+        iv[iv_size - 1 - i] = static_cast<unsigned char>(counter >> (8 * i));
+    }
+}
+
+inline uint64_t OpenSSL_Session::read_counter(const char* cipher_text)
+{
+    uint64_t counter = 0;
+    for (size_t i = 0; i < counter_size; i++) {
+        counter = (counter << 8) | static_cast<unsigned char>(cipher_text[i]);
+    }
+    return counter;
+}
+
+inline bool OpenSSL_Session::encrypt(const char* plain_text, size_t size, std::string& cipher_text)
+{
+    if (!_established) {
+        return false;
+    }
+    const uint64_t counter = _tx_counter++;
+    unsigned char iv[iv_size];
+    make_iv(counter, iv);
+    cipher_text.resize(counter_size + size + tag_size);
+    unsigned char* out = reinterpret_cast<unsigned char*>(&cipher_text[0]);
+    std::memcpy(out, iv + iv_size - counter_size, counter_size);
+    int length = 0;
+    int final_length = 0;
+    if (EVP_EncryptInit_ex(_enc_cipher_context, nullptr, nullptr, _tx_key, iv) <= 0
+        || EVP_EncryptUpdate(_enc_cipher_context, nullptr, &length, out, counter_size) <= 0
+        || EVP_EncryptUpdate(
+               _enc_cipher_context, out + counter_size, &length, reinterpret_cast<const unsigned char*>(plain_text),
+               static_cast<int>(size))
+               <= 0
+        || EVP_EncryptFinal_ex(_enc_cipher_context, out + counter_size + length, &final_length) <= 0
+        || EVP_CIPHER_CTX_ctrl(_enc_cipher_context, EVP_CTRL_GCM_GET_TAG, tag_size, out + counter_size + size) <= 0) {
+        cipher_text.clear();
+        return false;
+    }
+    return true;
+}
+
+inline bool OpenSSL_Session::decrypt_with(const unsigned char* key, const char* cipher_text, size_t size, std::string& plain_text)
+{
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(cipher_text);
+    unsigned char iv[iv_size] = {};
+    std::memcpy(iv + iv_size - counter_size, in, counter_size);
+    const size_t text_size = size - counter_size - tag_size;
+    plain_text.resize(text_size);
+    unsigned char* out = reinterpret_cast<unsigned char*>(&plain_text[0]);
+    unsigned char tag[tag_size];
+    std::memcpy(tag, in + counter_size + text_size, tag_size);
+    int length = 0;
+    int final_length = 0;
+    // Counter is authenticated as additional data, so it cannot be altered to shift the nonce
+    if (EVP_DecryptInit_ex(_dec_cipher_context, nullptr, nullptr, key, iv) <= 0
+        || EVP_DecryptUpdate(_dec_cipher_context, nullptr, &length, in, counter_size) <= 0
+        || EVP_DecryptUpdate(_dec_cipher_context, out, &length, in + counter_size, static_cast<int>(text_size)) <= 0
+        || EVP_CIPHER_CTX_ctrl(_dec_cipher_context, EVP_CTRL_GCM_SET_TAG, tag_size, tag) <= 0
+        || EVP_DecryptFinal_ex(_dec_cipher_context, out + length, &final_length) <= 0) {
+        plain_text.clear();
+        return false;
+    }
+    return true;
+}
+
+inline bool OpenSSL_Session::decrypt(const char* cipher_text, size_t size, std::string& plain_text)
+{
+    if (!_established || size < counter_size + tag_size) {
+        return false;
+    }
+    // Window is updated only after authentication, so forged counters cannot advance it
+    const uint64_t counter = read_counter(cipher_text);
+    if (_rx_window.check(counter) && decrypt_with(_rx_key, cipher_text, size, plain_text)) {
+        _rx_window.update(counter);
+        if (_previous_rx_valid) {
+            // Remote switched to the new key, messages under the old one can no longer arrive in order
+            OPENSSL_cleanse(_previous_rx_key, key_size);
+            _previous_rx_window.reset();
+            _previous_rx_valid = false;
+        }
+        return true;
+    }
+    if (_previous_rx_valid && _previous_rx_window.check(counter)
+        && decrypt_with(_previous_rx_key, cipher_text, size, plain_text)) {
+        _previous_rx_window.update(counter);
+        return true;
+    }
+    plain_text.clear();
+    return false;
+}
+
+inline std::string OpenSSL_Session::encrypt(const std::string& plain_text)
+{
+    std::string cipher_text;
+    encrypt(plain_text.data(), plain_text.size(), cipher_text);
+    return cipher_text;
+}
+
+inline std::string OpenSSL_Session::decrypt(const std::string& cipher_text)
+{
+    std::string plain_text;
+    decrypt(cipher_text.data(), cipher_text.size(), plain_text);
+    return plain_text;
+}
+
+inline void OpenSSL_Session::reset()
+{
+    EVP_PKEY_free(_ephemeral_key);
+    _ephemeral_key = nullptr;
+    OPENSSL_cleanse(_tx_key, key_size);
+    OPENSSL_cleanse(_rx_key, key_size);
+    OPENSSL_cleanse(_previous_rx_key, key_size);
+    _previous_rx_valid = false;
+    _rx_window.reset();
+    _previous_rx_window.reset();
+    _established = false;
+    _tx_counter = 0;
+}
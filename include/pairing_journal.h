@@ -0,0 +1,555 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file pairing_journal.h
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "event_loop.h"
+#include "json.h"
+
+/**
+ * @brief Append-only journal of pairing info changes on top of a json configuration file.
+ *
+ * Each change is appended to "<configuration_file>.journal" as one line with a CRC32 and a compact json record,
+ * and applied to the in-memory configuration. Paired remotes are kept in the "paired" object of the
+ * configuration, other top level values are set with append_value().
+ *
+ * Durability: an append is fsynced right away if sync_period has passed since the last sync, otherwise it stays
+ * in the page cache until the next sync. Pending records are synced by the timer started with
+ * start_sync_timer(), or, without an event loop, by the owner calling sync() periodically, e.g. from its worker
+ * thread. close() and the destructor always sync. A crash loses at most the records of the last sync_period.
+ *
+ * Compaction: when the journal exceeds compaction_records or compaction_bytes, the configuration is written to
+ * "<configuration_file>.tmp", fsynced, renamed over the configuration file, and the parent directory is fsynced
+ * so that the rename itself is durable. Only then is the journal truncated. Records only set or erase values, so
+ * replaying a journal that survived a crash between rename and truncation gives the same result.
+ *
+ * On load a torn or corrupted tail record, left by a crash during append, is dropped and cut off the journal.
+ * All methods are thread safe.
+ */
+class PairingJournal {
+public:
+    static constexpr size_t compaction_records = 256;
+    static constexpr size_t compaction_bytes = 1024 * 1024;
+    static constexpr std::chrono::milliseconds sync_period{1000}; // fsync batching period
+
+    PairingJournal() = default;
+
+    ~PairingJournal() { close(); }
+
+    PairingJournal(const PairingJournal&) = delete;
+    PairingJournal& operator=(const PairingJournal&) = delete;
+
+    /**
+     * @brief Load configuration file, replay journal on top of it and open journal for appending
+     * @param configuration_file path of the base configuration file
+     * @param configuration resulting configuration
+     * @return false if journal could not be opened for appending
+     */
+    bool load(const std::string& configuration_file, Json::Value& configuration);
+
+    /**
+     * @brief Append paired remote info
+     * @param name remote name
+     * @param val remote info
+     * @return true if record was appended
+     */
+    bool append_paired(const std::string& name, const Json::Value& val);
+
+    /**
+     * @brief Append removal of paired remote
+     * @param name remote name
+     * @return true if record was appended
+     */
+    bool append_removed(const std::string& name);
+
+    /**
+     * @brief Append change of single top level configuration value, e.g. last_connected
+     * @param key configuration key
+     * @param val new value
+     * @return true if record was appended
+     */
+    bool append_value(const std::string& key, const Json::Value& val);
+
+    /**
+     * @brief fsync appended records if sync_period passed since the last sync
+     * @param force sync regardless of sync_period
+     */
+    void sync(bool force = false);
+
+    /**
+     * @brief Sync pending records every sync_period from a timer on the event loop, stopped by close()
+     * @param event_loop event loop hosting the timer
+     * @return true if timer was added
+     */
+    bool start_sync_timer(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Get configuration with all appended records applied
+     * @return configuration copy
+     */
+    Json::Value configuration() const;
+
+    /**
+     * @brief Write full configuration crash safely and truncate journal. Called by appends when the journal
+     * exceeds its limits.
+     * @return true if successful
+     */
+    bool compact();
+
+    /**
+     * @brief Stop sync timer, sync and close journal
+     */
+    void close();
+
+private:
+    mutable std::mutex _mutex;
+    std::string _configuration_file;
+    std::string _journal_file;
+    Json::Value _configuration{Json::objectValue};
+    int _journal_fd = -1;
+    size_t _records = 0;
+    size_t _bytes = 0;
+    bool _unsynced = false;
+    std::chrono::steady_clock::time_point _last_sync;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _sync_timer = EventLoop::invalid_handle;
+
+    /**
+     * @brief Append one record to the journal file and apply it. Called with _mutex held.
+     * @param record json record
+     * @return true if record was written
+     */
+    bool append(const Json::Value& record);
+
+    /**
+     * @brief fsync journal. Called with _mutex held.
+     */
+    void sync_locked(bool force);
+
+    /**
+     * @brief Write configuration to temp file, rename it over the configuration file and truncate journal.
+     * Called with _mutex held.
+     */
+    bool compact_locked();
+
+    /**
+     * @brief Apply one journal record to configuration
+     * @param record json record
+     * @param configuration configuration to update
+     * @return false if record is malformed
+     */
+    static bool apply(const Json::Value& record, Json::Value& configuration);
+
+    /**
+     * @brief Format record as journal line "<crc32 hex> <compact json>\n"
+     */
+    static std::string format_line(const Json::Value& record);
+
+    /**
+     * @brief Parse journal line
+     * @return false if line is torn or its checksum does not match
+     */
+    static bool parse_line(const std::string& line, Json::Value& record);
+
+    static uint32_t crc32(const std::string& data);
+
+    static bool write_all(int fd, const std::string& data);
+
+    static bool sync_fd(int fd);
+
+    /**
+     * @brief fsync directory containing path, so that a rename in it survives power loss
+     */
+    static bool sync_parent_directory(const std::string& path);
+
+    /**
+     * @brief Replace target with source, durable once sync_parent_directory() returns
+     */
+    static bool replace_file(const std::string& source, const std::string& target);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool PairingJournal::load(const std::string& configuration_file, Json::Value& configuration)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_journal_fd >= 0) {
+        sync_locked(true);
+        ::close(_journal_fd);
+        _journal_fd = -1;
+    }
+    _configuration_file = configuration_file;
+    _journal_file = configuration_file + ".journal";
+    _configuration = Json::Value(Json::objectValue);
+    _records = 0;
+    _bytes = 0;
+
+    std::ifstream base(_configuration_file);
+    if (base) {
+        Json::CharReaderBuilder builder;
+        Json::Value parsed;
+        std::string errors;
+        if (Json::parseFromStream(builder, base, &parsed, &errors) && parsed.isObject()) {
+            _configuration = parsed;
+        }
+    }
+
+    // Replay up to the first torn or corrupted record, everything after it is cut off
+    std::ifstream journal(_journal_file, std::ios::binary);
+    std::string line;
+    while (journal && std::getline(journal, line)) {
+        Json::Value record;
+        if (journal.eof() || !parse_line(line, record) || !apply(record, _configuration)) {
+            break;
+        }
+        _records++;
+        _bytes += line.size() + 1;
+    }
+    journal.close();
+
+#ifdef _WIN32
+    _journal_fd = _open(_journal_file.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+    const bool truncated = _journal_fd >= 0 && _chsize(_journal_fd, static_cast<long>(_bytes)) == 0;
+#else
+    _journal_fd = ::open(_journal_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    const bool truncated = _journal_fd >= 0 && ftruncate(_journal_fd, static_cast<off_t>(_bytes)) == 0;
+#endif
+    if (!truncated) {
+        if (_journal_fd >= 0) {
+            ::close(_journal_fd);
+            _journal_fd = -1;
+        }
+        configuration = _configuration;
+        return false;
+    }
+    sync_fd(_journal_fd);
+    _unsynced = false;
+    _last_sync = std::chrono::steady_clock::now();
+    configuration = _configuration;
+    return true;
+}
+
+inline bool PairingJournal::append_paired(const std::string& name, const Json::Value& val)
+{
+    Json::Value record;
+    record[json_journal_operation] = json_journal_paired;
+    record[json_machine_name] = name;
+    record[json_journal_value] = val;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return append(record);
+}
+
+inline bool PairingJournal::append_removed(const std::string& name)
+{
+    Json::Value record;
+    record[json_journal_operation] = json_journal_removed;
+    record[json_machine_name] = name;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return append(record);
+}
+
+inline bool PairingJournal::append_value(const std::string& key, const Json::Value& val)
+{
+    Json::Value record;
+    record[json_journal_operation] = json_journal_value;
+    record[json_setting_name] = key;
+    record[json_journal_value] = val;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return append(record);
+}
+
+inline void PairingJournal::sync(bool force)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync_locked(force);
+}
+
+inline bool PairingJournal::start_sync_timer(std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_event_loop) {
+        return false;
+    }
+    _sync_timer = event_loop->add_timer(sync_period, [this] { sync(); });
+    if (_sync_timer == EventLoop::invalid_handle) {
+        return false;
+    }
+    _event_loop = event_loop;
+    return true;
+}
+
+inline Json::Value PairingJournal::configuration() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _configuration;
+}
+
+inline bool PairingJournal::compact()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return compact_locked();
+}
+
+inline void PairingJournal::close()
+{
+    std::shared_ptr<EventLoop> event_loop;
+    EventLoop::Handle sync_timer;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        event_loop = std::move(_event_loop);
+        sync_timer = _sync_timer;
+        _sync_timer = EventLoop::invalid_handle;
+    }
+    // Removed without holding _mutex, the timer callback takes it
+    if (event_loop) {
+        event_loop->remove(sync_timer);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_journal_fd >= 0) {
+        sync_locked(true);
+        ::close(_journal_fd);
+        _journal_fd = -1;
+    }
+}
+
+inline bool PairingJournal::append(const Json::Value& record)
+{
+    if (_journal_fd < 0 || !apply(record, _configuration)) {
+        return false;
+    }
+    const std::string line = format_line(record);
+    if (!write_all(_journal_fd, line)) {
+        // Keep the journal replayable, the in-memory change is persisted by the next compaction
+        return compact_locked();
+    }
+    _records++;
+    _bytes += line.size();
+    _unsynced = true;
+    if (_records >= compaction_records || _bytes >= compaction_bytes) {
+        return compact_locked();
+    }
+    sync_locked(false);
+    return true;
+}
+
+inline void PairingJournal::sync_locked(bool force)
+{
+    if (_journal_fd < 0 || !_unsynced) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (!force && now - _last_sync < sync_period) {
+        return;
+    }
+    if (sync_fd(_journal_fd)) {
+        _unsynced = false;
+        _last_sync = now;
+    }
+}
+
+inline bool PairingJournal::compact_locked()
+{
+    if (_configuration_file.empty()) {
+        return false;
+    }
+    const std::string temp_file = _configuration_file + ".tmp";
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "    ";
+    const std::string content = Json::writeString(builder, _configuration) + "\n";
+
+#ifdef _WIN32
+    int fd = _open(temp_file.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = ::open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+#endif
+    if (fd < 0) {
+        return false;
+    }
+    const bool written = write_all(fd, content) && sync_fd(fd);
+    ::close(fd);
+    if (!written || !replace_file(temp_file, _configuration_file) || !sync_parent_directory(_configuration_file)) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+
+    // Configuration file is durable, the journal can be dropped
+    if (_journal_fd >= 0) {
+#ifdef _WIN32
+        const bool truncated = _chsize(_journal_fd, 0) == 0;
+#else
+        const bool truncated = ftruncate(_journal_fd, 0) == 0;
+#endif
+        if (truncated) {
+            sync_fd(_journal_fd);
+            _records = 0;
+            _bytes = 0;
+        }
+    }
+    _unsynced = false;
+    _last_sync = std::chrono::steady_clock::now();
+    return true;
+}
+
+inline bool PairingJournal::apply(const Json::Value& record, Json::Value& configuration)
+{
+    if (!record.isObject() || !configuration.isObject()) {
+        return false;
+    }
+    const std::string op = record[json_journal_operation].asString();
+    if (op == json_journal_paired && record[json_machine_name].isString()) {
+        if (!configuration[json_journal_paired].isObject()) {
+            configuration[json_journal_paired] = Json::Value(Json::objectValue);
+        }
+        configuration[json_journal_paired][record[json_machine_name].asString()] = record[json_journal_value];
+        return true;
+    }
+    if (op == json_journal_removed && record[json_machine_name].isString()) {
+        if (configuration[json_journal_paired].isObject()) {
+            configuration[json_journal_paired].removeMember(record[json_machine_name].asString());
+        }
+        return true;
+    }
+    if (op == json_journal_value && record[json_setting_name].isString()) {
+        configuration[record[json_setting_name].asString()] = record[json_journal_value];
+        return true;
+    }
+    return false;
+}
+
+inline std::string PairingJournal::format_line(const Json::Value& record)
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    const std::string json = Json::writeString(builder, record);
+    char crc[9];
+    snprintf(crc, sizeof(crc), "%08x", crc32(json));
+    return std::string(crc) + " " + json + "\n";
+}
+
+inline bool PairingJournal::parse_line(const std::string& line, Json::Value& record)
+{
+    if (line.size() < 10 || line[8] != ' ') {
+        return false;
+    }
+    const std::string json = line.substr(9);
+    const std::string crc_hex = line.substr(0, 8);
+    char* end = nullptr;
+    const unsigned long crc = strtoul(crc_hex.c_str(), &end, 16);
+    if (end == nullptr || *end != '\0' || crc != crc32(json)) {
+        return false;
+    }
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string errors;
+    return reader->parse(json.data(), json.data() + json.size(), &record, &errors);
+}
+
+inline uint32_t PairingJournal::crc32(const std::string& data)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (unsigned char c : data) {
+        crc ^= c;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+inline bool PairingJournal::write_all(int fd, const std::string& data)
+{
+    size_t written = 0;
+    while (written < data.size()) {
+#ifdef _WIN32
+        const int res = _write(fd, data.data() + written, static_cast<unsigned int>(data.size() - written));
+#else
+        const ssize_t res = ::write(fd, data.data() + written, data.size() - written);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (res <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(res);
+    }
+    return true;
+}
+
+inline bool PairingJournal::sync_fd(int fd)
+{
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#elif defined(__APPLE__)
+    return fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+inline bool PairingJournal::sync_parent_directory(const std::string& path)
+{
+#ifdef _WIN32
+    // MoveFileEx with MOVEFILE_WRITE_THROUGH already returned after the rename was flushed
+    (void)path;
+    return true;
+#else
+    const auto slash = path.find_last_of('/');
+    const std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+#endif
+}
+
+inline bool PairingJournal::replace_file(const std::string& source, const std::string& target)
+{
+#ifdef _WIN32
+    return MoveFileExA(source.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
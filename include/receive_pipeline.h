@@ -0,0 +1,332 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file receive_pipeline.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "json.h"
+#include "link_layer_udp_batch.h"
+
+/**
+ * @brief Pipelined receive path. The socket thread submits raw datagrams, a pool of workers parses,
+ * decrypts and verifies them in parallel, and parsed messages are re-sequenced so that messages with the
+ * same key are delivered in the order they were received. Delivery for one key is done by one worker at a
+ * time, different keys are delivered concurrently.
+ *
+ * The key defaults to the origin address. A key function returning e.g. the sender id of the message header
+ * keeps the order of a remote whose address changes. The parse function gets the index of the calling worker,
+ * so state that is not thread safe, like an RSA key, can be kept per worker.
+ */
+class ReceivePipeline {
+public:
+    using KeyFunction = std::function<std::string(const std::string& msg, const std::string& from)>;
+    using ParseFunction =
+        std::function<bool(size_t worker, const std::string& msg, const std::string& from, Json::Value& parsed)>;
+    using DeliverFunction = std::function<void(const Json::Value& parsed, const std::string& from)>;
+
+    static constexpr size_t default_max_pending = 4096;
+
+    /**
+     * @brief Constructor
+     * @param parse function parsing, decrypting and verifying a datagram, called concurrently with different
+     * worker indexes
+     * @param deliver function receiving parsed messages in per-key order
+     * @param key function returning the ordering key of a datagram, empty to order by origin
+     */
+    ReceivePipeline(ParseFunction parse, DeliverFunction deliver, KeyFunction key = nullptr);
+
+    ~ReceivePipeline() { stop(); }
+
+    ReceivePipeline(const ReceivePipeline&) = delete;
+    ReceivePipeline& operator=(const ReceivePipeline&) = delete;
+
+    /**
+     * @brief Start workers
+     * @param threads number of workers, 0 means number of cores
+     * @return false if already started
+     */
+    bool start(size_t threads = 0);
+
+    /**
+     * @brief Parse and deliver on the event loop thread with worker index 0. Datagrams submitted from the
+     * loop thread are processed before submit() returns, others on the next loop iteration.
+     * @param event_loop event loop hosting the pipeline
+     * @return false if already started or the wakeup could not be added
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Stop workers, pending datagrams are discarded. Deliver is not called after stop() returns.
+     */
+    void stop();
+
+    /**
+     * @brief Submit received datagrams. Never blocks, datagrams are dropped if max_pending is exceeded.
+     * @param batch received datagrams
+     */
+    void submit(const std::vector<LinkLayerMessage>& batch);
+
+    void submit(const std::string& msg, const std::string& from);
+
+    void set_max_pending(size_t max_pending) { _max_pending = max_pending; }
+
+    uint64_t dropped() const { return _dropped; }
+
+private:
+    /**
+     * @brief Datagram being processed
+     */
+    struct Job {
+        std::string msg; // @brief Raw datagram
+        std::string from; // @brief Origin of the datagram
+        std::string key; // @brief Ordering key
+        Json::Value parsed; // @brief Parse result
+        bool done = false; // @brief Set when worker finished parsing
+        bool valid = false; // @brief Parse result
+    };
+
+    /**
+     * @brief Jobs of one key in arrival order
+     */
+    struct KeyQueue {
+        std::deque<std::shared_ptr<Job>> jobs; // @brief Pending and finished jobs, head is next to deliver
+        bool delivering = false; // @brief A worker is delivering from this queue
+    };
+
+    ParseFunction _parse;
+    DeliverFunction _deliver;
+    KeyFunction _key;
+    bool _should_exit = true; // @brief Guarded by _mutex
+    std::vector<std::thread> _threads;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _wakeup_handle = EventLoop::invalid_handle;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::shared_ptr<Job>> _work; // @brief Jobs waiting for a worker
+    std::map<std::string, KeyQueue> _keys;
+    size_t _pending = 0;
+    std::atomic<size_t> _max_pending{default_max_pending};
+    std::atomic<uint64_t> _dropped{0};
+
+    /**
+     * @brief Queue datagram. Caller holds _mutex.
+     * @return false if datagram was dropped
+     */
+    bool enqueue(const std::string& msg, const std::string& from);
+
+    /**
+     * @brief Parse job and deliver finished jobs of its key
+     * @param lock lock of _mutex, held on entry and on return
+     * @param worker worker index
+     * @param job job to parse
+     */
+    void process(std::unique_lock<std::mutex>& lock, size_t worker, const std::shared_ptr<Job>& job);
+
+    /**
+     * @brief Deliver finished jobs from the head of key queue
+     * @param lock lock of _mutex, held on entry and on return
+     * @param key ordering key
+     */
+    void deliver_in_order(std::unique_lock<std::mutex>& lock, const std::string& key);
+
+    /**
+     * @brief Event loop callback, processes all queued jobs
+     */
+    void run_queued();
+
+    void worker(size_t index);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline ReceivePipeline::ReceivePipeline(ParseFunction parse, DeliverFunction deliver, KeyFunction key)
+    : _parse(std::move(parse)), _deliver(std::move(deliver)), _key(std::move(key))
+{}
+
+inline bool ReceivePipeline::start(size_t threads)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_should_exit) {
+        return false;
+    }
+    _should_exit = false;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        _threads.emplace_back(&ReceivePipeline::worker, this, i);
+    }
+    return true;
+}
+
+inline bool ReceivePipeline::start(std::shared_ptr<EventLoop> event_loop)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_should_exit) {
+        return false;
+    }
+    _wakeup_handle = event_loop->add_wakeup([this]() { run_queued(); });
+    if (_wakeup_handle == EventLoop::invalid_handle) {
+        return false;
+    }
+    _event_loop = std::move(event_loop);
+    _should_exit = false;
+    return true;
+}
+
+inline void ReceivePipeline::stop()
+{
+    std::shared_ptr<EventLoop> event_loop;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_should_exit) {
+            return;
+        }
+        _should_exit = true;
+        event_loop = std::move(_event_loop);
+    }
+    _cv.notify_all();
+    if (event_loop) {
+        event_loop->remove(_wakeup_handle);
+        _wakeup_handle = EventLoop::invalid_handle;
+    }
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _work.clear();
+    _keys.clear();
+    _pending = 0;
+}
+
+inline void ReceivePipeline::submit(const std::vector<LinkLayerMessage>& batch)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    size_t queued = 0;
+    for (const auto& message : batch) {
+        queued += enqueue(message.message, message.from) ? 1 : 0;
+    }
+    if (queued == 0) {
+        return;
+    }
+    if (!_event_loop) {
+        lock.unlock();
+        queued > 1 ? _cv.notify_all() : _cv.notify_one();
+    } else if (_event_loop->in_loop_thread()) {
+        lock.unlock();
+        run_queued();
+    } else {
+        _event_loop->wakeup(_wakeup_handle);
+    }
+}
+
+inline void ReceivePipeline::submit(const std::string& msg, const std::string& from)
+{
+    submit(std::vector<LinkLayerMessage>{{msg, from}});
+}
+
+inline bool ReceivePipeline::enqueue(const std::string& msg, const std::string& from)
+{
+    if (_should_exit || _pending >= _max_pending) {
+        _dropped++;
+        return false;
+    }
+    auto job = std::make_shared<Job>();
+    job->msg = msg;
+    job->from = from;
+    job->key = _key ? _key(msg, from) : from;
+    _keys[job->key].jobs.push_back(job);
+    _work.push_back(std::move(job));
+    _pending++;
+    return true;
+}
+
+inline void ReceivePipeline::process(std::unique_lock<std::mutex>& lock, size_t worker, const std::shared_ptr<Job>& job)
+{
+    lock.unlock();
+    Json::Value parsed;
+    const bool valid = _parse(worker, job->msg, job->from, parsed);
+    lock.lock();
+    job->parsed = std::move(parsed);
+    job->valid = valid;
+    job->done = true;
+    deliver_in_order(lock, job->key);
+}
+
+inline void ReceivePipeline::deliver_in_order(std::unique_lock<std::mutex>& lock, const std::string& key)
+{
+    auto it = _keys.find(key);
+    if (it == _keys.end() || it->second.delivering) {
+        return;
+    }
+    KeyQueue& queue = it->second;
+    queue.delivering = true;
+    while (!_should_exit && !queue.jobs.empty() && queue.jobs.front()->done) {
+        auto job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+        _pending--;
+        if (job->valid) {
+            lock.unlock();
+            _deliver(job->parsed, job->from);
+            lock.lock();
+        }
+    }
+    queue.delivering = false;
+    if (queue.jobs.empty()) {
+        _keys.erase(it);
+    }
+}
+
+inline void ReceivePipeline::run_queued()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_should_exit && !_work.empty()) {
+        auto job = std::move(_work.front());
+        _work.pop_front();
+        process(lock, 0, job);
+    }
+}
+
+inline void ReceivePipeline::worker(size_t index)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_should_exit) {
+        if (_work.empty()) {
+            _cv.wait(lock);
+            continue;
+        }
+        auto job = std::move(_work.front());
+        _work.pop_front();
+        process(lock, index, job);
+    }
+}
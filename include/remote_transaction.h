@@ -0,0 +1,770 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file remote_transaction.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "deadline_queue.h"
+#include "event_loop.h"
+#include "json.h"
+#include "usm.h"
+
+/**
+ * @brief Per-remote transaction states
+ */
+enum RemoteTransactionState {
+    R_IDLE, /**< @brief Nothing to do for this remote */
+    R_CONFIG_PAIRING, /**< @brief Wait for drivers to be configured for pairing */
+    R_PAIR, /**< @brief Pair to remote and wait for response */
+    R_CONFIG_CONNECT, /**< @brief Wait for drivers to be configured for connecting */
+    R_CONNECT, /**< @brief Send connect request and wait for response */
+    R_RECONFIGURING /**< @brief Reconfigure request sent, waiting for status with new connection parameters */
+};
+
+constexpr size_t remote_state_count = R_RECONFIGURING + 1;
+
+// clang-format off
+/**
+ * @brief Per-remote transition table
+ */
+inline constexpr auto remote_transition_table = usm::make_transition_table<RemoteTransactionState, remote_state_count>({
+    {R_IDLE,            usm::T_NEXT1, R_CONFIG_PAIRING}, // pair
+    {R_IDLE,            usm::T_NEXT2, R_CONFIG_CONNECT}, // connect or autoconnect
+    {R_IDLE,            usm::T_NEXT3, R_RECONFIGURING},  // reconfigure
+    {R_IDLE,            usm::T_NEXT4, R_PAIR},           // pair without reconfiguring drivers
+    {R_IDLE,            usm::T_ERROR, R_IDLE},
+    {R_CONFIG_PAIRING,  usm::T_NEXT1, R_PAIR},
+    {R_CONFIG_PAIRING,  usm::T_ERROR, R_IDLE},
+    {R_PAIR,            usm::T_NEXT1, R_CONFIG_CONNECT}, // paired, connect
+    {R_PAIR,            usm::T_NEXT2, R_IDLE},           // cancelled or no response
+    {R_PAIR,            usm::T_ERROR, R_IDLE},
+    {R_CONFIG_CONNECT,  usm::T_NEXT1, R_CONNECT},
+    {R_CONFIG_CONNECT,  usm::T_ERROR, R_IDLE},
+    {R_CONNECT,         usm::T_NEXT1, R_IDLE},           // connected
+    {R_CONNECT,         usm::T_ERROR, R_IDLE},
+    {R_RECONFIGURING,   usm::T_NEXT1, R_IDLE},           // remote confirmed new configuration
+    {R_RECONFIGURING,   usm::T_NEXT2, R_CONFIG_CONNECT}, // reconnect after reconfiguration
+    {R_RECONFIGURING,   usm::T_ERROR, R_IDLE},
+});
+// clang-format on
+
+static_assert(remote_transition_table.well_formed(), "Duplicate or invalid remote transition");
+static_assert(remote_transition_table.error_transitions_complete(), "Every remote state needs a T_ERROR transition");
+static_assert(remote_transition_table.all_reachable(R_IDLE), "Unreachable remote state");
+
+/**
+ * @brief Operations a remote transaction needs from the connection manager. Called from the thread stepping
+ * the transaction, possibly for several remotes at once.
+ */
+class RemoteTransactionContext {
+public:
+    virtual ~RemoteTransactionContext() = default;
+
+    /**
+     * @brief Configure drivers for pairing or connecting. This is the only critical section shared between
+     * transactions: transactions needing the same section share one configuration round.
+     * @param section json_section_pairing or json_section_connection
+     * @return true if drivers are configured for the section
+     */
+    virtual bool configure_drivers_for(const std::string& section) = 0;
+
+    virtual void send_pairing_request(const std::string& name) = 0;
+
+    virtual bool send_connection_request(const std::string& name) = 0;
+
+    virtual bool send_reconfigure_request(const std::string& name, const Json::Value& new_params) = 0;
+
+    /**
+     * @brief Report finished transaction
+     * @param name remote name
+     * @param state state in which the transaction finished
+     * @param success true if transaction succeeded
+     */
+    virtual void transaction_finished(const std::string& name, RemoteTransactionState state, bool success) = 0;
+};
+
+/**
+ * @brief Pairing, connecting and reconfiguring lifecycle of a single remote.
+ *
+ * Commands and received responses only set flags and ask the scheduler to step the transaction, the
+ * requests are sent from step(). Requests are repeated every request timeout until the response arrives
+ * or the retries are used up.
+ */
+class RemoteTransaction
+    : public usm::TableStateMachine<RemoteTransaction, RemoteTransactionState, remote_transition_table> {
+public:
+    /**
+     * @brief Remote transaction events
+     */
+    enum Event : usm::EventMask {
+        E_COMMAND = 1 << 0, /**< @brief New command: pair, connect, reconfigure, cancel */
+        E_PAIR_RESPONSE = 1 << 1, /**< @brief Pairing response received from this remote */
+        E_CONNECT_RESPONSE = 1 << 2, /**< @brief Connect response received from this remote */
+        E_STATUS_RECEIVED = 1 << 3 /**< @brief Status message received from this remote */
+    };
+
+    /**
+     * @brief Constructor
+     * @param name remote name
+     * @param context connection manager operations
+     * @param request_timeout time to wait for a response before the request is repeated
+     * @param request_retries number of times a request is sent before the transaction fails
+     */
+    RemoteTransaction(const std::string& name, RemoteTransactionContext& context,
+                      std::chrono::milliseconds request_timeout, int request_retries);
+
+    const std::string& name() const { return _name; }
+
+    /**
+     * @brief Pair to remote, then connect
+     * @param skip_config true if drivers are already configured for pairing
+     */
+    void pair(bool skip_config = false);
+
+    void connect();
+
+    /**
+     * @brief Reconfigure connected remote
+     * @param new_params new connection driver configuration
+     * @param reconnect connect again once the remote confirmed the new configuration
+     */
+    void reconfigure(const Json::Value& new_params, bool reconnect);
+
+    /**
+     * @brief Cancel running or pending command
+     */
+    void cancel();
+
+    /**
+     * @brief Notify received responses
+     * @param events E_PAIR_RESPONSE, E_CONNECT_RESPONSE or E_STATUS_RECEIVED
+     */
+    void notify(usm::EventMask events);
+
+    /**
+     * @brief Set function asking the executor to step this transaction
+     * @param scheduler called from any thread, empty to detach
+     */
+    void set_scheduler(std::function<void()> scheduler);
+
+    /**
+     * @brief Run current state until it has to wait
+     * @return time at which the transaction has to run again if no event arrives, time_point::max() if none
+     */
+    std::chrono::steady_clock::time_point step();
+
+    /**
+     * @brief Export recorded transitions as Chrome trace-event JSON
+     */
+    std::string export_trace() const;
+
+    /**
+     * @brief Export time spent per state in Prometheus text format
+     */
+    std::string export_histograms() const;
+
+    static std::string state_to_string(RemoteTransactionState state);
+
+private:
+    friend class usm::TableStateMachine<RemoteTransaction, RemoteTransactionState, remote_transition_table>;
+
+    std::string _name;
+    RemoteTransactionContext& _context;
+    std::chrono::milliseconds _request_timeout;
+    int _request_retries;
+    std::mutex _command_mutex;
+    usm::Transition _command = usm::T_REPEAT; // @brief Pending command transition out of R_IDLE
+    bool _cancel = false;
+    Json::Value _reconfigure_params;
+    bool _reconnect = false;
+    std::function<void()> _scheduler;
+    std::atomic<usm::EventMask> _received{0}; // @brief Responses received since the current state was entered
+    int _retries = 0; // @brief Requests sent in the current state
+    std::chrono::steady_clock::time_point _wakeup;
+    std::chrono::steady_clock::time_point _request_time;
+
+    usm::Transition run_current_state(RemoteTransactionState current_state);
+
+    void on_transition(RemoteTransactionState current_state, RemoteTransactionState new_state, usm::Transition t);
+
+    void print_transition(RemoteTransactionState, RemoteTransactionState, usm::Transition) const {}
+
+    /**
+     * @brief Take cancel request
+     * @return true if transaction was cancelled
+     */
+    bool take_cancel();
+
+    /**
+     * @brief Send request when entering the state and repeat it every request timeout until the response arrives
+     * @param response response event
+     * @param send sends the request, returns false on failure
+     * @return T_NEXT1 on response, T_ERROR if sending failed or retries are used up, T_REPEAT while waiting
+     */
+    usm::Transition request(usm::EventMask response, const std::function<bool()>& send);
+
+    /**
+     * @brief Declare events the current state waits on and the time it has to run again
+     */
+    void wait_until(usm::EventMask events, std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * @brief Ask the executor to step this transaction
+     */
+    void schedule();
+};
+
+/**
+ * @brief Runs remote transactions on a fixed pool of threads or on an event loop. A transaction is stepped by
+ * one thread at a time, so its state machine is never entered concurrently, while different remotes progress
+ * in parallel. On an event loop all transactions are stepped from the loop thread, so driver configuration
+ * blocks the loop while it runs.
+ */
+class TransactionExecutor {
+public:
+    TransactionExecutor() = default;
+
+    ~TransactionExecutor() { stop(); }
+
+    TransactionExecutor(const TransactionExecutor&) = delete;
+    TransactionExecutor& operator=(const TransactionExecutor&) = delete;
+
+    /**
+     * @brief Start worker threads
+     * @param threads number of threads, 0 means number of cores
+     * @return false if already started
+     */
+    bool start(size_t threads = 0);
+
+    /**
+     * @brief Step transactions from the event loop
+     * @param event_loop event loop hosting the executor
+     * @return false if already started or the timer could not be added
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Stop stepping transactions. Waits for running steps.
+     */
+    void stop();
+
+    /**
+     * @brief Add transaction and step it as soon as possible
+     */
+    void add(std::shared_ptr<RemoteTransaction> transaction);
+
+    /**
+     * @brief Remove transaction. Waits if it is being stepped by another thread, a transaction removing
+     * itself from its own callback is released when its step returns.
+     * @param name remote name
+     */
+    void remove(const std::string& name);
+
+    /**
+     * @brief Find transaction
+     * @param name remote name
+     * @return transaction, nullptr if not added
+     */
+    std::shared_ptr<RemoteTransaction> find(const std::string& name);
+
+    /**
+     * @brief Notify received responses to a transaction
+     * @param name remote name
+     * @param events RemoteTransaction::Event bits
+     */
+    void notify(const std::string& name, usm::EventMask events);
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv; // @brief Wakes workers, notified when a transaction becomes ready or stops running
+    bool _should_exit = true; // @brief Guarded by _mutex
+    std::vector<std::thread> _threads;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _timer_handle = EventLoop::invalid_handle;
+    EventLoop::Handle _wakeup_handle = EventLoop::invalid_handle;
+    std::map<std::string, std::shared_ptr<RemoteTransaction>> _transactions;
+    DeadlineQueue<std::string> _wakeups; // @brief Next run time of each transaction
+    std::deque<std::string> _ready; // @brief Transactions whose run time passed
+    std::map<std::string, std::thread::id> _running; // @brief Transactions currently stepped and their threads
+    std::set<std::string> _rerun; // @brief Transactions scheduled while being stepped
+
+    /**
+     * @brief Step transaction as soon as possible, called by the transaction. Caller holds _mutex.
+     */
+    void schedule_now(const std::string& name);
+
+    /**
+     * @brief Move transactions whose run time passed to _ready. Caller holds _mutex.
+     */
+    void collect_ready(std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief Take next ready transaction and mark it running. Caller holds _mutex.
+     * @return transaction, nullptr if none is ready
+     */
+    std::shared_ptr<RemoteTransaction> take_ready();
+
+    /**
+     * @brief Mark transaction stepped and schedule its next run. Caller holds _mutex.
+     */
+    void finish(const std::string& name, std::chrono::steady_clock::time_point wakeup);
+
+    /**
+     * @brief Event loop callback, steps all ready transactions and rearms the timer
+     */
+    void run_ready();
+
+    void worker();
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline RemoteTransaction::RemoteTransaction(const std::string& name, RemoteTransactionContext& context,
+                                            std::chrono::milliseconds request_timeout, int request_retries)
+    : TableStateMachine(R_IDLE),
+      _name(name),
+      _context(context),
+      _request_timeout(request_timeout),
+      _request_retries(request_retries)
+{}
+
+inline void RemoteTransaction::pair(bool skip_config)
+{
+    {
+        std::lock_guard<std::mutex> lock(_command_mutex);
+        _command = skip_config ? usm::T_NEXT4 : usm::T_NEXT1;
+        _cancel = false;
+    }
+    notify_events(E_COMMAND);
+    schedule();
+}
+
+inline void RemoteTransaction::connect()
+{
+    {
+        std::lock_guard<std::mutex> lock(_command_mutex);
+        _command = usm::T_NEXT2;
+        _cancel = false;
+    }
+    notify_events(E_COMMAND);
+    schedule();
+}
+
+inline void RemoteTransaction::reconfigure(const Json::Value& new_params, bool reconnect)
+{
+    {
+        std::lock_guard<std::mutex> lock(_command_mutex);
+        _command = usm::T_NEXT3;
+        _cancel = false;
+        _reconfigure_params = new_params;
+        _reconnect = reconnect;
+    }
+    notify_events(E_COMMAND);
+    schedule();
+}
+
+inline void RemoteTransaction::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(_command_mutex);
+        _command = usm::T_REPEAT;
+        _cancel = true;
+    }
+    notify_events(E_COMMAND);
+    schedule();
+}
+
+inline void RemoteTransaction::notify(usm::EventMask events)
+{
+    _received |= events;
+    notify_events(events);
+    schedule();
+}
+
+inline void RemoteTransaction::set_scheduler(std::function<void()> scheduler)
+{
+    std::lock_guard<std::mutex> lock(_command_mutex);
+    _scheduler = std::move(scheduler);
+}
+
+inline std::chrono::steady_clock::time_point RemoteTransaction::step()
+{
+    take_events();
+    _wakeup = std::chrono::steady_clock::time_point::max();
+    while (iterate_once()) {
+        _wakeup = std::chrono::steady_clock::time_point::max();
+    }
+    return _wakeup;
+}
+
+inline std::string RemoteTransaction::export_trace() const
+{
+    return get_transition_trace().to_chrome_trace(state_to_string, "remote " + _name);
+}
+
+inline std::string RemoteTransaction::export_histograms() const
+{
+    return get_transition_trace().histograms_to_text(state_to_string, "cm_remote_transaction_state_seconds");
+}
+
+inline std::string RemoteTransaction::state_to_string(RemoteTransactionState state)
+{
+    switch (state) {
+        case R_IDLE:
+            return "R_IDLE";
+        case R_CONFIG_PAIRING:
+            return "R_CONFIG_PAIRING";
+        case R_PAIR:
+            return "R_PAIR";
+        case R_CONFIG_CONNECT:
+            return "R_CONFIG_CONNECT";
+        case R_CONNECT:
+            return "R_CONNECT";
+        case R_RECONFIGURING:
+            return "R_RECONFIGURING";
+    }
+    return "UNKNOWN";
+}
+
+inline usm::Transition RemoteTransaction::run_current_state(RemoteTransactionState current_state)
+{
+    switch (current_state) {
+        case R_IDLE: {
+            std::lock_guard<std::mutex> lock(_command_mutex);
+            _cancel = false;
+            const usm::Transition command = _command;
+            _command = usm::T_REPEAT;
+            if (command == usm::T_REPEAT) {
+                wait_until(E_COMMAND, std::chrono::steady_clock::time_point::max());
+            }
+            return command;
+        }
+        case R_CONFIG_PAIRING:
+            if (take_cancel()) {
+                return usm::T_ERROR;
+            }
+            return _context.configure_drivers_for(json_section_pairing) ? usm::T_NEXT1 : usm::T_ERROR;
+        case R_PAIR: {
+            if (take_cancel()) {
+                return usm::T_NEXT2;
+            }
+            const usm::Transition t = request(E_PAIR_RESPONSE, [this]() {
+                _context.send_pairing_request(_name);
+                return true;
+            });
+            return t == usm::T_ERROR ? usm::T_NEXT2 : t;
+        }
+        case R_CONFIG_CONNECT:
+            if (take_cancel()) {
+                return usm::T_ERROR;
+            }
+            return _context.configure_drivers_for(json_section_connection) ? usm::T_NEXT1 : usm::T_ERROR;
+        case R_CONNECT:
+            if (take_cancel()) {
+                return usm::T_ERROR;
+            }
+            return request(E_CONNECT_RESPONSE, [this]() { return _context.send_connection_request(_name); });
+        case R_RECONFIGURING: {
+            if (take_cancel()) {
+                return usm::T_ERROR;
+            }
+            const usm::Transition t = request(E_STATUS_RECEIVED, [this]() {
+                Json::Value params;
+                {
+                    std::lock_guard<std::mutex> lock(_command_mutex);
+                    params = _reconfigure_params;
+                }
+                return _context.send_reconfigure_request(_name, params);
+            });
+            if (t == usm::T_NEXT1) {
+                std::lock_guard<std::mutex> lock(_command_mutex);
+                return _reconnect ? usm::T_NEXT2 : usm::T_NEXT1;
+            }
+            return t;
+        }
+    }
+    return usm::T_ERROR;
+}
+
+inline void RemoteTransaction::on_transition(RemoteTransactionState current_state, RemoteTransactionState new_state,
+                                             usm::Transition t)
+{
+    _retries = 0;
+    _received = 0;
+    if (new_state == R_IDLE && current_state != R_IDLE) {
+        const bool success = t == usm::T_NEXT1 && (current_state == R_CONNECT || current_state == R_RECONFIGURING);
+        _context.transaction_finished(_name, current_state, success);
+    }
+}
+
+inline bool RemoteTransaction::take_cancel()
+{
+    std::lock_guard<std::mutex> lock(_command_mutex);
+    const bool cancel = _cancel;
+    _cancel = false;
+    return cancel;
+}
+
+inline usm::Transition RemoteTransaction::request(usm::EventMask response, const std::function<bool()>& send)
+{
+    if (_received & response) {
+        return usm::T_NEXT1;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (_retries == 0 || now >= _request_time + _request_timeout) {
+        if (_retries >= _request_retries || !send()) {
+            return usm::T_ERROR;
+        }
+        _retries++;
+        _request_time = now;
+    }
+    wait_until(response | E_COMMAND, _request_time + _request_timeout);
+    return usm::T_REPEAT;
+}
+
+inline void RemoteTransaction::wait_until(usm::EventMask events, std::chrono::steady_clock::time_point deadline)
+{
+    wait_for_events(events, deadline);
+    _wakeup = deadline;
+}
+
+inline void RemoteTransaction::schedule()
+{
+    std::function<void()> scheduler;
+    {
+        std::lock_guard<std::mutex> lock(_command_mutex);
+        scheduler = _scheduler;
+    }
+    if (scheduler) {
+        scheduler();
+    }
+}
+
+inline bool TransactionExecutor::start(size_t threads)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_should_exit) {
+        return false;
+    }
+    _should_exit = false;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        _threads.emplace_back(&TransactionExecutor::worker, this);
+    }
+    return true;
+}
+
+inline bool TransactionExecutor::start(std::shared_ptr<EventLoop> event_loop)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_should_exit) {
+        return false;
+    }
+    _timer_handle = event_loop->add_timer(std::chrono::milliseconds(1), [this]() { run_ready(); }, false);
+    _wakeup_handle = event_loop->add_wakeup([this]() { run_ready(); });
+    if (_timer_handle == EventLoop::invalid_handle || _wakeup_handle == EventLoop::invalid_handle) {
+        event_loop->remove(_timer_handle);
+        event_loop->remove(_wakeup_handle);
+        _timer_handle = _wakeup_handle = EventLoop::invalid_handle;
+        return false;
+    }
+    _event_loop = std::move(event_loop);
+    _should_exit = false;
+    return true;
+}
+
+inline void TransactionExecutor::stop()
+{
+    std::shared_ptr<EventLoop> event_loop;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_should_exit) {
+            return;
+        }
+        _should_exit = true;
+        event_loop = std::move(_event_loop);
+    }
+    _cv.notify_all();
+    if (event_loop) {
+        event_loop->remove(_timer_handle);
+        event_loop->remove(_wakeup_handle);
+        _timer_handle = _wakeup_handle = EventLoop::invalid_handle;
+    }
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+}
+
+inline void TransactionExecutor::add(std::shared_ptr<RemoteTransaction> transaction)
+{
+    const std::string name = transaction->name();
+    transaction->set_scheduler([this, name]() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        schedule_now(name);
+    });
+    std::lock_guard<std::mutex> lock(_mutex);
+    _transactions[name] = std::move(transaction);
+    schedule_now(name);
+}
+
+inline void TransactionExecutor::remove(const std::string& name)
+{
+    std::shared_ptr<RemoteTransaction> transaction;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _transactions.find(name);
+        if (it == _transactions.end()) {
+            return;
+        }
+        transaction = it->second;
+        _transactions.erase(it);
+        _wakeups.cancel(name);
+        _ready.erase(std::remove(_ready.begin(), _ready.end(), name), _ready.end());
+        _rerun.erase(name);
+        auto running = _running.find(name);
+        if (running == _running.end() || running->second != std::this_thread::get_id()) {
+            _cv.wait(lock, [this, &name]() { return _running.count(name) == 0; });
+        }
+    }
+    transaction->set_scheduler(nullptr);
+}
+
+inline std::shared_ptr<RemoteTransaction> TransactionExecutor::find(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _transactions.find(name);
+    return it != _transactions.end() ? it->second : nullptr;
+}
+
+inline void TransactionExecutor::notify(const std::string& name, usm::EventMask events)
+{
+    auto transaction = find(name);
+    if (transaction) {
+        transaction->notify(events);
+    }
+}
+
+inline void TransactionExecutor::schedule_now(const std::string& name)
+{
+    if (_transactions.count(name) == 0) {
+        return;
+    }
+    if (_running.count(name)) {
+        _rerun.insert(name);
+        return;
+    }
+    _wakeups.schedule(name, std::chrono::steady_clock::now());
+    if (_event_loop) {
+        _event_loop->wakeup(_wakeup_handle);
+    } else {
+        _cv.notify_one();
+    }
+}
+
+inline void TransactionExecutor::collect_ready(std::chrono::steady_clock::time_point now)
+{
+    _wakeups.expire(now, [this](const std::string& name) { _ready.push_back(name); });
+}
+
+inline std::shared_ptr<RemoteTransaction> TransactionExecutor::take_ready()
+{
+    while (!_ready.empty()) {
+        const std::string name = _ready.front();
+        _ready.pop_front();
+        auto it = _transactions.find(name);
+        if (it == _transactions.end() || _running.count(name)) {
+            continue;
+        }
+        _running[name] = std::this_thread::get_id();
+        return it->second;
+    }
+    return nullptr;
+}
+
+inline void TransactionExecutor::finish(const std::string& name, std::chrono::steady_clock::time_point wakeup)
+{
+    _running.erase(name);
+    if (_transactions.count(name)) {
+        if (_rerun.erase(name)) {
+            _wakeups.schedule(name, std::chrono::steady_clock::now());
+        } else if (wakeup != std::chrono::steady_clock::time_point::max()) {
+            _wakeups.schedule(name, wakeup);
+        }
+    }
+    _cv.notify_all();
+}
+
+inline void TransactionExecutor::run_ready()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_should_exit) {
+        return;
+    }
+    collect_ready(std::chrono::steady_clock::now());
+    while (auto transaction = take_ready()) {
+        lock.unlock();
+        const auto wakeup = transaction->step();
+        lock.lock();
+        finish(transaction->name(), wakeup);
+        collect_ready(std::chrono::steady_clock::now());
+    }
+    std::chrono::steady_clock::time_point deadline;
+    if (_event_loop && _wakeups.next_deadline(deadline)) {
+        const auto delay = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        _event_loop->rearm_timer(_timer_handle, std::max(delay, std::chrono::milliseconds(1)));
+    }
+}
+
+inline void TransactionExecutor::worker()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_should_exit) {
+        collect_ready(std::chrono::steady_clock::now());
+        auto transaction = take_ready();
+        if (!transaction) {
+            std::chrono::steady_clock::time_point deadline;
+            if (_wakeups.next_deadline(deadline)) {
+                _cv.wait_until(lock, deadline);
+            } else {
+                _cv.wait(lock);
+            }
+            continue;
+        }
+        lock.unlock();
+        const auto wakeup = transaction->step();
+        lock.lock();
+        finish(transaction->name(), wakeup);
+    }
+}
@@ -0,0 +1,185 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file replay_window.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+/**
+ * @brief Anti-replay sliding window over per-sender sequence numbers (IPsec style, RFC 6479 ring bitmap).
+ *
+ * Sequences newer than the highest seen are always accepted, sequences within the window are accepted
+ * once and sequences at or past the window edge are rejected, as they cannot be told apart from replays.
+ * A sender that restarts its counter is accepted again only after reset(). Both check and update run in
+ * constant time. Because the window is keyed by sender and not by
+ * origin address, copies of one message arriving over several radios or interfaces are accepted only once.
+ * Not thread safe.
+ */
+template<size_t WindowSize = 1024>
+class ReplayWindow {
+public:
+    static_assert(WindowSize >= 128 && WindowSize % 64 == 0, "Window size must be a multiple of 64 and at least 128");
+
+    /**
+     * @brief Usable window: one block is always being recycled
+     */
+    static constexpr uint64_t window = WindowSize - 64;
+
+    /**
+     * @brief Check sequence without recording it
+     * @param sequence received sequence
+     * @return false if sequence is a duplicate or older than the window
+     */
+    bool check(uint64_t sequence) const;
+
+    /**
+     * @brief Check sequence and record it. Call only after the message was authenticated.
+     * @param sequence received sequence
+     * @return false if sequence is a duplicate or older than the window
+     */
+    bool update(uint64_t sequence);
+
+    uint64_t highest() const { return _highest; }
+
+    void reset();
+
+private:
+    static constexpr size_t blocks = WindowSize / 64;
+
+    bool _initialized = false;
+    uint64_t _highest = 0;
+    uint64_t _bitmap[blocks] = {};
+
+    static size_t block(uint64_t sequence) { return static_cast<size_t>((sequence / 64) % blocks); }
+
+    static uint64_t bit(uint64_t sequence) { return uint64_t(1) << (sequence % 64); }
+};
+
+/**
+ * @brief Replay windows of all senders, checked right after the message header was verified, and the sequence
+ * of sent headers. Sequences start at 0, so the messages of a restarted sender are rejected until its window
+ * is reset on session handshake or re-pair. Legacy messages without header are not windowed, their json_sequence is not
+ * authenticated before decryption. Thread safe.
+ */
+class ReplayFilter {
+public:
+    /**
+     * @brief Check sequence of an authenticated header and record it
+     * @param sender_id sender id of the header
+     * @param sequence sequence of the header
+     * @return false if the message is a duplicate
+     */
+    bool accept(uint64_t sender_id, uint64_t sequence);
+
+    /**
+     * @brief Start over the window of a sender. Call on session handshake and on re-pair, when the remote may
+     * have restarted its sequence.
+     * @param sender_id sender id of the remote
+     */
+    void reset(uint64_t sender_id);
+
+    /**
+     * @brief Forget sender, e.g. when it is unpaired
+     * @param sender_id sender id of the remote
+     */
+    void remove(uint64_t sender_id);
+
+    /**
+     * @brief Get sequence for the next sent header
+     */
+    uint64_t next_sequence() { return _sequence++; }
+
+private:
+    std::mutex _mutex;
+    std::map<uint64_t, ReplayWindow<>> _windows; // @brief Keyed by sender id
+    std::atomic<uint64_t> _sequence{0};
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+template<size_t WindowSize>
+bool ReplayWindow<WindowSize>::check(uint64_t sequence) const
+{
+    if (!_initialized || sequence > _highest) {
+        return true;
+    }
+    if (_highest - sequence >= window) {
+        return false;
+    }
+    return (_bitmap[block(sequence)] & bit(sequence)) == 0;
+}
+
+template<size_t WindowSize>
+bool ReplayWindow<WindowSize>::update(uint64_t sequence)
+{
+    if (!check(sequence)) {
+        return false;
+    }
+    if (!_initialized) {
+        _initialized = true;
+        _highest = sequence;
+    } else if (sequence > _highest) {
+        // Clear blocks that the window slides over, at most all of them
+        uint64_t advance = sequence / 64 - _highest / 64;
+        if (advance > blocks) {
+            advance = blocks;
+        }
+        for (uint64_t i = 1; i <= advance; i++) {
+            _bitmap[block(_highest + i * 64)] = 0;
+        }
+        _highest = sequence;
+    }
+    _bitmap[block(sequence)] |= bit(sequence);
+    return true;
+}
+
+template<size_t WindowSize>
+void ReplayWindow<WindowSize>::reset()
+{
+    _initialized = false;
+    _highest = 0;
+    for (auto& b : _bitmap) {
+        b = 0;
+    }
+}
+
+inline bool ReplayFilter::accept(uint64_t sender_id, uint64_t sequence)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _windows[sender_id].update(sequence);
+}
+
+inline void ReplayFilter::reset(uint64_t sender_id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _windows.find(sender_id);
+    if (it != _windows.end()) {
+        it->second.reset();
+    }
+}
+
+inline void ReplayFilter::remove(uint64_t sender_id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _windows.erase(sender_id);
+}
@@ -0,0 +1,144 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file snapshot.h
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Value published by a writer and read without locks.
+ *
+ * The value lives in one of Slots preallocated slots, each with a reader count. A reader increments the
+ * count of the current slot and then checks that the slot is still current, retrying otherwise, so it never
+ * blocks and never allocates. The writer stores the new value into a slot that is neither current nor
+ * held by a reader and then makes it current. Writers are serialized by a mutex that readers never take.
+ * When every other slot is held by a reader the writer yields until one is released, so readers must not
+ * keep a Reader for long. Slots - 1 concurrent readers never delay the writer.
+ */
+template<typename T, size_t Slots = 4>
+class Snapshot {
+    static_assert(Slots >= 2, "Snapshot needs at least two slots");
+
+    struct Slot {
+        std::atomic<uint32_t> readers{0};
+        T value{};
+    };
+
+public:
+    /**
+     * @brief Guard that keeps the value it was created with alive and unchanged until destroyed
+     */
+    class Reader {
+    public:
+        Reader(Reader&& other) noexcept : _slot(other._slot) { other._slot = nullptr; }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        Reader& operator=(Reader&&) = delete;
+
+        ~Reader()
+        {
+            if (_slot) {
+                _slot->readers.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        const T& operator*() const { return _slot->value; }
+
+        const T* operator->() const { return &_slot->value; }
+
+    private:
+        friend class Snapshot;
+
+        explicit Reader(Slot* slot) : _slot(slot) {}
+
+        Slot* _slot;
+    };
+
+    Snapshot() = default;
+
+    /**
+     * @brief Constructor
+     * @param value initial value
+     */
+    explicit Snapshot(T value) { _slots[0].value = std::move(value); }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    /**
+     * @brief Get current value. Lock free, does not allocate.
+     * @return guard referring to the current value
+     */
+    Reader read() const;
+
+    /**
+     * @brief Replace current value. Readers holding the previous value are not affected.
+     * @param value new value
+     */
+    void publish(T value);
+
+private:
+    mutable std::array<Slot, Slots> _slots;
+    std::atomic<size_t> _current{0};
+    std::mutex _writer_mutex;
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+template<typename T, size_t Slots>
+typename Snapshot<T, Slots>::Reader Snapshot<T, Slots>::read() const
+{
+    for (;;) {
+        const size_t index = _current.load(std::memory_order_seq_cst);
+        Slot& slot = _slots[index];
+        slot.readers.fetch_add(1, std::memory_order_seq_cst);
+        // The writer only reuses a slot that is not current and has no readers, so once the slot is seen
+        // current after incrementing its count it cannot be overwritten until the Reader is destroyed
+        if (_current.load(std::memory_order_seq_cst) == index) {
+            return Reader(&slot);
+        }
+        slot.readers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+template<typename T, size_t Slots>
+void Snapshot<T, Slots>::publish(T value)
+{
+    std::lock_guard<std::mutex> lock(_writer_mutex);
+    const size_t current = _current.load(std::memory_order_relaxed);
+    for (size_t i = 1;; i++) {
+        const size_t index = (current + i) % Slots;
+        if (index == current) {
+            std::this_thread::yield();
+            continue;
+        }
+        Slot& slot = _slots[index];
+        if (slot.readers.load(std::memory_order_seq_cst) == 0) {
+            slot.value = std::move(value);
+            _current.store(index, std::memory_order_seq_cst);
+            return;
+        }
+    }
+}
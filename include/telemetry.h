@@ -0,0 +1,354 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file telemetry.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "event_loop.h"
+#include "json.h"
+
+/**
+ * @brief Latest telemetry values of one driver instance
+ */
+struct TelemetrySample {
+    enum Field : uint32_t { RSSI = 1 << 0, SNR = 1 << 1, BATTERY_SOC = 1 << 2, OTHER = 1 << 3 };
+
+    float rssi = 0.f; // @brief json_driver_telemetry_rssi
+    float snr = 0.f; // @brief json_driver_telemetry_snr
+    float battery_soc = 0.f; // @brief json_driver_telemetry_soc
+    Json::Value other; // @brief Driver specific fields not covered above
+    uint32_t valid = 0; // @brief Fields that were ever reported
+    uint32_t changed = 0; // @brief Fields changed since the previous delivery
+    std::set<std::string> changed_other; // @brief Driver specific fields changed since the previous delivery
+
+    /**
+     * @brief Merge telemetry reported by driver
+     * @param telemetry json telemetry
+     * @return true if any field changed
+     */
+    bool merge(const Json::Value& telemetry);
+
+    /**
+     * @brief Convert to json
+     * @param changed_only include only changed fields
+     * @return json telemetry
+     */
+    Json::Value to_json(bool changed_only = false) const;
+
+    /**
+     * @brief Clear changed fields after delivery
+     */
+    void clear_changed();
+};
+
+/**
+ * @brief Coalesces driver telemetry. Keeps latest values per driver instance and delivers the
+ * instances that changed at most once per interval, as a single batch.
+ *
+ * Feed it from ConnectionManager::register_telemetry_callback(). The first change after a delivery is
+ * delivered once the interval since that delivery has passed, so a single change is not delayed by a full
+ * interval while a high rate radio is limited to one delivery per interval.
+ */
+class TelemetryAggregator {
+public:
+    using BatchCallback = std::function<void(const std::map<std::string, TelemetrySample>&)>;
+
+    static constexpr std::chrono::milliseconds default_interval{1000};
+
+    TelemetryAggregator() = default;
+
+    ~TelemetryAggregator() { stop(); }
+
+    TelemetryAggregator(const TelemetryAggregator&) = delete;
+    TelemetryAggregator& operator=(const TelemetryAggregator&) = delete;
+
+    /**
+     * @brief Start delivery thread
+     * @param callback called with changed instances, each sample has its changed mask set
+     * @param interval minimum time between deliveries
+     * @return false if already started
+     */
+    bool start(BatchCallback callback, std::chrono::milliseconds interval = default_interval);
+
+    /**
+     * @brief Deliver from the event loop
+     * @param event_loop event loop hosting the delivery timer
+     * @param callback called with changed instances from the event loop thread
+     * @param interval minimum time between deliveries
+     * @return false if already started or the timer could not be added
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop, BatchCallback callback,
+               std::chrono::milliseconds interval = default_interval);
+
+    /**
+     * @brief Stop delivery. Callback is not called after stop() returns.
+     */
+    void stop();
+
+    /**
+     * @brief Store telemetry reported by driver instance, does not call the callback
+     * @param instance driver instance
+     * @param telemetry json telemetry
+     */
+    void update(const std::string& instance, const Json::Value& telemetry);
+
+    /**
+     * @brief Get latest values of all instances
+     */
+    std::map<std::string, TelemetrySample> latest();
+
+private:
+    BatchCallback _callback;
+    std::chrono::milliseconds _interval{default_interval};
+    std::atomic<bool> _started{false};
+    bool _should_exit = true; // @brief Guarded by _mutex
+    std::thread _worker_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _timer_handle = EventLoop::invalid_handle;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::map<std::string, TelemetrySample> _samples;
+    bool _dirty = false;
+    bool _timer_armed = false; // @brief Event loop timer is pending, guarded by _mutex
+    std::chrono::steady_clock::time_point _last_delivery; // @brief Guarded by _mutex
+
+    /**
+     * @brief Collect changed instances and clear their changed fields. Caller holds _mutex.
+     * @return changed instances
+     */
+    std::map<std::string, TelemetrySample> take_changed();
+
+    /**
+     * @brief Event loop timer, delivers changed instances
+     */
+    void deliver();
+
+    /**
+     * @brief Delivery thread, waits for first change and then for the rest of the interval
+     */
+    void worker();
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline bool TelemetrySample::merge(const Json::Value& telemetry)
+{
+    if (!telemetry.isObject()) {
+        return false;
+    }
+    const uint32_t previous = changed;
+    auto merge_float = [this](const Json::Value& value, Field field, float& current) {
+        if (!value.isNumeric()) {
+            return;
+        }
+        const float updated = value.asFloat();
+        if (!(valid & field) || updated != current) {
+            current = updated;
+            valid |= field;
+            changed |= field;
+        }
+    };
+    for (const auto& name : telemetry.getMemberNames()) {
+        const Json::Value& value = telemetry[name];
+        if (name == json_driver_telemetry_rssi) {
+            merge_float(value, RSSI, rssi);
+        } else if (name == json_driver_telemetry_snr) {
+            merge_float(value, SNR, snr);
+        } else if (name == json_driver_telemetry_soc) {
+            merge_float(value, BATTERY_SOC, battery_soc);
+        } else if (!other.isMember(name) || other[name] != value) {
+            other[name] = value;
+            valid |= OTHER;
+            changed |= OTHER;
+            changed_other.insert(name);
+        }
+    }
+    return changed != previous || !changed_other.empty();
+}
+
+inline Json::Value TelemetrySample::to_json(bool changed_only) const
+{
+    const uint32_t fields = changed_only ? changed : valid;
+    Json::Value telemetry(Json::objectValue);
+    if (fields & RSSI) {
+        telemetry[json_driver_telemetry_rssi] = rssi;
+    }
+    if (fields & SNR) {
+        telemetry[json_driver_telemetry_snr] = snr;
+    }
+    if (fields & BATTERY_SOC) {
+        telemetry[json_driver_telemetry_soc] = battery_soc;
+    }
+    if (fields & OTHER) {
+        for (const auto& name : other.getMemberNames()) {
+            if (!changed_only || changed_other.count(name)) {
+                telemetry[name] = other[name];
+            }
+        }
+    }
+    return telemetry;
+}
+
+inline void TelemetrySample::clear_changed()
+{
+    changed = 0;
+    changed_other.clear();
+}
+
+inline bool TelemetryAggregator::start(BatchCallback callback, std::chrono::milliseconds interval)
+{
+    if (_started.exchange(true)) {
+        return false;
+    }
+    _callback = std::move(callback);
+    _interval = interval;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _should_exit = false;
+        _last_delivery = std::chrono::steady_clock::time_point();
+    }
+    _worker_thread = std::thread(&TelemetryAggregator::worker, this);
+    return true;
+}
+
+inline bool TelemetryAggregator::start(std::shared_ptr<EventLoop> event_loop, BatchCallback callback,
+                                       std::chrono::milliseconds interval)
+{
+    if (_started.exchange(true)) {
+        return false;
+    }
+    _callback = std::move(callback);
+    _interval = interval;
+    _timer_handle = event_loop->add_timer(interval, [this]() { deliver(); }, false);
+    if (_timer_handle == EventLoop::invalid_handle) {
+        _started = false;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _event_loop = std::move(event_loop);
+    // Deliver changes already stored when the timer first expires
+    _timer_armed = true;
+    _last_delivery = std::chrono::steady_clock::time_point();
+    return true;
+}
+
+inline void TelemetryAggregator::stop()
+{
+    if (!_started.exchange(false)) {
+        return;
+    }
+    std::shared_ptr<EventLoop> event_loop;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _should_exit = true;
+        event_loop = std::move(_event_loop);
+    }
+    _cv.notify_one();
+    if (event_loop) {
+        event_loop->remove(_timer_handle);
+        _timer_handle = EventLoop::invalid_handle;
+    }
+    if (_worker_thread.joinable()) {
+        _worker_thread.join();
+    }
+}
+
+inline void TelemetryAggregator::update(const std::string& instance, const Json::Value& telemetry)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_samples[instance].merge(telemetry) || _dirty) {
+        return;
+    }
+    _dirty = true;
+    if (!_event_loop) {
+        lock.unlock();
+        _cv.notify_one();
+        return;
+    }
+    if (!_timer_armed) {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _last_delivery);
+        _timer_armed = true;
+        _event_loop->rearm_timer(_timer_handle, std::max(_interval - elapsed, std::chrono::milliseconds(1)));
+    }
+}
+
+inline std::map<std::string, TelemetrySample> TelemetryAggregator::latest()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _samples;
+}
+
+inline std::map<std::string, TelemetrySample> TelemetryAggregator::take_changed()
+{
+    std::map<std::string, TelemetrySample> changed;
+    for (auto& sample : _samples) {
+        if (sample.second.changed) {
+            changed.emplace(sample.first, sample.second);
+            sample.second.clear_changed();
+        }
+    }
+    _dirty = false;
+    _last_delivery = std::chrono::steady_clock::now();
+    return changed;
+}
+
+inline void TelemetryAggregator::deliver()
+{
+    std::map<std::string, TelemetrySample> changed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _timer_armed = false;
+        if (!_dirty) {
+            return;
+        }
+        changed = take_changed();
+    }
+    _callback(changed);
+}
+
+inline void TelemetryAggregator::worker()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_should_exit) {
+        _cv.wait(lock, [this]() { return _should_exit || _dirty; });
+        if (_should_exit) {
+            break;
+        }
+        // Coalesce further updates until the interval since the previous delivery has passed
+        if (_cv.wait_until(lock, _last_delivery + _interval, [this]() { return _should_exit; })) {
+            break;
+        }
+        auto changed = take_changed();
+        lock.unlock();
+        _callback(changed);
+        lock.lock();
+    }
+}
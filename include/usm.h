@@ -19,12 +19,400 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
 namespace usm {
 
 enum Transition { T_REPEAT, T_NEXT1, T_NEXT2, T_NEXT3, T_NEXT4, T_ERROR };
 
+constexpr size_t transition_count = T_ERROR + 1;
+
+inline std::string to_string(Transition t);
+
+using EventMask = uint32_t;
+
+constexpr EventMask E_ANY = ~EventMask(0);
+
+/**
+ * @brief "Wait for event or deadline" support shared by both state machine variants.
+ *
+ * A state that returns T_REPEAT declares with wait_for() which events it waits on and until when.
+ * wait() then sleeps until one of those events is notified or the deadline passes. A state that does
+ * not declare anything is woken by any event or after max_wait, which matches periodic polling.
+ * Events notified while the state is running are kept, so they are never lost.
+ */
+class EventWait {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Notify events, can be called from any thread
+     * @param events event bits
+     */
+    void notify(EventMask events);
+
+    /**
+     * @brief Declare events and deadline the current state waits on. Called from run_current_state().
+     * @param events event bits
+     * @param deadline wake up at this time even if no event arrives
+     */
+    void wait_for(EventMask events, Clock::time_point deadline = Clock::time_point::max());
+
+    /**
+     * @brief Forget declaration of the previous state. Called before each run_current_state().
+     */
+    void disarm();
+
+    /**
+     * @brief Sleep until a declared event, the declared deadline or max_wait
+     * @param max_wait upper bound for sleeping
+     * @return events that caused the wakeup, 0 on timeout
+     */
+    EventMask wait(Clock::duration max_wait);
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    EventMask _pending = 0;
+    EventMask _mask = E_ANY;
+    Clock::time_point _deadline = Clock::time_point::max();
+};
+
+/**
+ * @brief Single recorded state transition
+ */
+template<typename StateEnum>
+struct TransitionRecord {
+    std::chrono::steady_clock::time_point time; // @brief Time of the transition
+    std::chrono::steady_clock::duration duration; // @brief Time spent in the previous state
+    StateEnum from; // @brief Previous state
+    StateEnum to; // @brief New state
+    Transition transition; // @brief Transition returned by the previous state
+    EventMask events; // @brief Events that woke the previous state last, 0 if it was woken by deadline or did not wait
+};
+
+/**
+ * @brief Latency histogram of time spent in one state
+ */
+struct StateHistogram {
+    static constexpr int64_t bounds_ms[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 60000};
+    static constexpr size_t bucket_count = sizeof(bounds_ms) / sizeof(bounds_ms[0]) + 1; // last bucket is +Inf
+
+    uint64_t buckets[bucket_count] = {};
+    uint64_t count = 0;
+    std::chrono::steady_clock::duration sum{0};
+    std::chrono::steady_clock::duration max{0};
+
+    void add(std::chrono::steady_clock::duration d);
+};
+
+/**
+ * @brief Bounded ring buffer of state transitions with per-state latency histograms.
+ * Recording is done by the state machine thread, export can be called from any thread.
+ */
+template<typename StateEnum>
+class TransitionTrace {
+public:
+    static const size_t default_capacity = 1024;
+
+    explicit TransitionTrace(size_t capacity = default_capacity);
+
+    /**
+     * @brief Record transition, time spent in from state is measured since the previous record
+     */
+    void record(StateEnum from, StateEnum to, Transition t, EventMask events);
+
+    /**
+     * @brief Get recorded transitions, oldest first
+     */
+    std::vector<TransitionRecord<StateEnum>> records() const;
+
+    /**
+     * @brief Get histogram of time spent in state
+     * @return false if state was never left
+     */
+    bool histogram(StateEnum state, StateHistogram& histogram) const;
+
+    /**
+     * @brief Export recorded transitions as Chrome trace-event JSON (chrome://tracing, Perfetto)
+     * @param state_to_string state name conversion
+     * @param name name of the state machine, used as thread name
+     * @return json string
+     */
+    std::string to_chrome_trace(const std::function<std::string(StateEnum)>& state_to_string, const std::string& name) const;
+
+    /**
+     * @brief Export per-state latency histograms in Prometheus text format
+     * @param state_to_string state name conversion
+     * @param metric metric name
+     * @return histogram text
+     */
+    std::string histograms_to_text(const std::function<std::string(StateEnum)>& state_to_string, const std::string& metric) const;
+
+    void clear();
+
+private:
+    mutable std::mutex _mutex;
+    size_t _capacity;
+    size_t _next = 0;
+    std::vector<TransitionRecord<StateEnum>> _records;
+    std::map<StateEnum, StateHistogram> _histograms;
+    std::chrono::steady_clock::time_point _entered = std::chrono::steady_clock::now();
+
+    static std::string escape(const std::string& s);
+};
+
+/**
+ * @brief Single row of a transition table
+ */
+template<typename StateEnum>
+struct TransitionEntry {
+    StateEnum from;
+    Transition transition;
+    StateEnum to;
+};
+
+/**
+ * @brief Dense transition table indexed by (state, transition), built at compile time with make_transition_table().
+ * Pairs that are not mapped fall back to the T_ERROR target of their state, like the default case of USM_MAP.
+ */
+template<typename StateEnum, size_t NumStates>
+struct TransitionTable {
+    StateEnum next[NumStates][transition_count] = {};
+    bool defined[NumStates][transition_count] = {};
+    bool duplicates = false; // set if the same (state, transition) was mapped more than once
+    bool out_of_range = false; // set if an entry uses a state >= NumStates or maps T_REPEAT
+
+    /**
+     * @brief Get next state. T_REPEAT stays in state, unmapped transitions take the T_ERROR transition of state.
+     */
+    constexpr StateEnum lookup(StateEnum state, Transition t) const { return next[static_cast<size_t>(state)][t]; }
+
+    constexpr bool well_formed() const { return !duplicates && !out_of_range; }
+
+    /**
+     * @brief Every state must map T_ERROR, which was the implicit fallback of USM_TABLE
+     */
+    constexpr bool error_transitions_complete() const
+    {
+        for (size_t s = 0; s < NumStates; s++) {
+            if (!defined[s][T_ERROR]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Every state must be reachable from the starting state
+     */
+    constexpr bool all_reachable(StateEnum start) const
+    {
+        bool reached[NumStates] = {};
+        size_t queue[NumStates] = {};
+        size_t head = 0;
+        size_t tail = 0;
+        reached[static_cast<size_t>(start)] = true;
+        queue[tail++] = static_cast<size_t>(start);
+        while (head < tail) {
+            const size_t s = queue[head++];
+            for (size_t t = T_NEXT1; t < transition_count; t++) {
+                if (defined[s][t]) {
+                    const size_t n = static_cast<size_t>(next[s][t]);
+                    if (!reached[n]) {
+                        reached[n] = true;
+                        queue[tail++] = n;
+                    }
+                }
+            }
+        }
+        return tail == NumStates;
+    }
+};
+
+/**
+ * @brief Build transition table from list of entries at compile time
+ * @param entries transition entries
+ * @return dense transition table
+ */
+template<typename StateEnum, size_t NumStates, size_t NumEntries>
+constexpr TransitionTable<StateEnum, NumStates> make_transition_table(const TransitionEntry<StateEnum> (&entries)[NumEntries])
+{
+    TransitionTable<StateEnum, NumStates> table{};
+    for (size_t i = 0; i < NumEntries; i++) {
+        const size_t from = static_cast<size_t>(entries[i].from);
+        const size_t to = static_cast<size_t>(entries[i].to);
+        if (from >= NumStates || to >= NumStates || entries[i].transition == T_REPEAT) {
+            table.out_of_range = true;
+            continue;
+        }
+        if (table.defined[from][entries[i].transition]) {
+            table.duplicates = true;
+        }
+        table.defined[from][entries[i].transition] = true;
+        table.next[from][entries[i].transition] = entries[i].to;
+    }
+    for (size_t s = 0; s < NumStates; s++) {
+        // Without a T_ERROR entry the state stays where it is, error_transitions_complete() reports that
+        const StateEnum fallback = table.defined[s][T_ERROR] ? table.next[s][T_ERROR] : static_cast<StateEnum>(s);
+        table.next[s][T_REPEAT] = static_cast<StateEnum>(s);
+        for (size_t t = T_NEXT1; t < transition_count; t++) {
+            if (!table.defined[s][t]) {
+                table.next[s][t] = fallback;
+            }
+        }
+    }
+    return table;
+}
+
+/**
+ * @brief Current state, stepping, event waiting and transition trace shared by EventStateMachine and
+ * TableStateMachine. Derived only decides how states run and transition:
+ *   Transition dispatch_state(StateEnum current_state);
+ *   StateEnum dispatch_next_state(StateEnum current_state, Transition t);
+ *   void dispatch_transition(StateEnum current_state, StateEnum new_state, Transition t); // also called for T_REPEAT
+ */
+template<typename Derived, typename StateEnum>
+class EventStateMachineBase {
+public:
+    EventStateMachineBase(StateEnum startingState) : _current_state(startingState) {}
+
+    bool iterate_once();
+
+    /**
+     * @brief Run current state and, if it did not transition, sleep until an event it waits on or its deadline
+     * @param max_wait upper bound for sleeping
+     * @return true if state changed
+     */
+    bool iterate_or_wait(std::chrono::steady_clock::duration max_wait);
+
+    StateEnum get_state();
+
+    /**
+     * @brief Notify events, can be called from any thread
+     * @param events event bits
+     */
+    void notify_events(EventMask events) { _events.notify(events); }
+
+    /**
+     * @brief Get recorded transitions and per-state latency histograms
+     */
+    const TransitionTrace<StateEnum>& get_transition_trace() const { return _trace; }
+
+protected:
+    bool _print_repeat_transition = false;
+
+    std::string transition_to_string(Transition t) const { return to_string(t); }
+
+    void state_lock() { _state_mutex.lock(); };
+
+    void state_unlock() { _state_mutex.unlock(); };
+
+    /**
+     * @brief Declare events and deadline the current state waits on before returning T_REPEAT
+     */
+    void wait_for_events(EventMask events, EventWait::Clock::time_point deadline = EventWait::Clock::time_point::max())
+    {
+        _events.wait_for(events, deadline);
+    }
+
+    /**
+     * @brief Forget events and deadline declared by the previous run of a state
+     */
+    void disarm_events() { _events.disarm(); }
+
+    /**
+     * @brief Take events notified since the previous run without sleeping. Used instead of iterate_or_wait() by
+     * state machines stepped by an executor, so the trace still records what woke the state.
+     */
+    void take_events() { _last_events = _events.wait(EventWait::Clock::duration::zero()); }
+
+    /**
+     * @brief Record transition together with the events that last woke the state being left
+     */
+    void record_transition(StateEnum from, StateEnum to, Transition t)
+    {
+        _trace.record(from, to, t, _last_events.exchange(0));
+    }
+
+private:
+    std::mutex _state_mutex;
+    StateEnum _current_state;
+    EventWait _events;
+    std::atomic<EventMask> _last_events{0};
+    TransitionTrace<StateEnum> _trace;
+
+    Derived& derived() { return static_cast<Derived&>(*this); }
+};
+
+/**
+ * @brief State machine driven by a constexpr transition table. Dispatch is resolved at compile time (CRTP),
+ * Derived has to provide:
+ *   Transition run_current_state(StateEnum current_state);
+ *   void on_transition(StateEnum current_state, StateEnum new_state, Transition t); // reset state variables
+ *   void print_transition(StateEnum current_state, StateEnum new_state, Transition t) const;
+ */
+template<typename Derived, typename StateEnum, const auto& Table>
+class TableStateMachine : public EventStateMachineBase<TableStateMachine<Derived, StateEnum, Table>, StateEnum> {
+public:
+    TableStateMachine(StateEnum startingState) : EventStateMachineBase<TableStateMachine, StateEnum>(startingState) {}
+
+private:
+    friend class EventStateMachineBase<TableStateMachine, StateEnum>;
+
+    Derived& derived() { return static_cast<Derived&>(*this); }
+
+    Transition dispatch_state(StateEnum current_state) { return derived().run_current_state(current_state); }
+
+    StateEnum dispatch_next_state(StateEnum current_state, Transition t) { return Table.lookup(current_state, t); }
+
+    void dispatch_transition(StateEnum current_state, StateEnum new_state, Transition t)
+    {
+        if (t != T_REPEAT) {
+            derived().on_transition(current_state, new_state, t);
+        }
+        derived().print_transition(current_state, new_state, t);
+    }
+};
+
+/**
+ * @brief StateMachine with the same virtual interface that can wait for events. StateMachine itself keeps its
+ * layout, classes already built against it are not affected.
+ */
+template<typename StateEnum>
+class EventStateMachine : public EventStateMachineBase<EventStateMachine<StateEnum>, StateEnum> {
+public:
+    EventStateMachine(StateEnum startingState) : EventStateMachineBase<EventStateMachine, StateEnum>(startingState) {}
+
+    virtual ~EventStateMachine() = default;
+
+protected:
+    virtual Transition run_current_state(StateEnum currentState) = 0; // a big switch
+
+    virtual StateEnum choose_next_state(StateEnum currentState, Transition transition) = 0; // nested switches
+
+    virtual void print_transition(StateEnum currentState, StateEnum newState, Transition t) const = 0;
+
+private:
+    friend class EventStateMachineBase<EventStateMachine, StateEnum>;
+
+    Transition dispatch_state(StateEnum current_state) { return run_current_state(current_state); }
+
+    StateEnum dispatch_next_state(StateEnum current_state, Transition t) { return choose_next_state(current_state, t); }
+
+    void dispatch_transition(StateEnum current_state, StateEnum new_state, Transition t) { print_transition(current_state, new_state, t); }
+};
+
 template<typename StateEnum>
 class StateMachine {
 public:
@@ -105,6 +493,231 @@ std::string StateMachine<StateEnum>::transition_to_string(Transition t) const
             return "UNKNOWN";
     }
 }
+
+inline void StateHistogram::add(std::chrono::steady_clock::duration d)
+{
+    size_t i = 0;
+    while (i < bucket_count - 1 && d > std::chrono::milliseconds(bounds_ms[i])) {
+        i++;
+    }
+    buckets[i]++;
+    count++;
+    sum += d;
+    if (d > max) {
+        max = d;
+    }
+}
+
+template<typename StateEnum>
+TransitionTrace<StateEnum>::TransitionTrace(size_t capacity) : _capacity(capacity > 0 ? capacity : 1)
+{}
+
+template<typename StateEnum>
+void TransitionTrace<StateEnum>::record(StateEnum from, StateEnum to, Transition t, EventMask events)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(_mutex);
+    TransitionRecord<StateEnum> r{now, now - _entered, from, to, t, events};
+    _histograms[from].add(r.duration);
+    if (_records.size() < _capacity) {
+        _records.push_back(r);
+    } else {
+        _records[_next] = r;
+    }
+    _next = (_next + 1) % _capacity;
+    _entered = now;
+}
+
+template<typename StateEnum>
+std::vector<TransitionRecord<StateEnum>> TransitionTrace<StateEnum>::records() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_records.size() < _capacity) {
+        return _records;
+    }
+    std::vector<TransitionRecord<StateEnum>> ordered(_records.begin() + _next, _records.end());
+    ordered.insert(ordered.end(), _records.begin(), _records.begin() + _next);
+    return ordered;
+}
+
+template<typename StateEnum>
+bool TransitionTrace<StateEnum>::histogram(StateEnum state, StateHistogram& histogram) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _histograms.find(state);
+    if (it == _histograms.end()) {
+        return false;
+    }
+    histogram = it->second;
+    return true;
+}
+
+template<typename StateEnum>
+std::string TransitionTrace<StateEnum>::to_chrome_trace(const std::function<std::string(StateEnum)>& state_to_string, const std::string& name) const
+{
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+
+    const auto recs = records();
+    std::ostringstream out;
+    out << R"({"traceEvents":[)";
+    out << R"({"name":"thread_name","ph":"M","pid":1,"tid":1,"args":{"name":")" << escape(name) << R"("}})";
+    for (const auto& r : recs) {
+        const auto start = r.time - r.duration;
+        out << R"(,{"name":")" << escape(state_to_string(r.from)) << R"(","cat":"state","ph":"X","pid":1,"tid":1)";
+        out << R"(,"ts":)" << duration_cast<microseconds>(start.time_since_epoch()).count();
+        out << R"(,"dur":)" << duration_cast<microseconds>(r.duration).count();
+        out << R"(,"args":{"transition":")" << to_string(r.transition) << R"(","next":")" << escape(state_to_string(r.to))
+            << R"(","events":)" << r.events << "}}";
+    }
+    out << R"(],"displayTimeUnit":"ms"})";
+    return out.str();
+}
+
+template<typename StateEnum>
+std::string TransitionTrace<StateEnum>::histograms_to_text(
+    const std::function<std::string(StateEnum)>& state_to_string,
+    const std::string& metric) const
+{
+    std::map<StateEnum, StateHistogram> histograms;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        histograms = _histograms;
+    }
+    std::ostringstream out;
+    out << "# TYPE " << metric << " histogram\n";
+    for (const auto& h : histograms) {
+        const std::string label = "state=\"" + escape(state_to_string(h.first)) + "\"";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < StateHistogram::bucket_count; i++) {
+            cumulative += h.second.buckets[i];
+            out << metric << "_bucket{" << label << ",le=\"";
+            if (i < StateHistogram::bucket_count - 1) {
+                out << StateHistogram::bounds_ms[i] / 1000.0;
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << metric << "_sum{" << label << "} " << std::chrono::duration<double>(h.second.sum).count() << "\n";
+        out << metric << "_count{" << label << "} " << h.second.count << "\n";
+    }
+    return out.str();
+}
+
+template<typename StateEnum>
+void TransitionTrace<StateEnum>::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _records.clear();
+    _histograms.clear();
+    _next = 0;
+}
+
+template<typename StateEnum>
+std::string TransitionTrace<StateEnum>::escape(const std::string& s)
+{
+    std::string escaped;
+    escaped.reserve(s.size());
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+inline void EventWait::notify(EventMask events)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending |= events;
+    }
+    _cv.notify_all();
+}
+
+inline void EventWait::wait_for(EventMask events, Clock::time_point deadline)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _mask = events;
+    _deadline = deadline;
+}
+
+inline void EventWait::disarm()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _mask = E_ANY;
+    _deadline = Clock::time_point::max();
+}
+
+inline EventMask EventWait::wait(Clock::duration max_wait)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    const auto now = Clock::now();
+    const auto until = (_deadline - now < max_wait) ? _deadline : now + max_wait;
+    _cv.wait_until(lock, until, [this] { return (_pending & _mask) != 0; });
+    const EventMask fired = _pending & _mask;
+    _pending &= ~fired;
+    return fired;
+}
+
+template<typename Derived, typename StateEnum>
+bool EventStateMachineBase<Derived, StateEnum>::iterate_once()
+{
+    std::lock_guard<std::mutex> lock(_state_mutex);
+    disarm_events();
+    Transition t = derived().dispatch_state(_current_state);
+    if (t != T_REPEAT) {
+        const StateEnum new_state = derived().dispatch_next_state(_current_state, t);
+        derived().dispatch_transition(_current_state, new_state, t);
+        record_transition(_current_state, new_state, t);
+        _current_state = new_state;
+        return true;
+    } else {
+        if (_print_repeat_transition) {
+            derived().dispatch_transition(_current_state, _current_state, t);
+        }
+        return false;
+    }
+}
+
+template<typename Derived, typename StateEnum>
+bool EventStateMachineBase<Derived, StateEnum>::iterate_or_wait(std::chrono::steady_clock::duration max_wait)
+{
+    if (iterate_once()) {
+        return true;
+    }
+    _last_events = _events.wait(max_wait);
+    return false;
+}
+
+template<typename Derived, typename StateEnum>
+StateEnum EventStateMachineBase<Derived, StateEnum>::get_state()
+{
+    std::lock_guard<std::mutex> lock(_state_mutex);
+    return _current_state;
+}
+
+inline std::string to_string(Transition t)
+{
+    switch (t) {
+        case T_REPEAT:
+            return "REPEAT";
+        case T_NEXT1:
+            return "NEXT1";
+        case T_NEXT2:
+            return "NEXT2";
+        case T_NEXT3:
+            return "NEXT3";
+        case T_NEXT4:
+            return "NEXT4";
+        case T_ERROR:
+            return "ERROR";
+        default:
+            return "UNKNOWN";
+    }
+}
 } // namespace usm
 
 /*---------------MACROS TO MAKE TRANSITION TABLES EASY------------------*/
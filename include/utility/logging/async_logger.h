@@ -0,0 +1,353 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file async_logger.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "logging.h"
+
+namespace connection_manager {
+namespace utility {
+namespace logging {
+
+/**
+ * @brief Asynchronous front end for the sink passed to register_logger().
+ *
+ * Logging threads only copy the formatted line into a preallocated slot of a bounded lock-free ring, the sink
+ * is called from the own flush thread or from the event loop. When the ring is full the line is dropped and
+ * counted instead of blocking the caller. A flush requested by the library, e.g. after an error, drains the
+ * ring synchronously so buffered lines are not lost. The library formats every line before it calls the
+ * sink, so formatting still happens on the logging thread.
+ */
+class AsyncLogger {
+public:
+    static constexpr size_t default_capacity = 8192;
+    static constexpr std::chrono::milliseconds default_flush_period{100};
+
+    /**
+     * @brief Logging statistics
+     */
+    struct Statistics {
+        uint64_t logged = 0; // @brief Lines passed to the sink
+        uint64_t dropped = 0; // @brief Lines dropped because the ring was full
+        size_t high_watermark = 0; // @brief Maximum number of lines buffered at once
+    };
+
+    /**
+     * @brief Constructor
+     * @param sink called with every formatted line, only from one thread at a time
+     * @param flush called after a batch of lines was passed to the sink, can be empty
+     * @param capacity ring size, rounded up to a power of two
+     * @param flush_period maximum time a line stays buffered
+     */
+    AsyncLogger(std::function<void(const std::string&)> sink, std::function<void()> flush,
+                size_t capacity = default_capacity, std::chrono::milliseconds flush_period = default_flush_period);
+
+    ~AsyncLogger() { stop(); }
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    /**
+     * @brief Start flush thread and register with the library
+     * @return false if already started
+     */
+    bool start();
+
+    /**
+     * @brief Flush from the event loop and register with the library
+     * @param event_loop event loop hosting the flush timer
+     * @return false if already started or the timer could not be added
+     */
+    bool start(std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Register the sink with the library again, then drain the ring. Lines logged afterwards are passed
+     * to the sink synchronously.
+     */
+    void stop();
+
+    /**
+     * @brief Buffer line, never blocks
+     * @param line formatted line
+     * @return false if the ring was full and the line was dropped
+     */
+    bool log(const std::string& line);
+
+    /**
+     * @brief Pass all buffered lines to the sink and call flush
+     */
+    void flush();
+
+    /**
+     * @brief Get logging statistics
+     * @return current statistics
+     */
+    Statistics get_statistics() const;
+
+private:
+    /**
+     * @brief Ring slot, sequence tells whether the slot is free for the producer at position sequence or holds
+     * the line for the consumer at position sequence - 1
+     */
+    struct Slot {
+        std::atomic<size_t> sequence{0};
+        std::string line; // @brief Keeps its capacity after being consumed, so steady state logging does not allocate
+    };
+
+    std::function<void(const std::string&)> _sink;
+    std::function<void()> _flush;
+    std::chrono::milliseconds _flush_period;
+    std::vector<Slot> _slots;
+    size_t _mask;
+    std::atomic<size_t> _enqueue_position{0};
+    std::atomic<size_t> _dequeue_position{0};
+    std::mutex _consumer_mutex; // @brief Serializes the flush thread, the event loop and flush() as consumers
+    std::atomic<uint64_t> _logged{0};
+    std::atomic<uint64_t> _dropped{0};
+    std::atomic<size_t> _high_watermark{0};
+
+    std::mutex _thread_mutex;
+    std::condition_variable _thread_cv;
+    bool _should_exit = true; // @brief Guarded by _thread_mutex
+    bool _wake = false; // @brief Guarded by _thread_mutex
+    std::thread _flush_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _timer_handle = EventLoop::invalid_handle;
+    EventLoop::Handle _wakeup_handle = EventLoop::invalid_handle;
+    std::atomic<EventLoop*> _wakeup_loop{nullptr}; // @brief Event loop woken by producers, null on own thread
+    std::atomic<bool> _started{false};
+
+    /**
+     * @brief Pass buffered lines to the sink
+     * @return number of lines passed
+     */
+    size_t drain();
+
+    /**
+     * @brief Pass buffered lines to the sink and call flush if there were any
+     */
+    void flush_batch();
+
+    /**
+     * @brief Wake the consumer early, called when the ring gets half full
+     */
+    void wake();
+
+    void flush_thread();
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline AsyncLogger::AsyncLogger(std::function<void(const std::string&)> sink, std::function<void()> flush,
+                                size_t capacity, std::chrono::milliseconds flush_period)
+    : _sink(std::move(sink)), _flush(std::move(flush)), _flush_period(flush_period)
+{
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    _slots = std::vector<Slot>(size);
+    _mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+inline bool AsyncLogger::start()
+{
+    if (_started.exchange(true)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_thread_mutex);
+        _should_exit = false;
+    }
+    _flush_thread = std::thread(&AsyncLogger::flush_thread, this);
+    register_logger([this](const std::string& line) { log(line); }, [this]() { flush(); });
+    return true;
+}
+
+inline bool AsyncLogger::start(std::shared_ptr<EventLoop> event_loop)
+{
+    if (_started.exchange(true)) {
+        return false;
+    }
+    _event_loop = std::move(event_loop);
+    _timer_handle = _event_loop->add_timer(_flush_period, [this]() { flush_batch(); });
+    _wakeup_handle = _event_loop->add_wakeup([this]() { flush_batch(); });
+    if (_timer_handle == EventLoop::invalid_handle || _wakeup_handle == EventLoop::invalid_handle) {
+        _event_loop->remove(_timer_handle);
+        _event_loop->remove(_wakeup_handle);
+        _timer_handle = _wakeup_handle = EventLoop::invalid_handle;
+        _event_loop.reset();
+        _started = false;
+        return false;
+    }
+    _wakeup_loop = _event_loop.get();
+    register_logger([this](const std::string& line) { log(line); }, [this]() { flush(); });
+    return true;
+}
+
+inline void AsyncLogger::stop()
+{
+    if (!_started.exchange(false)) {
+        return;
+    }
+    register_logger(_sink, _flush ? _flush : []() {});
+    if (_event_loop) {
+        _wakeup_loop = nullptr;
+        _event_loop->remove(_timer_handle);
+        _event_loop->remove(_wakeup_handle);
+        _timer_handle = _wakeup_handle = EventLoop::invalid_handle;
+        _event_loop.reset();
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(_thread_mutex);
+            _should_exit = true;
+        }
+        _thread_cv.notify_one();
+        if (_flush_thread.joinable()) {
+            _flush_thread.join();
+        }
+    }
+    flush();
+}
+
+inline bool AsyncLogger::log(const std::string& line)
+{
+    size_t position = _enqueue_position.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &_slots[position & _mask];
+        const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (difference == 0) {
+            if (_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = _enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+    slot->line.assign(line);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    const size_t depth = position + 1 - _dequeue_position.load(std::memory_order_relaxed);
+    size_t high_watermark = _high_watermark.load(std::memory_order_relaxed);
+    while (depth > high_watermark && !_high_watermark.compare_exchange_weak(high_watermark, depth)) {
+    }
+    if (depth == (_mask + 1) / 2) {
+        wake();
+    }
+    return true;
+}
+
+inline void AsyncLogger::flush()
+{
+    drain();
+    if (_flush) {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        _flush();
+    }
+}
+
+inline AsyncLogger::Statistics AsyncLogger::get_statistics() const
+{
+    Statistics statistics;
+    statistics.logged = _logged.load();
+    statistics.dropped = _dropped.load();
+    statistics.high_watermark = _high_watermark.load();
+    return statistics;
+}
+
+inline size_t AsyncLogger::drain()
+{
+    std::lock_guard<std::mutex> lock(_consumer_mutex);
+    size_t count = 0;
+    size_t position = _dequeue_position.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = _slots[position & _mask];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            break;
+        }
+        _sink(slot.line);
+        slot.line.clear();
+        slot.sequence.store(position + _mask + 1, std::memory_order_release);
+        position++;
+        _dequeue_position.store(position, std::memory_order_relaxed);
+        count++;
+    }
+    if (count) {
+        _logged.fetch_add(count, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+inline void AsyncLogger::flush_batch()
+{
+    if (drain() && _flush) {
+        std::lock_guard<std::mutex> lock(_consumer_mutex);
+        _flush();
+    }
+}
+
+inline void AsyncLogger::wake()
+{
+    EventLoop* event_loop = _wakeup_loop.load();
+    if (event_loop) {
+        event_loop->wakeup(_wakeup_handle);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_thread_mutex);
+        _wake = true;
+    }
+    _thread_cv.notify_one();
+}
+
+inline void AsyncLogger::flush_thread()
+{
+    std::unique_lock<std::mutex> lock(_thread_mutex);
+    while (!_should_exit) {
+        _thread_cv.wait_for(lock, _flush_period, [this]() { return _should_exit || _wake; });
+        _wake = false;
+        lock.unlock();
+        flush_batch();
+        lock.lock();
+    }
+}
+
+} // namespace logging
+} // namespace utility
+} // namespace connection_manager
@@ -0,0 +1,708 @@
+/****************************************************************************
+ *
+ *      Copyright (c) 2022, Auterion Ltd. All rights reserved.
+ *
+ * All information contained herein is, and remains the property of
+ * Auterion Ltd. and its suppliers, if any. The intellectual and technical
+ * concepts contained herein are proprietary to Auterion Ltd. and its
+ * suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Reproduction or distribution, in whole or in part, of this information
+ * or reproduction of this material is strictly forbidden unless prior
+ * written permission is obtained from Auterion Ltd.
+ *
+ ****************************************************************************/
+
+/**
+ * @file metrics.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "event_loop.h"
+#include "sockets.h"
+
+namespace connection_manager {
+namespace utility {
+namespace metrics {
+
+/**
+ * @brief Monotonic counter. Updates are single relaxed atomic operations.
+ */
+class Counter {
+public:
+    void inc(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> _value{0};
+};
+
+/**
+ * @brief Value that can go up and down
+ */
+class Gauge {
+public:
+    void set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+
+    void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+
+    int64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> _value{0};
+};
+
+/**
+ * @brief Histogram with fixed bucket bounds in seconds. Sum is kept in microseconds, so updates stay integer atomics.
+ */
+class Histogram {
+public:
+    /**
+     * @brief Constructor
+     * @param bounds ascending upper bucket bounds in seconds, +Inf bucket is added implicitly
+     */
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double seconds);
+
+    void observe(std::chrono::steady_clock::duration d) { observe(std::chrono::duration<double>(d).count()); }
+
+    const std::vector<double>& bounds() const { return _bounds; }
+
+    /**
+     * @brief Get non-cumulative bucket counts, last one is the +Inf bucket
+     */
+    std::vector<uint64_t> buckets() const;
+
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+    double sum() const { return _sum_us.load(std::memory_order_relaxed) / 1e6; }
+
+private:
+    std::vector<double> _bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> _buckets;
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _sum_us{0};
+};
+
+/**
+ * @brief Default latency buckets: 1 ms .. 60 s
+ */
+const std::vector<double>& default_latency_buckets();
+
+/**
+ * @brief Registry of all metrics in the process, exposed in Prometheus text format.
+ *
+ * Registration takes a lock and is done once when a component is created, metric updates never lock.
+ * Metrics with the same name and labels are shared. A name registered with a different metric type gets a
+ * metric that is not exported, so a naming conflict never produces an invalid exposition.
+ *
+ * The exposition is served on a local socket from an own thread or from an EventLoop. Each connection receives
+ * a minimal HTTP response once its request header is complete, so Prometheus and plain socket readers both work.
+ */
+class Registry {
+public:
+    using Labels = std::map<std::string, std::string>;
+
+    Registry() = default;
+
+    ~Registry() { stop(); }
+
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    /**
+     * @brief Get registry shared by the whole process
+     */
+    static Registry& instance();
+
+    std::shared_ptr<Counter> counter(const std::string& name, const std::string& help, const Labels& labels = {});
+
+    std::shared_ptr<Gauge> gauge(const std::string& name, const std::string& help, const Labels& labels = {});
+
+    std::shared_ptr<Histogram> histogram(
+        const std::string& name,
+        const std::string& help,
+        const Labels& labels = {},
+        const std::vector<double>& bounds = default_latency_buckets());
+
+    /**
+     * @brief Serialize all metrics in Prometheus text exposition format 0.0.4
+     */
+    std::string serialize();
+
+    /**
+     * @brief Serve metrics on a local socket from own thread
+     * @param address "unix:/path/to/socket" or "tcp:127.0.0.1:9464". A stale socket at the unix path is replaced,
+     * any other file there makes serving fail.
+     * @return false if socket could not be opened or metrics are already served
+     */
+    bool serve(const std::string& address);
+
+    /**
+     * @brief Serve metrics on a local socket from event loop
+     * @param address "unix:/path/to/socket" or "tcp:127.0.0.1:9464". A stale socket at the unix path is replaced,
+     * any other file there makes serving fail.
+     * @param event_loop event loop hosting the listening and the accepted sockets
+     * @return false if socket could not be opened or metrics are already served
+     */
+    bool serve(const std::string& address, std::shared_ptr<EventLoop> event_loop);
+
+    /**
+     * @brief Stop serving metrics, open connections are closed
+     */
+    void stop();
+
+private:
+    static constexpr std::chrono::milliseconds poll_timeout{100};
+    static constexpr std::chrono::milliseconds client_timeout{5000}; // @brief Connections without complete request are closed
+    static constexpr size_t max_request_size = 8192;
+
+    /**
+     * @brief Registered metric family member
+     */
+    struct Entry {
+        std::string help; // @brief Metric help text
+        Labels labels; // @brief Metric labels
+        std::shared_ptr<Counter> counter; // @brief Set for counters
+        std::shared_ptr<Gauge> gauge; // @brief Set for gauges
+        std::shared_ptr<Histogram> histogram; // @brief Set for histograms
+    };
+
+    /**
+     * @brief Accepted connection waiting for its request
+     */
+    struct Client {
+        std::string request; // @brief Request received so far
+        std::chrono::steady_clock::time_point accepted; // @brief Accept time, for client_timeout
+        EventLoop::Handle handle = EventLoop::invalid_handle; // @brief Event loop registration
+    };
+
+    std::mutex _mutex;
+    std::multimap<std::string, Entry> _entries;
+
+    SOCKET _server_sock = INVALID_SOCKET;
+    std::string _unix_path; // @brief Socket file removed on stop
+    std::atomic<bool> _should_exit{true};
+    std::thread _server_thread;
+    std::shared_ptr<EventLoop> _event_loop;
+    EventLoop::Handle _server_handle = EventLoop::invalid_handle;
+    EventLoop::Handle _expire_timer = EventLoop::invalid_handle;
+    std::mutex _clients_mutex; // @brief Guards _clients between serving thread or event loop and stop()
+    std::map<SOCKET, Client> _clients;
+
+    /**
+     * @brief Find entry of metric or create it
+     * @param name metric name
+     * @param help metric help text
+     * @param labels metric labels
+     * @param create creates metric of entry, called for new entries only
+     * @param matches checks if entry holds metric of the requested type
+     * @return entry or nullptr if name is registered with a different type
+     */
+    template<typename Create, typename Matches>
+    Entry* find_or_create(const std::string& name, const std::string& help, const Labels& labels, Create create, Matches matches);
+
+    /**
+     * @brief Open listening socket
+     * @param address "unix:/path/to/socket" or "tcp:127.0.0.1:9464"
+     * @return true if listening
+     */
+    bool open_server(const std::string& address);
+
+    /**
+     * @brief Server thread, polls listening and accepted sockets
+     */
+    void server_worker();
+
+    /**
+     * @brief Accept pending connections
+     */
+    void accept_clients();
+
+    /**
+     * @brief Read request of client and answer it once complete
+     * @param sock client socket
+     */
+    void read_client(SOCKET sock);
+
+    /**
+     * @brief Close client connection, called with _clients_mutex held
+     * @param sock client socket
+     */
+    void close_client(SOCKET sock);
+
+    /**
+     * @brief Close connections older than client_timeout
+     */
+    void expire_clients();
+
+    static std::string format_labels(const Labels& labels, const std::string& extra = "");
+
+    static std::string escape(const std::string& s, bool quote);
+};
+
+/*---------------IMPLEMENTATION------------------*/
+
+inline Histogram::Histogram(std::vector<double> bounds) : _bounds(std::move(bounds))
+{
+    std::sort(_bounds.begin(), _bounds.end());
+    _bounds.erase(std::unique(_bounds.begin(), _bounds.end()), _bounds.end());
+    _buckets.reset(new std::atomic<uint64_t>[_bounds.size() + 1]);
+    for (size_t i = 0; i <= _bounds.size(); i++) {
+        _buckets[i] = 0;
+    }
+}
+
+inline void Histogram::observe(double seconds)
+{
+    // Bucket i counts observations <= bounds[i], the last one is +Inf
+    const size_t i = static_cast<size_t>(std::lower_bound(_bounds.begin(), _bounds.end(), seconds) - _bounds.begin());
+    _buckets[i].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum_us.fetch_add(seconds > 0 ? static_cast<uint64_t>(seconds * 1e6) : 0, std::memory_order_relaxed);
+}
+
+inline std::vector<uint64_t> Histogram::buckets() const
+{
+    std::vector<uint64_t> counts(_bounds.size() + 1);
+    for (size_t i = 0; i < counts.size(); i++) {
+        counts[i] = _buckets[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+inline const std::vector<double>& default_latency_buckets()
+{
+    static const std::vector<double> buckets = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 60};
+    return buckets;
+}
+
+inline Registry& Registry::instance()
+{
+    static Registry registry;
+    return registry;
+}
+
+template<typename Create, typename Matches>
+Registry::Entry* Registry::find_or_create(const std::string& name, const std::string& help, const Labels& labels, Create create, Matches matches)
+{
+    auto range = _entries.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (!matches(it->second)) {
+            return nullptr;
+        }
+        if (it->second.labels == labels) {
+            return &it->second;
+        }
+    }
+    auto it = _entries.emplace(name, Entry{help, labels, nullptr, nullptr, nullptr});
+    create(it->second);
+    return &it->second;
+}
+
+inline std::shared_ptr<Counter> Registry::counter(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Entry* entry = find_or_create(
+        name, help, labels, [](Entry& e) { e.counter = std::make_shared<Counter>(); }, [](const Entry& e) { return e.counter != nullptr; });
+    return entry ? entry->counter : std::make_shared<Counter>();
+}
+
+inline std::shared_ptr<Gauge> Registry::gauge(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Entry* entry = find_or_create(
+        name, help, labels, [](Entry& e) { e.gauge = std::make_shared<Gauge>(); }, [](const Entry& e) { return e.gauge != nullptr; });
+    return entry ? entry->gauge : std::make_shared<Gauge>();
+}
+
+inline std::shared_ptr<Histogram> Registry::histogram(
+    const std::string& name,
+    const std::string& help,
+    const Labels& labels,
+    const std::vector<double>& bounds)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Entry* entry = find_or_create(
+        name, help, labels, [&bounds](Entry& e) { e.histogram = std::make_shared<Histogram>(bounds); },
+        [](const Entry& e) { return e.histogram != nullptr; });
+    return entry ? entry->histogram : std::make_shared<Histogram>(bounds);
+}
+
+inline std::string Registry::serialize()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ostringstream out;
+    for (auto it = _entries.begin(); it != _entries.end(); it = _entries.upper_bound(it->first)) {
+        const std::string& name = it->first;
+        const Entry& first = it->second;
+        const char* type = first.counter ? "counter" : first.gauge ? "gauge" : "histogram";
+        out << "# HELP " << name << " " << escape(first.help, false) << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+        auto range = _entries.equal_range(name);
+        for (auto e = range.first; e != range.second; ++e) {
+            const Entry& entry = e->second;
+            if (entry.counter) {
+                out << name << format_labels(entry.labels) << " " << entry.counter->value() << "\n";
+            } else if (entry.gauge) {
+                out << name << format_labels(entry.labels) << " " << entry.gauge->value() << "\n";
+            } else {
+                const auto counts = entry.histogram->buckets();
+                const auto& bounds = entry.histogram->bounds();
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < counts.size(); i++) {
+                    cumulative += counts[i];
+                    std::ostringstream le;
+                    if (i < bounds.size()) {
+                        le << bounds[i];
+                    } else {
+                        le << "+Inf";
+                    }
+                    out << name << "_bucket" << format_labels(entry.labels, "le=\"" + le.str() + "\"") << " " << cumulative << "\n";
+                }
+                out << name << "_sum" << format_labels(entry.labels) << " " << entry.histogram->sum() << "\n";
+                out << name << "_count" << format_labels(entry.labels) << " " << entry.histogram->count() << "\n";
+            }
+        }
+    }
+    return out.str();
+}
+
+inline bool Registry::serve(const std::string& address)
+{
+    if (!open_server(address)) {
+        return false;
+    }
+    _should_exit = false;
+    _server_thread = std::thread(&Registry::server_worker, this);
+    return true;
+}
+
+inline bool Registry::serve(const std::string& address, std::shared_ptr<EventLoop> event_loop)
+{
+    if (!event_loop || !open_server(address)) {
+        return false;
+    }
+    _should_exit = false;
+    _event_loop = event_loop;
+    _server_handle = _event_loop->add_socket(_server_sock, [this] { accept_clients(); });
+    _expire_timer = _event_loop->add_timer(client_timeout, [this] { expire_clients(); });
+    if (_server_handle == EventLoop::invalid_handle || _expire_timer == EventLoop::invalid_handle) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+inline void Registry::stop()
+{
+    _should_exit = true;
+    if (_server_thread.joinable()) {
+        _server_thread.join();
+    }
+    if (_event_loop) {
+        // No new clients are accepted once the server socket is removed, then wait for running client callbacks
+        _event_loop->remove(_server_handle);
+        _event_loop->remove(_expire_timer);
+        _server_handle = EventLoop::invalid_handle;
+        _expire_timer = EventLoop::invalid_handle;
+        std::vector<EventLoop::Handle> handles;
+        {
+            std::lock_guard<std::mutex> lock(_clients_mutex);
+            for (const auto& client : _clients) {
+                handles.push_back(client.second.handle);
+            }
+        }
+        for (auto handle : handles) {
+            _event_loop->remove(handle);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(_clients_mutex);
+        while (!_clients.empty()) {
+            close_client(_clients.begin()->first);
+        }
+    }
+    _event_loop.reset();
+    if (_server_sock != INVALID_SOCKET) {
+        closesocket(_server_sock);
+        _server_sock = INVALID_SOCKET;
+    }
+#ifdef __linux__
+    if (!_unix_path.empty()) {
+        unlink(_unix_path.c_str());
+        _unix_path.clear();
+    }
+#endif
+}
+
+inline bool Registry::open_server(const std::string& address)
+{
+#ifdef __linux__
+    if (_server_sock != INVALID_SOCKET) {
+        return false;
+    }
+    const std::string unix_prefix = "unix:";
+    const std::string tcp_prefix = "tcp:";
+    if (address.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+        sockaddr_un local{};
+        const std::string path = address.substr(unix_prefix.size());
+        if (path.empty() || path.size() >= sizeof(local.sun_path)) {
+            return false;
+        }
+        local.sun_family = AF_UNIX;
+        std::memcpy(local.sun_path, path.c_str(), path.size());
+        _server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_server_sock == INVALID_SOCKET) {
+            return false;
+        }
+        // Socket file left behind by a previous process would make bind fail, anything else at the path is kept
+        struct stat status;
+        if (lstat(path.c_str(), &status) == 0) {
+            if (!S_ISSOCK(status.st_mode)) {
+                closesocket(_server_sock);
+                _server_sock = INVALID_SOCKET;
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        if (bind(_server_sock, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+            closesocket(_server_sock);
+            _server_sock = INVALID_SOCKET;
+            return false;
+        }
+        _unix_path = path;
+    } else if (address.compare(0, tcp_prefix.size(), tcp_prefix) == 0) {
+        const std::string host_port = address.substr(tcp_prefix.size());
+        const size_t colon = host_port.rfind(':');
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        if (colon == std::string::npos || inet_pton(AF_INET, host_port.substr(0, colon).c_str(), &local.sin_addr) != 1) {
+            return false;
+        }
+        char* end = nullptr;
+        const unsigned long port = std::strtoul(host_port.c_str() + colon + 1, &end, 10);
+        if (end == host_port.c_str() + colon + 1 || *end != '\0' || port > 65535) {
+            return false;
+        }
+        local.sin_port = htons(static_cast<uint16_t>(port));
+        _server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_server_sock == INVALID_SOCKET) {
+            return false;
+        }
+        int enable = 1;
+        setsockopt(_server_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        if (bind(_server_sock, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+            closesocket(_server_sock);
+            _server_sock = INVALID_SOCKET;
+            return false;
+        }
+    } else {
+        return false;
+    }
+    fcntl(_server_sock, F_SETFL, fcntl(_server_sock, F_GETFL, 0) | O_NONBLOCK);
+    if (listen(_server_sock, 8) != 0) {
+        stop();
+        return false;
+    }
+    return true;
+#else
+    (void)address;
+    return false;
+#endif
+}
+
+inline void Registry::server_worker()
+{
+#ifdef __linux__
+    while (!_should_exit) {
+        std::vector<pollfd> fds;
+        fds.push_back({_server_sock, POLLIN, 0});
+        {
+            std::lock_guard<std::mutex> lock(_clients_mutex);
+            for (const auto& client : _clients) {
+                fds.push_back({client.first, POLLIN, 0});
+            }
+        }
+        if (poll(fds.data(), fds.size(), static_cast<int>(poll_timeout.count())) > 0) {
+            for (size_t i = 1; i < fds.size(); i++) {
+                if (fds[i].revents != 0) {
+                    read_client(fds[i].fd);
+                }
+            }
+            if (fds[0].revents != 0) {
+                accept_clients();
+            }
+        }
+        expire_clients();
+    }
+#endif
+}
+
+inline void Registry::accept_clients()
+{
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(_clients_mutex);
+    for (;;) {
+        const SOCKET sock = accept4(_server_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == INVALID_SOCKET) {
+            break;
+        }
+        Client& client = _clients[sock];
+        client.accepted = std::chrono::steady_clock::now();
+        if (_event_loop) {
+            client.handle = _event_loop->add_socket(sock, [this, sock] { read_client(sock); });
+            if (client.handle == EventLoop::invalid_handle) {
+                close_client(sock);
+            }
+        }
+    }
+#endif
+}
+
+inline void Registry::read_client(SOCKET sock)
+{
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(_clients_mutex);
+    auto it = _clients.find(sock);
+    if (it == _clients.end()) {
+        return;
+    }
+    char buffer[1024];
+    bool peer_closed = false;
+    for (;;) {
+        const ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            it->second.request.append(buffer, static_cast<size_t>(received));
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (received < 0) {
+            close_client(sock);
+            return;
+        }
+        peer_closed = true;
+        break;
+    }
+    const std::string& request = it->second.request;
+    const bool complete = request.find("\r\n\r\n") != std::string::npos || request.find("\n\n") != std::string::npos;
+    // A reader that half-closes without sending a request still gets the metrics
+    if (!complete && !peer_closed && request.size() < max_request_size) {
+        return;
+    }
+    const std::string body = serialize();
+    const std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                 std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    // Local peer, the response normally fits into the socket buffer. The rest is dropped for a peer that does
+    // not read, so the serving thread is never blocked for longer than poll_timeout.
+    size_t sent = 0;
+    while (sent < response.size()) {
+        pollfd fd{sock, POLLOUT, 0};
+        if (poll(&fd, 1, static_cast<int>(poll_timeout.count())) <= 0) {
+            break;
+        }
+        const ssize_t res = send(sock, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (res <= 0) {
+            break;
+        }
+        sent += static_cast<size_t>(res);
+    }
+    shutdown(sock, SHUT_WR);
+    close_client(sock);
+#else
+    (void)sock;
+#endif
+}
+
+inline void Registry::close_client(SOCKET sock)
+{
+    auto it = _clients.find(sock);
+    if (it == _clients.end()) {
+        return;
+    }
+    if (_event_loop && it->second.handle != EventLoop::invalid_handle) {
+        _event_loop->remove(it->second.handle);
+    }
+    _clients.erase(it);
+    closesocket(sock);
+}
+
+inline void Registry::expire_clients()
+{
+    std::lock_guard<std::mutex> lock(_clients_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = _clients.begin(); it != _clients.end();) {
+        const SOCKET sock = it->first;
+        const bool expired = now - it->second.accepted > client_timeout;
+        ++it;
+        if (expired) {
+            close_client(sock);
+        }
+    }
+}
+
+inline std::string Registry::format_labels(const Labels& labels, const std::string& extra)
+{
+    if (labels.empty() && extra.empty()) {
+        return "";
+    }
+    std::string text = "{";
+    for (const auto& label : labels) {
+        if (text.size() > 1) {
+            text += ",";
+        }
+        text += label.first + "=\"" + escape(label.second, true) + "\"";
+    }
+    if (!extra.empty()) {
+        text += (text.size() > 1 ? "," : "") + extra;
+    }
+    return text + "}";
+}
+
+inline std::string Registry::escape(const std::string& s, bool quote)
+{
+    std::string escaped;
+    escaped.reserve(s.size());
+    for (char c : s) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else if (c == '"' && quote) {
+            escaped += "\\\"";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+} // namespace metrics
+} // namespace utility
+} // namespace connection_manager
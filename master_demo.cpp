@@ -37,15 +37,19 @@
  * @author Matej Frančeškin (Matej@auterion.com)
  */
 
+#include <cmath>
 #include <condition_variable>
 #include <iomanip>
 #include <iostream>
 #include <thread>
 
 #include "connection_manager_master.h"
+#include "interface_monitor.h"
 #include "json.h"
+#include "telemetry.h"
 #include "utility/logging/logging_internal.h"
 #include "util.h"
+#include "utility/metrics/metrics.h"
 
 const std::string config_begin = ""
                                  R"({                                           )"
@@ -247,6 +251,27 @@ static void display_help()
     std::cout << "x  - exit" << std::endl;
 }
 
+/**
+ * @brief Export latest driver telemetry as per instance gauges, rounded to integers
+ */
+static void export_telemetry(const std::map<std::string, TelemetrySample>& samples)
+{
+    auto& registry = connection_manager::utility::metrics::Registry::instance();
+    for (const auto& s : samples) {
+        const connection_manager::utility::metrics::Registry::Labels labels = {{"instance", s.first}};
+        if (s.second.valid & TelemetrySample::RSSI) {
+            registry.gauge("cm_demo_driver_rssi_dbm", "Last RSSI reported by the driver", labels)->set(std::lround(s.second.rssi));
+        }
+        if (s.second.valid & TelemetrySample::SNR) {
+            registry.gauge("cm_demo_driver_snr_db", "Last SNR reported by the driver", labels)->set(std::lround(s.second.snr));
+        }
+        if (s.second.valid & TelemetrySample::BATTERY_SOC) {
+            registry.gauge("cm_demo_driver_battery_soc_percent", "Last battery state of charge reported by the driver", labels)
+                ->set(std::lround(s.second.battery_soc));
+        }
+    }
+}
+
 static bool find_in_argv(const std::string& s, int argc, char* argv[])
 {
     for (int i = 1; i < argc; i++) {
@@ -263,6 +288,7 @@ int main(int argc, char* argv[])
 {
     spdlog::cfg::load_env_levels();
 
+    TelemetryAggregator telemetry_aggregator;
     ConnectionManagerMaster connection_manager;
 
     SPDLOG_INFO("Starting connection manager master");
@@ -273,6 +299,7 @@ int main(int argc, char* argv[])
     bool driver_usb_c = find_in_argv("usbc", argc, argv);
     bool driver_doodle_labs = find_in_argv("doodlelabs", argc, argv);
     bool driver_zerotier = find_in_argv("zerotier", argc, argv);
+    bool serve_metrics = find_in_argv("metrics", argc, argv);
     bool first = true;
     std::string config = config_begin;
     if (driver_microhard) {
@@ -324,27 +351,47 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    // Exposed with "metrics" next to the in-repo component metrics, the library itself does not export any
+    auto& metrics_registry = connection_manager::utility::metrics::Registry::instance();
+    const std::string list_changes_help = "Changes of the connection manager remote lists";
+    auto pairing_list_changes = metrics_registry.counter("cm_demo_list_changes_total", list_changes_help, {{"list", "pairing"}});
+    auto paired_list_changes = metrics_registry.counter("cm_demo_list_changes_total", list_changes_help, {{"list", "paired"}});
+    auto connected_list_changes = metrics_registry.counter("cm_demo_list_changes_total", list_changes_help, {{"list", "connected"}});
+    auto status_code = metrics_registry.gauge("cm_demo_status_code", "Last reported connection manager status code");
+    auto interface_events = metrics_registry.counter("cm_demo_interface_events_total", "Network interface link and address changes");
+
     connection_manager.register_pairing_list_changed_callback([&]() {
+        pairing_list_changes->inc();
         std::cout << "***** pairing list changed" << std::endl;
         display_lists(connection_manager);
     });
 
     connection_manager.register_paired_list_changed_callback([&]() {
+        paired_list_changes->inc();
         std::cout << "***** paired list changed" << std::endl;
         display_lists(connection_manager);
     });
 
     connection_manager.register_connected_list_changed_callback([&]() {
+        connected_list_changes->inc();
         std::cout << "***** connected list changed" << std::endl;
         display_lists(connection_manager);
     });
 
-    connection_manager.register_telemetry_callback([](const std::string& instance, const Json::Value& data) {
-        const std::string output = json_to_string(data);
-        std::cout << "***** " << instance << " Telemetry data: " << std::endl << output << std::endl;
+    telemetry_aggregator.start([](const std::map<std::string, TelemetrySample>& samples) {
+        export_telemetry(samples);
+        for (const auto& s : samples) {
+            const std::string output = json_to_string(s.second.to_json(true));
+            std::cout << "***** " << s.first << " Telemetry data: " << std::endl << output << std::endl;
+        }
+    });
+
+    connection_manager.register_telemetry_callback([&](const std::string& instance, const Json::Value& data) {
+        telemetry_aggregator.update(instance, data);
     });
 
-    connection_manager.register_status_callback([](ConnectionStatus status) {
+    connection_manager.register_status_callback([status_code](ConnectionStatus status) {
+        status_code->set(static_cast<int64_t>(status.code));
         std::cout << "***** Status = " << static_cast<int>(status.code) << " " << status.context << std::endl;
     });
 
@@ -353,6 +400,18 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    if (serve_metrics && !connection_manager::utility::metrics::Registry::instance().serve("tcp:127.0.0.1:9464")) {
+        SPDLOG_WARN("Could not serve metrics on 127.0.0.1:9464");
+    }
+
+    InterfaceMonitor interface_monitor;
+    interface_monitor.start([interface_events](const InterfaceEvent& event) {
+        interface_events->inc();
+        static const char* types[] = {"link up", "link down", "address added", "address removed"};
+        std::cout << "***** Interface " << event.interface_name << " " << types[static_cast<int>(event.type)] << " "
+                  << event.address << std::endl;
+    });
+
     display_help();
 
     bool run = true;